@@ -0,0 +1,102 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Reports GB/s and comparisons/s of the distance kernels for each instruction set the CPU supports,
+ * and fails if a kernel disagrees with the scalar implementation.
+ * Sizes are deliberately not multiples of the vector widths so the tails are covered.
+ *
+ * $ distance_kernels_benchmark [vectors] [repetitions]
+ */
+
+#include <QElapsedTimer>
+#include <QVector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <openbr/core/distance_sse.h>
+
+static const int Bytes = 1000; // uchar kernels
+static const int Floats = 257; // float kernels
+
+enum Kernel { ByteL1, PackedL1, Hamming, FloatL1, FloatL2, Dot, Kernels };
+static const char *KernelNames[] = { "l1(uchar)", "packed_l1", "hamming", "l1(float)", "l2", "dot" };
+
+static float compare(Kernel kernel, const uchar *bytes, const float *floats, int i)
+{
+    switch (kernel) {
+      case ByteL1:   return l1(bytes, bytes + (i+1)*Bytes, Bytes);
+      case PackedL1: return packed_l1(bytes, bytes + (i+1)*Bytes, Bytes);
+      case Hamming:  return hamming(bytes, bytes + (i+1)*Bytes, Bytes);
+      case FloatL1:  return l1(floats, floats + (i+1)*Floats, Floats);
+      case FloatL2:  return l2(floats, floats + (i+1)*Floats, Floats);
+      default:       return dot(floats, floats + (i+1)*Floats, Floats);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const int vectors = argc > 1 ? atoi(argv[1]) : 4096;
+    const int repetitions = argc > 2 ? atoi(argv[2]) : 20;
+
+    // The first vector is the query, compared against every other vector
+    srand(0);
+    QVector<uchar> bytes((vectors+1) * Bytes);
+    QVector<float> floats((vectors+1) * Floats);
+    for (int i=0; i<bytes.size(); i++) bytes[i] = uchar(rand());
+    for (int i=0; i<floats.size(); i++) floats[i] = float(rand()) / RAND_MAX - 0.5f;
+
+    QVector< QVector<float> > reference(Kernels);
+    bool agree = true;
+
+    printf("isa,kernel,comparisons/s,GB/s\n");
+    foreach (const QString &isa, distanceISAs()) {
+        setDistanceISA(isa);
+        for (int k=0; k<Kernels; k++) {
+            const Kernel kernel = Kernel(k);
+            QVector<float> scores(vectors);
+            QElapsedTimer timer;
+            timer.start();
+            for (int r=0; r<repetitions; r++)
+                for (int i=0; i<vectors; i++)
+                    scores[i] = compare(kernel, bytes.constData(), floats.constData(), i);
+            const double seconds = std::max(timer.nsecsElapsed(), qint64(1)) / 1e9;
+
+            if (reference[k].isEmpty()) {
+                reference[k] = scores;
+            } else {
+                // Vectorized float sums associate differently, integer kernels must match exactly
+                for (int i=0; i<vectors; i++) {
+                    const float tolerance = (kernel >= FloatL1) ? 1e-4f * std::max(1.f, std::fabs(reference[k][i])) : 0;
+                    if (std::fabs(scores[i] - reference[k][i]) > tolerance) {
+                        fprintf(stderr, "%s %s disagrees with Scalar for vector %d: %f != %f\n",
+                                qPrintable(isa), KernelNames[k], i, scores[i], reference[k][i]);
+                        agree = false;
+                        break;
+                    }
+                }
+            }
+
+            const double comparisons = double(vectors) * repetitions;
+            const double bytesRead = comparisons * ((kernel >= FloatL1) ? Floats * sizeof(float) : Bytes);
+            printf("%s,%s,%.0f,%.2f\n", qPrintable(isa), KernelNames[k], comparisons / seconds, bytesRead / seconds / 1e9);
+        }
+    }
+
+    setDistanceISA(distanceISAs().last());
+    return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}
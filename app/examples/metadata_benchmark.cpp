@@ -0,0 +1,129 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Reports the per-template cost of the metadata a gallery, ProgressCounter and Stream touch on every hop,
+ * before (a QVariantMap, as br::File used to store it) and after (br::File), then the cost of string key
+ * lookups at 1 to 16 threads.
+ * Fails if the two representations disagree.
+ *
+ * $ metadata_benchmark [templates]
+ */
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QThreadPool>
+#include <QVariantMap>
+#include <QtConcurrent>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <openbr/openbr_plugin.h>
+
+static double elapsed(const QElapsedTimer &timer, int templates)
+{
+    return std::max(timer.nsecsElapsed(), qint64(1)) / double(templates);
+}
+
+// The QVariantMap baseline
+static qint64 mapHops(int templates)
+{
+    qint64 checksum = 0;
+    for (int i=0; i<templates; i++) {
+        QVariantMap metadata;
+        metadata.insert("FrameNumber", i);
+        metadata.insert("progress", i);
+        metadata.insert("Label", i % 7);
+        metadata.insert("Subject", i % 11);
+
+        const QVariantMap copy = metadata; // Handed to the next stage
+        checksum += copy.value("Label").toInt() + copy.value("progress").toInt() + copy.value("Subject").toInt();
+        if (copy.contains("Rects"))
+            checksum++;
+    }
+    return checksum;
+}
+
+static qint64 fileHops(int templates)
+{
+    qint64 checksum = 0;
+    for (int i=0; i<templates; i++) {
+        br::File file;
+        file.set(br::Metadata::FrameNumber, i);
+        file.set(br::Metadata::Progress, i);
+        file.set(br::Metadata::Label, i % 7);
+        file.set("Subject", i % 11);
+
+        const br::File copy = file; // Handed to the next stage
+        checksum += copy.get<int>(br::Metadata::Label) + copy.get<int>(br::Metadata::Progress) + copy.get<int>("Subject");
+        if (copy.contains(br::Metadata::Rects))
+            checksum++;
+    }
+    return checksum;
+}
+
+static qint64 lookups(const br::File &file, int templates)
+{
+    qint64 checksum = 0;
+    for (int i=0; i<templates; i++)
+        checksum += file.get<int>("Subject");
+    return checksum;
+}
+
+int main(int argc, char *argv[])
+{
+    br::Context::initialize(argc, argv);
+    const int templates = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    QElapsedTimer timer;
+    timer.start();
+    const qint64 before = mapHops(templates);
+    const double mapCost = elapsed(timer, templates);
+
+    timer.start();
+    const qint64 after = fileHops(templates);
+    const double fileCost = elapsed(timer, templates);
+
+    printf("representation,ns/template\n");
+    printf("QVariantMap,%.1f\n", mapCost);
+    printf("br::File,%.1f\n", fileCost);
+    bool agree = (before == after);
+    if (!agree)
+        fprintf(stderr, "Checksums differ: %lld before, %lld after\n", (long long)before, (long long)after);
+
+    // Every thread looks up the same interned key, which must not serialize them
+    br::File file;
+    file.set("Subject", 1);
+    printf("threads,ns/lookup\n");
+    for (int threads=1; threads<=16; threads*=2) {
+        QThreadPool::globalInstance()->setMaxThreadCount(threads);
+        QList< QFuture<qint64> > futures;
+        timer.start();
+        for (int i=0; i<threads; i++)
+            futures.append(QtConcurrent::run(lookups, file, templates));
+        qint64 found = 0;
+        foreach (const QFuture<qint64> &future, futures)
+            found += future.result();
+        printf("%d,%.1f\n", threads, elapsed(timer, templates));
+        if (found != qint64(threads) * templates) {
+            fprintf(stderr, "%d threads found %lld of %lld keys\n", threads, (long long)found, (long long)threads * templates);
+            agree = false;
+        }
+    }
+
+    br::Context::finalize();
+    return agree ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,73 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Reports frames/s through a Stream of trivial transforms at 1 to 64 threads, so the cost measured is
+ * the hand-off between stages rather than the work done in them.
+ * Fails if a frame is lost or delivered twice.
+ *
+ * $ stream_benchmark [frames] [batchSize]
+ */
+
+#include <QElapsedTimer>
+#include <QSet>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <openbr/openbr_plugin.h>
+
+int main(int argc, char *argv[])
+{
+    const int frames = argc > 1 ? atoi(argv[1]) : 20000;
+    const int batchSize = argc > 2 ? atoi(argv[2]) : 1;
+    const QString algorithm = QString("Stream(Identity+Identity+Identity,batchSize=%1)").arg(batchSize);
+    bool delivered = true;
+
+    printf("threads,frames/s\n");
+    for (int threads=1; threads<=64; threads*=2) {
+        // The scheduler is sized when it is created, so each thread count gets a fresh context
+        br::Context::initialize(argc, argv);
+        br::Globals->setProperty("parallelism", QString::number(threads));
+
+        // Frames are read from a gallery held in memory
+        const br::File gallery("stream_benchmark.mem");
+        QScopedPointer<br::Gallery> output(br::Gallery::make(gallery));
+        for (int i=0; i<frames; i++)
+            output->write(br::Template(br::File(QString::number(i)), cv::Mat(8, 8, CV_8UC1, cv::Scalar(i % 256))));
+
+        QScopedPointer<br::Transform> stream(br::Transform::make(algorithm, NULL));
+        br::TemplateList src, dst;
+        src.append(br::Template(gallery));
+
+        QElapsedTimer timer;
+        timer.start();
+        stream->projectUpdate(src, dst);
+        const double seconds = std::max(timer.nsecsElapsed(), qint64(1)) / 1e9;
+
+        QSet<QString> names;
+        foreach (const br::Template &t, dst)
+            names.insert(t.file.name);
+        if ((dst.size() != frames) || (names.size() != frames)) {
+            fprintf(stderr, "%d threads delivered %d frames, %d distinct, expected %d\n", threads, dst.size(), names.size(), frames);
+            delivered = false;
+        }
+
+        printf("%d,%.0f\n", threads, frames / seconds);
+        br::Context::finalize();
+    }
+
+    return delivered ? EXIT_SUCCESS : EXIT_FAILURE;
+}
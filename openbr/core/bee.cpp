@@ -128,67 +128,95 @@ void writeSigset(const QString &sigset, const FileList &files, bool ignoreMetada
     QtUtils::writeFile(sigset, lines);
 }
 
-Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+MatrixReader::MatrixReader(const File &matrix)
+    : file(matrix.name), data(NULL), position(0)
 {
-    QFile file(matrix);
     bool success = file.open(QFile::ReadOnly);
     if (!success) qFatal("Unable to open %s for reading.", qPrintable(matrix.name));
 
     // Check format
     QByteArray format = file.readLine();
-    bool isDistance = (format[0] == 'D');
+    const bool isDistance = (format[0] == 'D');
     if (format[1] != '2') qFatal("Invalid matrix header.");
+    negate = isDistance ^ matrix.get<bool>("negate", false);
 
     // Read sigsets
-    if (targetSigset != NULL) *targetSigset = file.readLine().simplified();
-    else                      file.readLine();
-    if (querySigset != NULL) *querySigset = file.readLine().simplified();
-    else                     file.readLine();
+    targetSigset = file.readLine().simplified();
+    querySigset = file.readLine().simplified();
 
     // Get matrix size
     const QStringList words = QString(file.readLine()).split(" ");
-    const int rows = words[1].toInt();
-    const int cols = words[2].toInt();
-    const bool isMask = words[0][1] == 'B';
-    const int typeSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
+    rows = words[1].toInt();
+    cols = words[2].toInt();
+    isMask = words[0][1] == 'B';
+    type = isMask ? OpenCVType<BEE::MaskValue,1>::make() : OpenCVType<BEE::SimmatValue,1>::make();
+    const qint64 bytesPerRow = qint64(cols) * (isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue));
+    blockRows = int(std::max(qint64(1), (qint64(1) << 26) / std::max(qint64(1), bytesPerRow)));
 
     // Get matrix data
-    Mat m;
-    if (isMask)
-        m.create(rows, cols, OpenCVType<BEE::MaskValue,1>::make());
-    else
-        m.create(rows, cols, OpenCVType<BEE::SimmatValue,1>::make());
-
-    const qint64 bytesPerRow = m.cols * typeSize;
-    for (int i=0; i<m.rows; i++) {
-        Mat aRow = m.row(i);
-        qint64 bytesRead = file.read((char *)aRow.data, bytesPerRow);
-        if (bytesRead != bytesPerRow)
+    offset = file.pos();
+    const qint64 bytes = bytesPerRow * rows;
+    if (file.size() - offset < bytes)
+        qFatal("Didn't read complete row!");
+    if (file.size() - offset > bytes)
+        qFatal("Expected matrix end of file.");
+
+    if (bytes > 0)
+        data = file.map(offset, bytes);
+}
+
+Mat MatrixReader::mapped() const
+{
+    if (data == NULL) return Mat();
+    return Mat(rows, cols, type, (void*)data);
+}
+
+Mat MatrixReader::read(int row, int count, bool writable) const
+{
+    if (data == NULL) {
+        // Only the requested rows are read from a file that couldn't be mapped
+        Mat m(count, cols, type);
+        const qint64 bytes = qint64(count) * cols * m.elemSize();
+        if (!file.seek(offset + qint64(row) * cols * m.elemSize()) || (file.read((char*)m.data, bytes) != bytes))
             qFatal("Didn't read complete row!");
+        if (negate) m.convertTo(m, -1, -1);
+        return m;
     }
-    if (!file.atEnd())
-        qFatal("Expected matrix end of file.");
-    file.close();
 
+    const Mat m = mapped().rowRange(row, row+count);
     Mat result = m;
-    if (isDistance ^ matrix.get<bool>("negate", false))
-        m.convertTo(result, -1, -1);
+    if (negate)        m.convertTo(result, -1, -1);
+    else if (writable) result = m.clone();
     return result;
 }
 
-void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+Mat MatrixReader::read() const
+{
+    return read(0, rows, true);
+}
+
+bool MatrixReader::nextBlock(Mat &block, int *row)
+{
+    if (position >= rows) return false;
+    const int count = std::min(blockRows, rows - position);
+    block = read(position, count);
+    if (row != NULL) *row = position;
+    position += count;
+    return true;
+}
+
+MatrixWriter::MatrixWriter(const QString &fileName, int rows, int cols, int type, const QString &targetSigset, const QString &querySigset)
+    : file(fileName), rows(rows), cols(cols), type(type), appended(0)
 {
     bool isMask = false;
-    if (m.type() == OpenCVType<BEE::MaskValue,1>::make())
+    if (type == OpenCVType<BEE::MaskValue,1>::make())
         isMask = true;
-    else if (m.type() != OpenCVType<BEE::SimmatValue,1>::make())
+    else if (type != OpenCVType<BEE::SimmatValue,1>::make())
         qFatal("Invalid matrix type, .mtx files can only contain single channel float or uchar matrices.");
 
-    const int elemSize = isMask ? sizeof(BEE::MaskValue) : sizeof(BEE::SimmatValue);
     const QString matrixType = isMask ? "B" : "F";
 
     char buff[4];
-    QFile file(fileName);
     QtUtils::touchDir(file);
     if (!file.open(QFile::WriteOnly))
         qFatal("Unable to open %s for writing.", qPrintable(fileName));
@@ -200,28 +228,106 @@ void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSig
     file.write("M");
     file.write(qPrintable(matrixType));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.rows)));
+    file.write(qPrintable(QString::number(rows)));
     file.write(" ");
-    file.write(qPrintable(QString::number(m.cols)));
+    file.write(qPrintable(QString::number(cols)));
     file.write(" ");
     const int endian = 0x12345678;
     memcpy(&buff, &endian, 4);
     file.write(buff, 4);
     file.write("\n");
-    file.write((const char*)m.data, m.rows*m.cols*elemSize);
+    headerSize = file.pos();
+}
+
+MatrixWriter::~MatrixWriter()
+{
+    fill(rows);
     file.close();
 }
 
+void MatrixWriter::append(const Mat &m)
+{
+    if ((m.type() != type) || (m.cols != cols) || (appended + m.rows > rows))
+        qFatal("Matrix block does not fit %s.", qPrintable(file.fileName()));
+
+    file.seek(headerSize + qint64(appended) * cols * m.elemSize());
+    if (m.isContinuous()) {
+        file.write((const char*)m.data, qint64(m.rows) * cols * m.elemSize());
+    } else {
+        for (int i=0; i<m.rows; i++)
+            file.write((const char*)m.ptr(i), qint64(cols) * m.elemSize());
+    }
+    appended += m.rows;
+}
+
+void MatrixWriter::write(const Mat &block, int row, int column)
+{
+    if ((row == appended) && (column == 0) && (block.cols == cols)) {
+        append(block);
+        return;
+    }
+
+    if ((block.type() != type) || (row + block.rows > rows) || (column + block.cols > cols))
+        qFatal("Matrix block does not fit %s.", qPrintable(file.fileName()));
+
+    fill(row + block.rows);
+    for (int i=0; i<block.rows; i++) {
+        file.seek(headerSize + (qint64(row+i) * cols + column) * block.elemSize());
+        file.write((const char*)block.ptr(i), qint64(block.cols) * block.elemSize());
+    }
+}
+
+// Write default values through row \em end
+void MatrixWriter::fill(int end)
+{
+    if (appended >= end) return;
+
+    Mat defaults(1, cols, type);
+    if (type == OpenCVType<BEE::MaskValue,1>::make()) defaults.setTo(DontCare);
+    else                                               defaults.setTo(-std::numeric_limits<float>::max());
+    while (appended < end)
+        append(defaults);
+}
+
+Mat readMatrix(const File &matrix, QString *targetSigset, QString *querySigset)
+{
+    MatrixReader reader(matrix);
+    if (targetSigset != NULL) *targetSigset = reader.targetSigset;
+    if (querySigset != NULL) *querySigset = reader.querySigset;
+    return reader.read();
+}
+
+void writeMatrix(const Mat &m, const QString &fileName, const QString &targetSigset, const QString &querySigset)
+{
+    MatrixWriter writer(fileName, m.rows, m.cols, m.type(), targetSigset, querySigset);
+    writer.append(m);
+}
+
 void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset)
 {
     qDebug("Reading %s header.", qPrintable(matrix));
-    readMatrix(matrix, targetSigset, querySigset);
+    MatrixReader reader(matrix);
+    *targetSigset = reader.targetSigset;
+    *querySigset = reader.querySigset;
 }
 
 void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset)
 {
     qDebug("Writing %s header to %s %s.", qPrintable(matrix), qPrintable(targetSigset), qPrintable(querySigset));
-    writeMatrix(readMatrix(matrix), matrix, targetSigset, querySigset);
+
+    // The header size may change, so copy the matrix a block at a time
+    const QString temporary = matrix + ".tmp";
+    {
+        MatrixReader reader(matrix);
+        const int type = reader.isMask ? OpenCVType<BEE::MaskValue,1>::make() : OpenCVType<BEE::SimmatValue,1>::make();
+        MatrixWriter writer(temporary, reader.rows, reader.cols, type, targetSigset, querySigset);
+        Mat block;
+        while (reader.nextBlock(block))
+            writer.append(block);
+    }
+    QFile::remove(matrix);
+    if (!QFile::rename(temporary, matrix))
+        qFatal("Unable to replace %s.", qPrintable(matrix));
 }
 
 void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask)
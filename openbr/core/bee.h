@@ -17,6 +17,7 @@
 #ifndef BEE_BEE_H
 #define BEE_BEE_H
 
+#include <QFile>
 #include <QString>
 #include <QStringList>
 #include <opencv2/core/core.hpp>
@@ -43,6 +44,68 @@ namespace BEE
     void readMatrixHeader(const QString &matrix, QString *targetSigset, QString *querySigset);
     void writeMatrixHeader(const QString &matrix, const QString &targetSigset, const QString &querySigset);
 
+    /*!
+     * \brief Memory-mapped reader for matrices written by writeMatrix().
+     *
+     * Nothing is copied until rows are requested.
+     * If the file can't be mapped, rows are read from it as they are requested instead.
+     * Distance matrices, and matrices with a \c negate file parameter, are negated as rows are read,
+     * so only the requested rows are ever materialized.
+     */
+    class MatrixReader
+    {
+    public:
+        QString targetSigset, querySigset;
+        int rows, cols;
+        bool isMask;
+        bool negate; /*!< \brief Stored scores are negated when read. */
+        int blockRows; /*!< \brief Rows returned by each nextBlock(), about 64 MB by default. */
+
+        explicit MatrixReader(const br::File &matrix);
+
+        cv::Mat mapped() const; /*!< \brief The matrix as stored, read-only and valid for the lifetime of the reader, or empty if the file couldn't be mapped. */
+        cv::Mat read(int row, int count, bool writable = false) const; /*!< \brief Rows [row, row+count), referencing mapped() unless they are negated, \em writable or it is empty. */
+        cv::Mat read() const; /*!< \brief The whole matrix in newly allocated memory. */
+
+        /*!
+         * \brief Iterate over the matrix #blockRows rows at a time.
+         * Sets \em block to read() of the next rows and \em row to the index of the first of them, returns \c false after the last block.
+         */
+        bool nextBlock(cv::Mat &block, int *row = NULL);
+
+    private:
+        Q_DISABLE_COPY(MatrixReader)
+        mutable QFile file; // Read from when it can't be mapped
+        int type;
+        qint64 offset; // Of the matrix data in the file
+        const uchar *data;
+        int position;
+    };
+
+    /*!
+     * \brief Writes a matrix incrementally, without holding it in memory.
+     *
+     * Rows are appended in order, or blocks written anywhere with write().
+     * Rows that are never written hold \c -FLT_MAX, or DontCare in masks.
+     */
+    class MatrixWriter
+    {
+    public:
+        MatrixWriter(const QString &fileName, int rows, int cols, int type, const QString &targetSigset = "Unknown_Target", const QString &querySigset = "Unknown_Query");
+        ~MatrixWriter(); /*!< \brief Fills the rows that were not written. */
+
+        void append(const cv::Mat &rows); /*!< \brief Write full rows following the last appended ones. */
+        void write(const cv::Mat &block, int row, int column); /*!< \brief Write a block with its top left corner at (\em row, \em column). */
+
+    private:
+        Q_DISABLE_COPY(MatrixWriter)
+        QFile file;
+        qint64 headerSize;
+        int rows, cols, type, appended;
+
+        void fill(int rows);
+    };
+
     // Mask
     void makeMask(const QString &targetInput, const QString &queryInput, const QString &mask);
     cv::Mat makeMask(const br::FileList &targets, const br::FileList &queries, int partition = 0);
@@ -143,8 +143,16 @@ Neighborhood br::knnFromSimmat(const QList<cv::Mat> &simmats, int k)
 // generate k-NN graph from pre-computed similarity matrices 
 Neighborhood br::knnFromSimmat(const QStringList &simmats, int k)
 {
+    // Matrices are used in place from memory maps unless they need negating
+    QList< QSharedPointer<BEE::MatrixReader> > readers;
     QList<cv::Mat> mats;
     foreach (const QString &simmat, simmats) {
+        if (br::File(simmat).suffix() == "mtx") {
+            QSharedPointer<BEE::MatrixReader> reader(new BEE::MatrixReader(simmat));
+            mats.append(reader->read(0, reader->rows));
+            readers.append(reader);
+            continue;
+        }
         QScopedPointer<br::Format> format(br::Factory<br::Format>::make(simmat));
         br::Template t = format->read();
         mats.append(t);
@@ -18,6 +18,8 @@
 
 #include "bee.h"
 #include "common.h"
+#include "modelcontainer.h"
+#include "profiler.h"
 #include "qtutils.h"
 #include "../plugins/openbr_internal.h"
 
@@ -44,6 +46,7 @@ struct AlgorithmCore
     QSharedPointer<Transform> progressCounter;
 
     AlgorithmCore(const QString &name)
+        : pendingMode(None)
     {
         if (name == "algorithm") {
             this->name = Globals->algorithm;
@@ -58,11 +61,26 @@ struct AlgorithmCore
 
     bool isClassifier() const
     {
-        return comparison.isNull();
+        return comparison.isNull() && pendingComparison.isNull();
+    }
+
+    // Comparisons stored in a model container are loaded on first use, enrollment doesn't need them
+    void loadComparison()
+    {
+        QMutexLocker locker(&pendingComparisonLock);
+        if (pendingComparison.isNull())
+            return;
+
+        QBuffer buffer;
+        pendingComparison->open("comparison", buffer);
+        QDataStream in(&buffer);
+        loadComparison(in, pendingMode);
+        pendingComparison.clear();
     }
 
     void train(const File &input, const QString &model)
     {
+        loadComparison();
         qDebug("Training on %s%s", qPrintable(input.flat()),
                model.isEmpty() ? "" : qPrintable(" to " + model));
 
@@ -75,14 +93,19 @@ struct AlgorithmCore
         Globals->startTime.start();
 
         qDebug("Training Enrollment");
-        trainingWrapper->train(data);
+        {
+            Profiler::Scope scope(trainingWrapper.data(), "train", data);
+            trainingWrapper->train(data);
+        }
 
         if (!distance.isNull() && distance->trainable()) {
             if (Globals->crossValidate > 0)
                 for (int i=data.size()-1; i>=0; i--) if (data[i].file.get<bool>("allPartitions",false)) data.removeAt(i);
 
             qDebug("Projecting Enrollment");
+            Profiler::Scope scope(trainingWrapper.data(), "projectUpdate", data);
             trainingWrapper->projectUpdate(data,data);
+            scope.output(data);
 
             qDebug("Training Comparison");
             distance->train(data);
@@ -110,13 +133,10 @@ struct AlgorithmCore
 
     void store(const QString &model) const
     {
-        QtUtils::BlockCompression compressedWrite;
-        QFile outFile(model);
-        compressedWrite.setBasis(&outFile);
-        QDataStream out(&compressedWrite);
-        compressedWrite.open(QFile::WriteOnly);
+        ModelContainer::Writer writer(model);
 
         // Serialize algorithm to stream
+        QDataStream &out = writer.section("transform");
         transform->serialize(out);
 
         qint32 mode = None;
@@ -128,12 +148,12 @@ struct AlgorithmCore
         out << mode;
 
         if (mode == DistanceCompare)
-            distance->serialize(out);
+            distance->serialize(writer.section("comparison"));
 
         if (mode == TransformCompare)
-            comparison->serialize(out);
+            comparison->serialize(writer.section("comparison"));
 
-        compressedWrite.close();
+        writer.commit();
     }
 
     void load(const QString &model)
@@ -145,6 +165,23 @@ struct AlgorithmCore
         if (!Globals->modelSearch.contains(path))
             Globals->modelSearch.append(path);
 
+        if (ModelContainer::isContainer(model)) {
+            QSharedPointer<ModelContainer> container(new ModelContainer(model));
+            QBuffer buffer;
+            container->open("transform", buffer);
+            QDataStream in(&buffer);
+            transform = QSharedPointer<Transform>(Transform::deserialize(in));
+
+            qint32 mode;
+            in >> mode;
+            if (mode != None) {
+                pendingComparison = container;
+                pendingMode = mode;
+            }
+            return;
+        }
+
+        // Models stored before model containers
         QtUtils::BlockCompression compressedRead;
         QFile inFile(model);
         compressedRead.setBasis(&inFile);
@@ -156,7 +193,11 @@ struct AlgorithmCore
 
         qint32 mode;
         in >> mode;
+        loadComparison(in, mode);
+    }
 
+    void loadComparison(QDataStream &in, qint32 mode)
+    {
         if (mode == DistanceCompare) {
             QString distanceDescription;
             in >> distanceDescription;
@@ -241,9 +282,17 @@ struct AlgorithmCore
 
         bool done;
         do {
-            TemplateList templates = inputGallery->readBlock(&done);
-            if (!templates.empty())
+            TemplateList templates;
+            {
+                Profiler::Scope scope(inputGallery.data(), "read");
+                templates = inputGallery->readBlock(&done);
+                scope.output(templates);
+            }
+            if (!templates.empty()) {
+                Profiler::Scope scope(transform.data(), "project", templates);
                 templates >> *transform;
+                scope.output(templates);
+            }
             if (!templates.empty())
                 outputGallery->writeBlock(templates);
         } while (!done);
@@ -257,7 +306,7 @@ struct AlgorithmCore
 
     void retrieveOrEnroll(const File &file, QScopedPointer<Gallery> &gallery, FileList &galleryFiles)
     {
-        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+        if (!file.getBool("enroll") && (QStringList() << "gal" << "mem" << "template" << "ut" << "fv").contains(file.suffix())) {
             // Retrieve it
             gallery.reset(Gallery::make(file));
             galleryFiles = gallery->files();
@@ -280,6 +329,7 @@ struct AlgorithmCore
                qPrintable(queryGallery.flat()),
                output.isNull() ? "" : qPrintable(" to " + output.flat()));
 
+        loadComparison();
         if (distance.isNull()) qFatal("Null distance.");
 
         if (queryGallery == ".") queryGallery = targetGallery;
@@ -316,6 +366,7 @@ struct AlgorithmCore
     {
         qDebug("Deduplicating %s to %s with a score threshold of %f", qPrintable(inputGallery.flat()), qPrintable(outputGallery.flat()), threshold);
 
+        loadComparison();
         if (distance.isNull()) qFatal("Null distance.");
 
         QScopedPointer<Gallery> i;
@@ -368,6 +419,8 @@ struct AlgorithmCore
                qPrintable(queryGallery.flat()),
                output.isNull() ? "" : qPrintable(" to " + output.flat()));
 
+        loadComparison();
+
         // Escape hatch for distances that need to operate directly on the gallery files
         if (distance && distance->compare(targetGallery, queryGallery, output))
             return;
@@ -434,7 +487,7 @@ struct AlgorithmCore
             colEnrolledGallery = colGallery.baseName() + colGallery.hash() + '.' + targetExtension;
 
             // Check if we have to do real enrollment, and not just convert the gallery's type.
-            if (!(QStringList() << "gal" << "template" << "mem" << "ut").contains(colGallery.suffix()))
+            if (!(QStringList() << "gal" << "template" << "mem" << "ut" << "fv").contains(colGallery.suffix()))
                 enroll(colGallery, colEnrolledGallery);
 
             // If the gallery does have enrolled templates, but is not the right type, we do a simple
@@ -456,7 +509,7 @@ struct AlgorithmCore
         // which compares incoming templates against a gallery, we will handle enrollment of the row set by simply
         // building a transform that does enrollment (using the current algorithm), then does the comparison in one
         // step. This way, we don't have to retain the complete enrolled row gallery in memory, or on disk.
-        else if (!(QStringList() << "gal" << "mem" << "template" << "ut").contains(rowGallery.suffix()))
+        else if (!(QStringList() << "gal" << "mem" << "template" << "ut" << "fv").contains(rowGallery.suffix()))
             needEnrollRows = true;
 
         // At this point, we have decided how we will structure the comparison (either in transpose mode, or not), 
@@ -530,6 +583,9 @@ struct AlgorithmCore
 
 private:
     QString name;
+    QSharedPointer<ModelContainer> pendingComparison;
+    qint32 pendingMode;
+    QMutex pendingComparisonLock;
 
     // Check if description is either an abbreviation or a model file, if so load it
     bool loadOrExpand(const QString &description)
@@ -689,10 +745,9 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
         bool done = false;
         while (!done) after->writeBlock(before->readBlock(&done));
     } else if (fileType == "Output") {
-        QString target, query;
-        cv::Mat m = BEE::readMatrix(inputFile, &target, &query);
-        const FileList targetFiles = TemplateList::fromGallery(target).files();
-        const FileList queryFiles = TemplateList::fromGallery(query).files();
+        BEE::MatrixReader m(inputFile);
+        const FileList targetFiles = TemplateList::fromGallery(m.targetSigset).files();
+        const FileList queryFiles = TemplateList::fromGallery(m.querySigset).files();
 
         if ((targetFiles.size() != m.cols || queryFiles.size() != m.rows)
             && (m.cols != 1 || targetFiles.size() != m.rows || queryFiles.size() != m.rows))
@@ -709,9 +764,10 @@ void br::Convert(const File &fileType, const File &inputFile, const File &output
         }
 
         o->setBlock(0,0);
-        for (int i=0; i < m.rows; i++)
-            for (int j=0; j < m.cols; j++)
-                o->setRelative(m.at<float>(i,j), i, j);
+        cv::Mat block;
+        int row;
+        while (m.nextBlock(block, &row))
+            o->setRows(block, row, 0);
     } else {
         qFatal("Unrecognized file type %s.", qPrintable(fileType.flat()));
     }
@@ -741,7 +797,9 @@ void br::Deduplicate(const File &inputGallery, const File &outputGallery, const
 
 QSharedPointer<br::Transform> br::Transform::fromComparison(const QString &algorithm)
 {
-    return AlgorithmManager::getAlgorithm(algorithm)->comparison;
+    QSharedPointer<AlgorithmCore> algorithmCore = AlgorithmManager::getAlgorithm(algorithm);
+    algorithmCore->loadComparison();
+    return algorithmCore->comparison;
 }
 
 QSharedPointer<br::Transform> br::Transform::fromAlgorithm(const QString &algorithm, bool preprocess)
@@ -766,7 +824,9 @@ QSharedPointer<br::Transform> br::Transform::fromAlgorithm(const QString &algori
 
 QSharedPointer<br::Distance> br::Distance::fromAlgorithm(const QString &algorithm)
 {
-    return AlgorithmManager::getAlgorithm(algorithm)->distance;
+    QSharedPointer<AlgorithmCore> algorithmCore = AlgorithmManager::getAlgorithm(algorithm);
+    algorithmCore->loadComparison();
+    return algorithmCore->distance;
 }
 
 class pathInitializer : public Initializer
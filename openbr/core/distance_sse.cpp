@@ -0,0 +1,703 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "distance_sse.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || ((defined(__i386__) || defined(_M_IX86)) && defined(__SSE2__))
+#define BR_X86_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BR_TARGET(ISA)
+#else // not _MSC_VER
+#include <cpuid.h>
+#define BR_TARGET(ISA) __attribute__((target(ISA)))
+#endif // _MSC_VER
+#endif // x86
+
+/* Scalar kernels, also used for the tails of the vectorized kernels */
+static inline int popcount64(quint64 x)
+{
+    x = x - ((x >> 1) & Q_UINT64_C(0x5555555555555555));
+    x = (x & Q_UINT64_C(0x3333333333333333)) + ((x >> 2) & Q_UINT64_C(0x3333333333333333));
+    x = (x + (x >> 4)) & Q_UINT64_C(0x0F0F0F0F0F0F0F0F);
+    return int((x * Q_UINT64_C(0x0101010101010101)) >> 56);
+}
+
+static float l1Scalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += abs(a[i]-b[i]);
+    return distance;
+}
+
+static float packedL1Scalar(const uchar *a, const uchar *b, int size)
+{
+    static const uchar low_mask = 0x0F;
+    static const uchar hi_mask = 0xF0;
+
+    int distance = 0;
+    for (int i=0; i<size; i++)
+        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
+                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
+    return distance;
+}
+
+static float hammingScalar(const uchar *a, const uchar *b, int size)
+{
+    int distance = 0, i = 0;
+    for (; i+8<=size; i+=8) {
+        quint64 x, y;
+        memcpy(&x, a+i, 8);
+        memcpy(&y, b+i, 8);
+        distance += popcount64(x ^ y);
+    }
+    for (; i<size; i++)
+        distance += popcount64(a[i] ^ b[i]);
+    return distance;
+}
+
+static float l1FloatScalar(const float *a, const float *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++)
+        distance += fabs(a[i]-b[i]);
+    return distance;
+}
+
+static float l2FloatScalar(const float *a, const float *b, int size)
+{
+    float distance = 0;
+    for (int i=0; i<size; i++)
+        distance += (a[i]-b[i])*(a[i]-b[i]);
+    return distance;
+}
+
+static float dotFloatScalar(const float *a, const float *b, int size)
+{
+    float dot = 0;
+    for (int i=0; i<size; i++)
+        dot += a[i]*b[i];
+    return dot;
+}
+
+static float cosineFloatScalar(const float *a, const float *b, int size)
+{
+    float dot = 0, magA = 0, magB = 0;
+    for (int i=0; i<size; i++) {
+        dot += a[i]*b[i];
+        magA += a[i]*a[i];
+        magB += b[i]*b[i];
+    }
+    return dot / (sqrt(magA)*sqrt(magB));
+}
+
+static void pqScanScalar(const uchar *codes, int count, int subspaces, const float *tables, float *distances)
+{
+    for (int b=0; b<count/16; b++)
+        for (int i=0; i<16; i++) {
+            float distance = 0;
+            for (int j=0; j<subspaces; j++)
+                distance += tables[j*256 + codes[(b*subspaces + j)*16 + i]];
+            distances[b*16 + i] = distance;
+        }
+}
+
+static void pqScan8Scalar(const uchar *codes, int count, int subspaces, const uchar *tables, quint32 *distances)
+{
+    for (int b=0; b<count/16; b++)
+        for (int i=0; i<16; i++) {
+            quint32 distance = 0;
+            for (int j=0; j<subspaces; j++)
+                distance += tables[j*256 + codes[(b*subspaces + j)*16 + i]];
+            distances[b*16 + i] = distance;
+        }
+}
+
+#ifdef BR_X86_SIMD
+
+/* SSE2 kernels */
+static inline int hsum64(__m128i x)
+{
+    return int(_mm_cvtsi128_si32(x) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(x, x)));
+}
+
+static inline float hsum(__m128 x)
+{
+    x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+    x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+    return _mm_cvtss_f32(x);
+}
+
+static float l1SSE2(const uchar *a, const uchar *b, int size)
+{
+    __m128i accumulate = _mm_setzero_si128();
+    int i = 0;
+    for (; i+16<=size; i+=16)
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a+i)), _mm_loadu_si128((const __m128i*)(b+i))));
+    return hsum64(accumulate) + l1Scalar(a+i, b+i, size-i);
+}
+
+static float packedL1SSE2(const uchar *a, const uchar *b, int size)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    __m128i accumulate = _mm_setzero_si128();
+    int i = 0;
+    for (; i+16<=size; i+=16) {
+        const __m128i A = _mm_loadu_si128((const __m128i*)(a+i));
+        const __m128i B = _mm_loadu_si128((const __m128i*)(b+i));
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_and_si128(A, mask), _mm_and_si128(B, mask)));
+        accumulate = _mm_add_epi64(accumulate, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi16(A, 4), mask), _mm_and_si128(_mm_srli_epi16(B, 4), mask)));
+    }
+    return hsum64(accumulate) + packedL1Scalar(a+i, b+i, size-i);
+}
+
+static float l1FloatSSE2(const float *a, const float *b, int size)
+{
+    const __m128 sign = _mm_set1_ps(-0.f);
+    __m128 accumulate = _mm_setzero_ps();
+    int i = 0;
+    for (; i+4<=size; i+=4)
+        accumulate = _mm_add_ps(accumulate, _mm_andnot_ps(sign, _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i))));
+    return hsum(accumulate) + l1FloatScalar(a+i, b+i, size-i);
+}
+
+static float l2FloatSSE2(const float *a, const float *b, int size)
+{
+    __m128 accumulate = _mm_setzero_ps();
+    int i = 0;
+    for (; i+4<=size; i+=4) {
+        const __m128 d = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        accumulate = _mm_add_ps(accumulate, _mm_mul_ps(d, d));
+    }
+    return hsum(accumulate) + l2FloatScalar(a+i, b+i, size-i);
+}
+
+static float dotFloatSSE2(const float *a, const float *b, int size)
+{
+    __m128 accumulate = _mm_setzero_ps();
+    int i = 0;
+    for (; i+4<=size; i+=4)
+        accumulate = _mm_add_ps(accumulate, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    return hsum(accumulate) + dotFloatScalar(a+i, b+i, size-i);
+}
+
+static float cosineFloatSSE2(const float *a, const float *b, int size)
+{
+    __m128 dot = _mm_setzero_ps(), magA = _mm_setzero_ps(), magB = _mm_setzero_ps();
+    int i = 0;
+    for (; i+4<=size; i+=4) {
+        const __m128 A = _mm_loadu_ps(a+i);
+        const __m128 B = _mm_loadu_ps(b+i);
+        dot = _mm_add_ps(dot, _mm_mul_ps(A, B));
+        magA = _mm_add_ps(magA, _mm_mul_ps(A, A));
+        magB = _mm_add_ps(magB, _mm_mul_ps(B, B));
+    }
+    float d = hsum(dot), ma = hsum(magA), mb = hsum(magB);
+    for (; i<size; i++) {
+        d += a[i]*b[i];
+        ma += a[i]*a[i];
+        mb += b[i]*b[i];
+    }
+    return d / (sqrt(ma)*sqrt(mb));
+}
+
+/* AVX2 kernels */
+BR_TARGET("avx2")
+static inline int hsum64(__m256i x)
+{
+    return hsum64(_mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+}
+
+BR_TARGET("avx2")
+static inline float hsum(__m256 x)
+{
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1)));
+}
+
+// Per-byte popcount via a nibble lookup table
+BR_TARGET("avx2")
+static inline __m256i popcount8(__m256i x)
+{
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, mask)),
+                           _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+}
+
+BR_TARGET("avx2")
+static float l1AVX2(const uchar *a, const uchar *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+32<=size; i+=32)
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(b+i))));
+    return hsum64(accumulate) + l1SSE2(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float packedL1AVX2(const uchar *a, const uchar *b, int size)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    __m256i accumulate = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i A = _mm256_loadu_si256((const __m256i*)(a+i));
+        const __m256i B = _mm256_loadu_si256((const __m256i*)(b+i));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_and_si256(A, mask), _mm256_and_si256(B, mask)));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi16(A, 4), mask), _mm256_and_si256(_mm256_srli_epi16(B, 4), mask)));
+    }
+    return hsum64(accumulate) + packedL1SSE2(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float hammingAVX2(const uchar *a, const uchar *b, int size)
+{
+    __m256i accumulate = _mm256_setzero_si256();
+    int i = 0;
+    for (; i+32<=size; i+=32) {
+        const __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(b+i)));
+        accumulate = _mm256_add_epi64(accumulate, _mm256_sad_epu8(popcount8(x), _mm256_setzero_si256()));
+    }
+    return hsum64(accumulate) + hammingScalar(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float l1FloatAVX2(const float *a, const float *b, int size)
+{
+    const __m256 sign = _mm256_set1_ps(-0.f);
+    __m256 accumulate = _mm256_setzero_ps();
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        accumulate = _mm256_add_ps(accumulate, _mm256_andnot_ps(sign, _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i))));
+    return hsum(accumulate) + l1FloatSSE2(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float l2FloatAVX2(const float *a, const float *b, int size)
+{
+    __m256 accumulate = _mm256_setzero_ps();
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(d, d));
+    }
+    return hsum(accumulate) + l2FloatSSE2(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float dotFloatAVX2(const float *a, const float *b, int size)
+{
+    __m256 accumulate = _mm256_setzero_ps();
+    int i = 0;
+    for (; i+8<=size; i+=8)
+        accumulate = _mm256_add_ps(accumulate, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    return hsum(accumulate) + dotFloatSSE2(a+i, b+i, size-i);
+}
+
+BR_TARGET("avx2")
+static float cosineFloatAVX2(const float *a, const float *b, int size)
+{
+    __m256 dot = _mm256_setzero_ps(), magA = _mm256_setzero_ps(), magB = _mm256_setzero_ps();
+    int i = 0;
+    for (; i+8<=size; i+=8) {
+        const __m256 A = _mm256_loadu_ps(a+i);
+        const __m256 B = _mm256_loadu_ps(b+i);
+        dot = _mm256_add_ps(dot, _mm256_mul_ps(A, B));
+        magA = _mm256_add_ps(magA, _mm256_mul_ps(A, A));
+        magB = _mm256_add_ps(magB, _mm256_mul_ps(B, B));
+    }
+    float d = hsum(dot), ma = hsum(magA), mb = hsum(magB);
+    for (; i<size; i++) {
+        d += a[i]*b[i];
+        ma += a[i]*a[i];
+        mb += b[i]*b[i];
+    }
+    return d / (sqrt(ma)*sqrt(mb));
+}
+
+// Each block of 16 codes takes two 8-lane gathers per subspace
+BR_TARGET("avx2")
+static void pqScanAVX2(const uchar *codes, int count, int subspaces, const float *tables, float *distances)
+{
+    for (int b=0; b<count/16; b++) {
+        __m256 low = _mm256_setzero_ps(), high = _mm256_setzero_ps();
+        for (int j=0; j<subspaces; j++) {
+            const __m128i indices = _mm_loadu_si128((const __m128i*)(codes + (b*subspaces + j)*16));
+            low = _mm256_add_ps(low, _mm256_i32gather_ps(tables + j*256, _mm256_cvtepu8_epi32(indices), 4));
+            high = _mm256_add_ps(high, _mm256_i32gather_ps(tables + j*256, _mm256_cvtepu8_epi32(_mm_srli_si128(indices, 8)), 4));
+        }
+        _mm256_storeu_ps(distances + b*16, low);
+        _mm256_storeu_ps(distances + b*16 + 8, high);
+    }
+}
+
+// Gathers 32 bits at byte offsets and keeps the low byte, hence the padding required after the tables
+BR_TARGET("avx2")
+static void pqScan8AVX2(const uchar *codes, int count, int subspaces, const uchar *tables, quint32 *distances)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFF);
+    for (int b=0; b<count/16; b++) {
+        __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+        for (int j=0; j<subspaces; j++) {
+            const int *table = (const int*)(tables + j*256);
+            const __m128i indices = _mm_loadu_si128((const __m128i*)(codes + (b*subspaces + j)*16));
+            low = _mm256_add_epi32(low, _mm256_and_si256(mask, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(indices), 1)));
+            high = _mm256_add_epi32(high, _mm256_and_si256(mask, _mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(indices, 8)), 1)));
+        }
+        _mm256_storeu_si256((__m256i*)(distances + b*16), low);
+        _mm256_storeu_si256((__m256i*)(distances + b*16 + 8), high);
+    }
+}
+
+/* AVX-512BW kernels, tails are handled with masked loads */
+BR_TARGET("avx512f,avx512bw")
+static float l1AVX512(const uchar *a, const uchar *b, int size)
+{
+    __m512i accumulate = _mm512_setzero_si512();
+    int i = 0;
+    for (; i+64<=size; i+=64)
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_loadu_si512(a+i), _mm512_loadu_si512(b+i)));
+    if (i < size) {
+        const __mmask64 tail = (__mmask64)(~Q_UINT64_C(0) >> (64 - (size-i)));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_maskz_loadu_epi8(tail, a+i), _mm512_maskz_loadu_epi8(tail, b+i)));
+    }
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float packedL1AVX512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<size; i+=64) {
+        const __mmask64 load = (__mmask64)(size-i >= 64 ? ~Q_UINT64_C(0) : ~Q_UINT64_C(0) >> (64 - (size-i)));
+        const __m512i A = _mm512_maskz_loadu_epi8(load, a+i);
+        const __m512i B = _mm512_maskz_loadu_epi8(load, b+i);
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_and_si512(A, mask), _mm512_and_si512(B, mask)));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(_mm512_and_si512(_mm512_srli_epi16(A, 4), mask), _mm512_and_si512(_mm512_srli_epi16(B, 4), mask)));
+    }
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float hammingAVX512(const uchar *a, const uchar *b, int size)
+{
+    const __m512i lut = _mm512_broadcast_i32x4(_mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4));
+    const __m512i mask = _mm512_set1_epi8(0x0F);
+    __m512i accumulate = _mm512_setzero_si512();
+    for (int i=0; i<size; i+=64) {
+        const __mmask64 load = (__mmask64)(size-i >= 64 ? ~Q_UINT64_C(0) : ~Q_UINT64_C(0) >> (64 - (size-i)));
+        const __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi8(load, a+i), _mm512_maskz_loadu_epi8(load, b+i));
+        const __m512i counts = _mm512_add_epi8(_mm512_shuffle_epi8(lut, _mm512_and_si512(x, mask)),
+                                               _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(x, 4), mask)));
+        accumulate = _mm512_add_epi64(accumulate, _mm512_sad_epu8(counts, _mm512_setzero_si512()));
+    }
+    return _mm512_reduce_add_epi64(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float l1FloatAVX512(const float *a, const float *b, int size)
+{
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<size; i+=16) {
+        const __mmask16 load = (__mmask16)(size-i >= 16 ? 0xFFFF : (1u << (size-i)) - 1);
+        accumulate = _mm512_add_ps(accumulate, _mm512_abs_ps(_mm512_sub_ps(_mm512_maskz_loadu_ps(load, a+i), _mm512_maskz_loadu_ps(load, b+i))));
+    }
+    return _mm512_reduce_add_ps(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float l2FloatAVX512(const float *a, const float *b, int size)
+{
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<size; i+=16) {
+        const __mmask16 load = (__mmask16)(size-i >= 16 ? 0xFFFF : (1u << (size-i)) - 1);
+        const __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(load, a+i), _mm512_maskz_loadu_ps(load, b+i));
+        accumulate = _mm512_fmadd_ps(d, d, accumulate);
+    }
+    return _mm512_reduce_add_ps(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float dotFloatAVX512(const float *a, const float *b, int size)
+{
+    __m512 accumulate = _mm512_setzero_ps();
+    for (int i=0; i<size; i+=16) {
+        const __mmask16 load = (__mmask16)(size-i >= 16 ? 0xFFFF : (1u << (size-i)) - 1);
+        accumulate = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(load, a+i), _mm512_maskz_loadu_ps(load, b+i), accumulate);
+    }
+    return _mm512_reduce_add_ps(accumulate);
+}
+
+BR_TARGET("avx512f,avx512bw")
+static float cosineFloatAVX512(const float *a, const float *b, int size)
+{
+    __m512 dot = _mm512_setzero_ps(), magA = _mm512_setzero_ps(), magB = _mm512_setzero_ps();
+    for (int i=0; i<size; i+=16) {
+        const __mmask16 load = (__mmask16)(size-i >= 16 ? 0xFFFF : (1u << (size-i)) - 1);
+        const __m512 A = _mm512_maskz_loadu_ps(load, a+i);
+        const __m512 B = _mm512_maskz_loadu_ps(load, b+i);
+        dot = _mm512_fmadd_ps(A, B, dot);
+        magA = _mm512_fmadd_ps(A, A, magA);
+        magB = _mm512_fmadd_ps(B, B, magB);
+    }
+    return _mm512_reduce_add_ps(dot) / (sqrt(_mm512_reduce_add_ps(magA))*sqrt(_mm512_reduce_add_ps(magB)));
+}
+
+BR_TARGET("avx512f,avx512bw")
+static void pqScanAVX512(const uchar *codes, int count, int subspaces, const float *tables, float *distances)
+{
+    for (int b=0; b<count/16; b++) {
+        __m512 accumulate = _mm512_setzero_ps();
+        for (int j=0; j<subspaces; j++) {
+            const __m128i indices = _mm_loadu_si128((const __m128i*)(codes + (b*subspaces + j)*16));
+            accumulate = _mm512_add_ps(accumulate, _mm512_i32gather_ps(_mm512_cvtepu8_epi32(indices), tables + j*256, 4));
+        }
+        _mm512_storeu_ps(distances + b*16, accumulate);
+    }
+}
+
+BR_TARGET("avx512f,avx512bw")
+static void pqScan8AVX512(const uchar *codes, int count, int subspaces, const uchar *tables, quint32 *distances)
+{
+    const __m512i mask = _mm512_set1_epi32(0xFF);
+    for (int b=0; b<count/16; b++) {
+        __m512i accumulate = _mm512_setzero_si512();
+        for (int j=0; j<subspaces; j++) {
+            const __m128i indices = _mm_loadu_si128((const __m128i*)(codes + (b*subspaces + j)*16));
+            accumulate = _mm512_add_epi32(accumulate, _mm512_and_si512(mask, _mm512_i32gather_epi32(_mm512_cvtepu8_epi32(indices), tables + j*256, 1)));
+        }
+        _mm512_storeu_si512(distances + b*16, accumulate);
+    }
+}
+
+/* CPU feature detection */
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int*)regs, leaf, subleaf);
+#else // not _MSC_VER
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif // _MSC_VER
+}
+
+static quint64 xgetbv()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else // not _MSC_VER
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (quint64(edx) << 32) | eax;
+#endif // _MSC_VER
+}
+
+#endif // BR_X86_SIMD
+
+namespace
+{
+
+enum ISALevel { ScalarLevel, SSE2Level, AVX2Level, AVX512Level };
+const char *ISANames[] = { "Scalar", "SSE2", "AVX2", "AVX-512BW" };
+
+// The widest instruction set the CPU and OS support
+ISALevel supportedLevel()
+{
+#ifdef BR_X86_SIMD
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    const unsigned int maxLeaf = regs[0];
+
+    // SSE2 is part of the x86-64 baseline, and required at compile time on 32-bit builds
+    if (maxLeaf < 7)
+        return SSE2Level;
+
+    cpuid(1, 0, regs);
+    const bool osxsave = (regs[2] >> 27) & 1;
+    if (!osxsave)
+        return SSE2Level;
+
+    // The OS must preserve the YMM (and ZMM) register state across context switches
+    const quint64 xcr0 = xgetbv();
+    const bool ymm = (xcr0 & 0x6) == 0x6;
+    const bool zmm = (xcr0 & 0xE6) == 0xE6;
+
+    cpuid(7, 0, regs);
+    const bool avx2 = (regs[1] >> 5) & 1;
+    const bool avx512f = (regs[1] >> 16) & 1;
+    const bool avx512bw = (regs[1] >> 30) & 1;
+
+    if (avx512f && avx512bw && zmm)
+        return AVX512Level;
+    if (avx2 && ymm)
+        return AVX2Level;
+    return SSE2Level;
+#else // not BR_X86_SIMD
+    return ScalarLevel;
+#endif // BR_X86_SIMD
+}
+
+struct DistanceKernels
+{
+    const char *isa;
+    float (*l1)(const uchar*, const uchar*, int);
+    float (*packedL1)(const uchar*, const uchar*, int);
+    float (*hamming)(const uchar*, const uchar*, int);
+    float (*l1Float)(const float*, const float*, int);
+    float (*l2Float)(const float*, const float*, int);
+    float (*dotFloat)(const float*, const float*, int);
+    float (*cosineFloat)(const float*, const float*, int);
+    void (*pqScan)(const uchar*, int, int, const float*, float*);
+    void (*pqScan8)(const uchar*, int, int, const uchar*, quint32*);
+
+    DistanceKernels(ISALevel level)
+    {
+        isa = ISANames[level];
+        l1 = l1Scalar;
+        packedL1 = packedL1Scalar;
+        hamming = hammingScalar;
+        l1Float = l1FloatScalar;
+        l2Float = l2FloatScalar;
+        dotFloat = dotFloatScalar;
+        cosineFloat = cosineFloatScalar;
+        pqScan = pqScanScalar;
+        pqScan8 = pqScan8Scalar;
+
+#ifdef BR_X86_SIMD
+        if (level >= SSE2Level) {
+            l1 = l1SSE2;
+            packedL1 = packedL1SSE2;
+            l1Float = l1FloatSSE2;
+            l2Float = l2FloatSSE2;
+            dotFloat = dotFloatSSE2;
+            cosineFloat = cosineFloatSSE2;
+        }
+
+        if (level >= AVX2Level) {
+            l1 = l1AVX2;
+            packedL1 = packedL1AVX2;
+            hamming = hammingAVX2;
+            l1Float = l1FloatAVX2;
+            l2Float = l2FloatAVX2;
+            dotFloat = dotFloatAVX2;
+            cosineFloat = cosineFloatAVX2;
+            pqScan = pqScanAVX2;
+            pqScan8 = pqScan8AVX2;
+        }
+
+        if (level >= AVX512Level) {
+            l1 = l1AVX512;
+            packedL1 = packedL1AVX512;
+            hamming = hammingAVX512;
+            l1Float = l1FloatAVX512;
+            l2Float = l2FloatAVX512;
+            dotFloat = dotFloatAVX512;
+            cosineFloat = cosineFloatAVX512;
+            pqScan = pqScanAVX512;
+            pqScan8 = pqScan8AVX512;
+        }
+#endif // BR_X86_SIMD
+    }
+};
+
+// Selected when the library is loaded, only changed by setDistanceISA()
+const ISALevel supported = supportedLevel();
+DistanceKernels kernels(supported);
+
+} // namespace
+
+float l1(const uchar *a, const uchar *b, int size)
+{
+    return kernels.l1(a, b, size);
+}
+
+float packed_l1(const uchar *a, const uchar *b, int size)
+{
+    return kernels.packedL1(a, b, size);
+}
+
+float hamming(const uchar *a, const uchar *b, int size)
+{
+    return kernels.hamming(a, b, size);
+}
+
+float l1(const float *a, const float *b, int size)
+{
+    return kernels.l1Float(a, b, size);
+}
+
+float l2(const float *a, const float *b, int size)
+{
+    return kernels.l2Float(a, b, size);
+}
+
+float dot(const float *a, const float *b, int size)
+{
+    return kernels.dotFloat(a, b, size);
+}
+
+float cosine(const float *a, const float *b, int size)
+{
+    return kernels.cosineFloat(a, b, size);
+}
+
+void pq_scan(const uchar *codes, int count, int subspaces, const float *tables, float *distances)
+{
+    kernels.pqScan(codes, count, subspaces, tables, distances);
+}
+
+void pq_scan(const uchar *codes, int count, int subspaces, const uchar *tables, quint32 *distances)
+{
+    kernels.pqScan8(codes, count, subspaces, tables, distances);
+}
+
+void pq_interleave(const uchar *codes, int count, int subspaces, size_t step, uchar *interleaved)
+{
+    const int padded = (count + 15) / 16 * 16;
+    memset(interleaved, 0, size_t(padded) * subspaces);
+    for (int i=0; i<count; i++)
+        for (int j=0; j<subspaces; j++)
+            interleaved[((i/16)*subspaces + j)*16 + i%16] = codes[i*step + j];
+}
+
+const char *distanceISA()
+{
+    return kernels.isa;
+}
+
+QStringList distanceISAs()
+{
+    QStringList isas;
+    for (int level=ScalarLevel; level<=supported; level++)
+        isas.append(ISANames[level]);
+    return isas;
+}
+
+bool setDistanceISA(const QString &isa)
+{
+    const int level = distanceISAs().indexOf(isa);
+    if (level == -1)
+        return false;
+    kernels = DistanceKernels(ISALevel(level));
+    return true;
+}
@@ -18,6 +18,14 @@
 #define DISTANCE_SSE_H
 
 #include <QDebug>
+#include <QStringList>
+#include <openbr/openbr_export.h>
+
+/*!
+ * Distance kernels dispatched at run time to the widest instruction set the CPU supports
+ * (scalar, SSE2, AVX2 or AVX-512BW). All kernels handle sizes that are not a multiple of the vector width.
+ * Sizes are in elements, i.e. bytes for the \c uchar kernels and floats for the \c float kernels.
+ */
 
 #ifdef __SSE__
 
@@ -31,45 +39,44 @@ inline QDebug operator<<(QDebug dbg, const __m128i &p)
     return dbg.space();
 }
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    size = size / sizeof(__m128i);
-    __m128i accumulate = _mm_setzero_si128();
-
-    for (int i=0; i<size; i++) {
-        __m128i A = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a)+i);
-        __m128i B = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)+i);
-        __m128i sad = _mm_sad_epu8(A, B);
-        accumulate = _mm_add_epi64(sad, accumulate);
-    }
+#endif // __SSE__
 
-    int64_t buff[2];
-    _mm_storeu_si128(reinterpret_cast<__m128i*>(&buff), accumulate);
-    return buff[0] + buff[1];
-}
+BR_EXPORT float l1(const uchar *a, const uchar *b, int size); /*!< \brief Sum of absolute differences of bytes. */
+BR_EXPORT float packed_l1(const uchar *a, const uchar *b, int size); /*!< \brief Sum of absolute differences of 4-bit values packed two per byte. */
+BR_EXPORT float hamming(const uchar *a, const uchar *b, int size); /*!< \brief Number of differing bits. */
+BR_EXPORT float l1(const float *a, const float *b, int size); /*!< \brief Sum of absolute differences. */
+BR_EXPORT float l2(const float *a, const float *b, int size); /*!< \brief Sum of squared differences. */
+BR_EXPORT float dot(const float *a, const float *b, int size); /*!< \brief Inner product. */
+BR_EXPORT float cosine(const float *a, const float *b, int size); /*!< \brief Inner product divided by the product of the magnitudes. */
 
-#else
+/*!
+ * \brief Sum the \em tables entries selected by each of \em count product quantization codes.
+ *
+ * \em tables holds 256 entries per subspace. \em codes are in the layout written by pq_interleave(), with \em count a multiple of 16.
+ */
+BR_EXPORT void pq_scan(const uchar *codes, int count, int subspaces, const float *tables, float *distances);
 
-inline float l1(const uchar *a, const uchar *b, int size)
-{
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += abs(a[i]-b[i]);
-    return distance;
-}
+/*!
+ * \brief Like pq_scan() with 8-bit tables, which must be followed by at least 3 readable bytes.
+ */
+BR_EXPORT void pq_scan(const uchar *codes, int count, int subspaces, const uchar *tables, quint32 *distances);
 
-#endif
+/*!
+ * \brief Interleave \em count codes of \em subspaces bytes, \em step bytes apart, for pq_scan().
+ *
+ * Codes are grouped in blocks of 16, and each block stores the codes of one subspace contiguously.
+ * \em interleaved must hold 16 * \em subspaces bytes per started block, padding codes are zero.
+ */
+BR_EXPORT void pq_interleave(const uchar *codes, int count, int subspaces, size_t step, uchar *interleaved);
 
-inline float packed_l1(const uchar *a, const uchar *b, int size)
-{
-    static const uchar low_mask = 0x0F;
-    static const uchar hi_mask = 0xF0;
+BR_EXPORT const char *distanceISA(); /*!< \brief Name of the instruction set selected for the kernels above. */
+BR_EXPORT QStringList distanceISAs(); /*!< \brief Names of the instruction sets supported by the CPU, narrowest first. */
 
-    int distance = 0;
-    for (int i=0; i<size; i++)
-        distance += (abs((a[i] & low_mask) - (b[i] & low_mask)) >> 0) +
-                    (abs((a[i] & hi_mask)  - (b[i] & hi_mask))  >> 4);
-    return distance;
-}
+/*!
+ * \brief Select the kernels of a supported instruction set, returning \c false if \em isa isn't one.
+ *
+ * Intended for benchmarks and for reproducing results across machines, it must not be called while kernels are in use.
+ */
+BR_EXPORT bool setDistanceISA(const QString &isa);
 
 #endif // DISTANCE_SSE_H
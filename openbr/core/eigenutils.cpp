@@ -1,3 +1,4 @@
+#include <Eigen/Dense>
 #include "eigenutils.h"
 #include <openbr/openbr_plugin.h>
 
@@ -71,3 +72,103 @@ Eigen::MatrixXf EigenUtils::matrixToVector(const Eigen::MatrixXf matrix) {
     }
     return vector;
 }
+
+// Columns per block, so a block of 64-bit values stays near 64 MB
+static int blockColumns(const EigenUtils::ColumnBlocks &data)
+{
+    return std::max(1, int((qint64(64) << 20) / (qint64(sizeof(double)) * std::max(1, data.rows()))));
+}
+
+// Orthonormal basis of the columns of m
+static MatrixXd orthonormalize(const MatrixXd &m)
+{
+    HouseholderQR<MatrixXd> qr(m);
+    return qr.householderQ() * MatrixXd::Identity(m.rows(), m.cols());
+}
+
+void EigenUtils::randomizedPCA(const ColumnBlocks &data, int k, int powerIterations,
+                               VectorXd &mean, VectorXd &eVals, MatrixXd &eVecs, double &totalVariance)
+{
+    const int dims = data.rows();
+    const int instances = data.cols();
+    const int step = blockColumns(data);
+
+    // Oversampling improves the accuracy of the trailing components
+    k = std::min(k, std::min(dims, instances));
+    const int samples = std::min(k + 10, std::min(dims, instances));
+
+    // First pass: mean and total variance
+    mean = VectorXd::Zero(dims);
+    double sumOfSquares = 0;
+    for (int i=0; i<instances; i+=step) {
+        const MatrixXd block = data.block(i, std::min(i+step, instances));
+        mean += block.rowwise().sum();
+        sumOfSquares += block.squaredNorm();
+    }
+    mean /= instances;
+    totalVariance = (sumOfSquares - instances * mean.squaredNorm()) / (instances - 1.0);
+
+    // Second pass: sample the range of the centered data with a Gaussian test matrix, drawn one block at a time
+    cv::RNG rng;
+    MatrixXd range = MatrixXd::Zero(dims, samples);
+    for (int i=0; i<instances; i+=step) {
+        MatrixXd block = data.block(i, std::min(i+step, instances));
+        block.colwise() -= mean;
+        MatrixXd test(block.cols(), samples);
+        for (int r=0; r<test.rows(); r++)
+            for (int c=0; c<samples; c++)
+                test(r, c) = rng.gaussian(1);
+        range += block * test;
+    }
+    range = orthonormalize(range);
+
+    // Power iterations sharpen the spectrum, one pass each
+    for (int iteration=0; iteration<powerIterations; iteration++) {
+        MatrixXd next = MatrixXd::Zero(dims, samples);
+        for (int i=0; i<instances; i+=step) {
+            MatrixXd block = data.block(i, std::min(i+step, instances));
+            block.colwise() -= mean;
+            next += block * (block.transpose() * range);
+        }
+        range = orthonormalize(next);
+    }
+
+    // Last pass: covariance projected into the sampled range, small enough to decompose exactly
+    MatrixXd projected = MatrixXd::Zero(samples, samples);
+    for (int i=0; i<instances; i+=step) {
+        MatrixXd block = data.block(i, std::min(i+step, instances));
+        block.colwise() -= mean;
+        const MatrixXd reduced = range.transpose() * block;
+        projected += reduced * reduced.transpose();
+    }
+    projected /= (instances - 1.0);
+
+    // Eigenvalues come in increasing order
+    SelfAdjointEigenSolver<MatrixXd> eSolver(projected);
+    eVals = eSolver.eigenvalues().reverse().head(k);
+    eVecs = range * eSolver.eigenvectors().rowwise().reverse().leftCols(k);
+}
+
+void EigenUtils::covariance(const ColumnBlocks &data, VectorXd &mean, MatrixXd &cov)
+{
+    const int dims = data.rows();
+    const int instances = data.cols();
+    const int step = blockColumns(data);
+
+    // Accumulate relative to the mean of the first block, which keeps the sums well conditioned
+    VectorXd shift, sum = VectorXd::Zero(dims);
+    MatrixXd products = MatrixXd::Zero(dims, dims);
+    for (int i=0; i<instances; i+=step) {
+        MatrixXd block = data.block(i, std::min(i+step, instances));
+        if (i == 0)
+            shift = block.rowwise().mean();
+        block.colwise() -= shift;
+        sum += block.rowwise().sum();
+        products.selfadjointView<Lower>().rankUpdate(block);
+    }
+
+    const VectorXd offset = sum / instances;
+    cov = products.selfadjointView<Lower>();
+    cov = (cov - instances * offset * offset.transpose()) / (instances - 1.0);
+    mean = shift + offset;
+}
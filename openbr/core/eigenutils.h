@@ -78,6 +78,25 @@ namespace EigenUtils
 
     // Compute the element-wise standard deviation
     float stddev(const Eigen::MatrixXf& x);
+
+    // Read access to the columns of a data matrix in blocks, so it need not be held in memory at once
+    class ColumnBlocks
+    {
+    public:
+        virtual ~ColumnBlocks() {}
+        virtual int rows() const = 0;
+        virtual int cols() const = 0;
+        virtual Eigen::MatrixXd block(int begin, int end) const = 0; // Columns [begin, end)
+    };
+
+    // Leading eigenvectors of the covariance of the columns of data, by randomized range finding (Halko et al. 2011).
+    // Reads the data 3 + powerIterations times, in blocks, and needs O(rows * k) memory beyond one block.
+    // Eigenvalues are returned in decreasing order, totalVariance is the trace of the covariance.
+    void randomizedPCA(const ColumnBlocks &data, int k, int powerIterations,
+                       Eigen::VectorXd &mean, Eigen::VectorXd &eVals, Eigen::MatrixXd &eVecs, double &totalVariance);
+
+    // Mean and sample covariance of the columns of data, accumulated a block at a time in O(rows^2) memory
+    void covariance(const ColumnBlocks &data, Eigen::VectorXd &mean, Eigen::MatrixXd &cov);
 }
 
 template<typename _Scalar, int _Rows, int _Cols, int _Options, int _MaxRows, int _MaxCols>
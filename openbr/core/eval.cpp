@@ -20,6 +20,8 @@
 #include "openbr/core/qtutils.h"
 #include "openbr/core/opencvutils.h"
 #include <QMapIterator>
+#include <functional>
+#include <string.h>
 
 using namespace cv;
 
@@ -27,6 +29,8 @@ namespace br
 {
 
 static const int Max_Points = 500; // Maximum number of points to render on plots
+static const int Max_Retrieval = 200; // Maximum rank of the CMC curve
+static const int Report_Retrieval = 5;
 
 struct Comparison
 {
@@ -134,6 +138,82 @@ static cv::Mat constructMatchingMask(const cv::Mat &scores, const FileList &targ
     return cv::Mat();
 }
 
+// Write DET, FAR, FRR, FT, FatT, CT and BC entries, returns TAR @ FAR = 0.01
+static float appendOperatingPoints(QStringList &lines, const QList<OperatingPoint> &operatingPoints, const QVector<int> &firstGenuineReturns)
+{
+    float result;
+
+    // Write Detection Error Tradeoff (DET), PRE, REC
+    float FAR=0.000001;
+    for (int i=0; i<Max_Points; i++) {
+        OperatingPoint operatingPoint = getOperatingPointGivenFAR(operatingPoints, FAR);
+        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
+                                              QString::number(1-operatingPoint.TAR)));
+        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(FAR)));
+        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
+                                              QString::number(1-operatingPoint.TAR)));
+        //multiplier roughly spans 10E-6 to 1
+        FAR *=1.02807;
+    }
+
+    // Write TAR@FAR Table (FT)
+    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
+      lines.append(qPrintable(QString("FT,%1,%2").arg(
+						      QString::number(far, 'f'),
+						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
+
+    // Write FAR@TAR Table (FatT)
+    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
+      lines.append(qPrintable(QString("FatT,%1,%2").arg(
+                         QString::number(tar, 'f', 2),
+                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
+
+    //Write CMC Table (CT)
+    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
+    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
+    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
+    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
+    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
+    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
+
+    // Write FAR/TAR Bar Chart (BC)
+    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
+    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
+    return result;
+}
+
+// Attempt to read template size from enrolled gallery and write to output CSV
+static size_t appendTemplateSize(QStringList &lines, const QString &target)
+{
+    size_t maxSize(0);
+    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
+        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
+        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
+    }
+    return maxSize;
+}
+
+// Write Cumulative Match Characteristic (CMC) curve
+static void appendCMC(QStringList &lines, const QVector<int> &firstGenuineReturns)
+{
+    for (int i=1; i<=Max_Retrieval; i++) {
+        const float retrievalRate = getCMC(firstGenuineReturns, i);
+        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
+    }
+}
+
+static void printSummary(const QList<OperatingPoint> &operatingPoints, const QVector<int> &firstGenuineReturns, size_t maxSize)
+{
+    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
+    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
+    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
+    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
+    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
+
+    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+}
+
 float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &query, const QString &csv, int partition)
 {
     return Evaluate(scores, constructMatchingMask(scores, target, query, partition), csv, QString(), QString(), 0);
@@ -141,6 +221,16 @@ float Evaluate(const cv::Mat &scores, const FileList &target, const FileList &qu
 
 float Evaluate(const QString &simmat, const QString &mask, const QString &csv, unsigned int matches)
 {
+    // Matrices with more comparisons than a QList can hold are evaluated in bounded memory
+    const File simmatFile(simmat);
+    if (simmatFile.suffix() == "mtx") {
+        const BEE::MatrixReader reader(simmatFile);
+        if (simmatFile.getBool("streaming") || (qint64(reader.rows)*reader.cols > std::numeric_limits<int>::max())) {
+            if (matches != 0) qWarning("Streaming evaluation does not list matches.");
+            return StreamingEvaluate(simmat, mask, csv);
+        }
+    }
+
     qDebug("Evaluating %s%s%s",
            qPrintable(simmat),
            mask.isEmpty() ? "" : qPrintable(" with " + mask),
@@ -302,50 +392,8 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QSt
         }
     }
 
-    // Write Detection Error Tradeoff (DET), PRE, REC
-    float FAR=0.000001;
-    for (int i=0; i<Max_Points; i++) {
-        OperatingPoint operatingPoint = getOperatingPointGivenFAR(operatingPoints, FAR);
-        lines.append(QString("DET,%1,%2").arg(QString::number(FAR),
-                                              QString::number(1-operatingPoint.TAR)));
-        lines.append(QString("FAR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(FAR)));
-        lines.append(QString("FRR,%1,%2").arg(QString::number(operatingPoint.score),
-                                              QString::number(1-operatingPoint.TAR)));
-        //multiplier roughly spans 10E-6 to 1
-        FAR *=1.02807;
-    }
-
-    // Write TAR@FAR Table (FT)
-    foreach (float far, QList<float>() << 1e-6 << 1e-5 << 1e-4 << 1e-3 << 1e-2 << 1e-1)
-      lines.append(qPrintable(QString("FT,%1,%2").arg(
-						      QString::number(far, 'f'),
-						      QString::number(getOperatingPointGivenFAR(operatingPoints, far).TAR, 'f', 3))));
-
-    // Write FAR@TAR Table (FatT)
-    foreach (float tar, QList<float>() << 0.95 << 0.85 << 0.75 << 0.65 << 0.5 << 0.4)
-      lines.append(qPrintable(QString("FatT,%1,%2").arg(
-                         QString::number(tar, 'f', 2),
-                         QString::number(getOperatingPointGivenTAR(operatingPoints, tar).FAR, 'f', 3))));
-
-    //Write CMC Table (CT)
-    lines.append(qPrintable(QString("CT,1,%1").arg(QString::number(getCMC(firstGenuineReturns, 1), 'f', 3))));
-    lines.append(qPrintable(QString("CT,5,%1").arg(QString::number(getCMC(firstGenuineReturns, 5), 'f', 3))));
-    lines.append(qPrintable(QString("CT,10,%1").arg(QString::number(getCMC(firstGenuineReturns, 10), 'f', 3))));
-    lines.append(qPrintable(QString("CT,20,%1").arg(QString::number(getCMC(firstGenuineReturns, 20), 'f', 3))));
-    lines.append(qPrintable(QString("CT,50,%1").arg(QString::number(getCMC(firstGenuineReturns, 50), 'f', 3))));
-    lines.append(qPrintable(QString("CT,100,%1").arg(QString::number(getCMC(firstGenuineReturns, 100), 'f', 3))));
-
-    // Write FAR/TAR Bar Chart (BC)
-    lines.append(qPrintable(QString("BC,0.001,%1").arg(QString::number(getOperatingPointGivenFAR(operatingPoints, 0.001).TAR, 'f', 3))));
-    lines.append(qPrintable(QString("BC,0.01,%1").arg(QString::number(result = getOperatingPointGivenFAR(operatingPoints, 0.01).TAR, 'f', 3))));
-
-    // Attempt to read template size from enrolled gallery and write to output CSV
-    size_t maxSize(0);
-    if (target.endsWith(".gal") && QFileInfo(target).exists()) {
-        foreach (const Template &t, TemplateList::fromGallery(target)) maxSize = max(maxSize, t.bytes());
-        lines.append(QString("TS,,%1").arg(QString::number(maxSize)));
-    }
+    result = appendOperatingPoints(lines, operatingPoints, firstGenuineReturns);
+    const size_t maxSize = appendTemplateSize(lines, target);
 
     // Write SD & KDE
     int points = qMin(qMin(Max_Points, genuines.size()), impostors.size());
@@ -365,22 +413,9 @@ float Evaluate(const Mat &simmat, const Mat &mask, const QString &csv, const QSt
         }
     }
 
-    // Write Cumulative Match Characteristic (CMC) curve
-    const int Max_Retrieval = 200;
-    const int Report_Retrieval = 5;
-    for (int i=1; i<=Max_Retrieval; i++) {
-        const float retrievalRate = getCMC(firstGenuineReturns, i);
-        lines.append(qPrintable(QString("CMC,%1,%2").arg(QString::number(i), QString::number(retrievalRate))));
-    }
-
+    appendCMC(lines, firstGenuineReturns);
     QtUtils::writeFile(csv, lines);
-    if (maxSize > 0) qDebug("Template Size: %i bytes", (int)maxSize);
-    qDebug("TAR @ FAR = 0.01:    %.3f",getOperatingPointGivenFAR(operatingPoints, 0.01).TAR);
-    qDebug("TAR @ FAR = 0.001:   %.3f",getOperatingPointGivenFAR(operatingPoints, 0.001).TAR);
-    qDebug("TAR @ FAR = 0.0001:  %.3f",getOperatingPointGivenFAR(operatingPoints, 0.0001).TAR);
-    qDebug("TAR @ FAR = 0.00001: %.3f",getOperatingPointGivenFAR(operatingPoints, 0.00001).TAR);
-
-    qDebug("\nRetrieval Rate @ Rank = %d: %.3f", Report_Retrieval, getCMC(firstGenuineReturns, Report_Retrieval));
+    printSummary(operatingPoints, firstGenuineReturns, maxSize);
 
     return result;
 }
@@ -396,6 +431,275 @@ void assertEval(const QString &simmat, const QString &mask, float accuracy)
     }
 }
 
+// Maps a float to an unsigned integer with the same ordering
+static inline quint32 scoreKey(float score)
+{
+    quint32 bits;
+    memcpy(&bits, &score, sizeof(bits));
+    return (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+}
+
+static inline float keyScore(quint32 key)
+{
+    const quint32 bits = (key & 0x80000000) ? (key & 0x7FFFFFFF) : ~key;
+    float score;
+    memcpy(&score, &bits, sizeof(score));
+    return score;
+}
+
+static const int Histogram_Bits = 20;
+
+static inline int scoreBin(float score)
+{
+    return scoreKey(score) >> (32 - Histogram_Bits);
+}
+
+// Lowest score that falls in a bin
+static inline float binScore(int bin)
+{
+    const float score = keyScore(quint32(bin) << (32 - Histogram_Bits));
+    return (score == score) ? score : -std::numeric_limits<float>::infinity(); // The bin holding -inf starts with NaNs
+}
+
+// Keep the largest values in a bounded min-heap
+static inline void keepTop(QVector<float> &heap, int size, float score)
+{
+    if (heap.size() < size) {
+        heap.append(score);
+        std::push_heap(heap.begin(), heap.end(), std::greater<float>());
+    } else if (score > heap.first()) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<float>());
+        heap.last() = score;
+        std::push_heap(heap.begin(), heap.end(), std::greater<float>());
+    }
+}
+
+// Difference in TAR between the operating points bracketing FAR
+static float getTARErrorBound(const QList<OperatingPoint> &operatingPoints, float FAR)
+{
+    int index = 0;
+    while (operatingPoints[index].FAR < FAR) {
+        index++;
+        if (index == operatingPoints.size())
+            return 1 - operatingPoints.last().TAR;
+    }
+    return operatingPoints[index].TAR - (index == 0 ? 0 : operatingPoints[index-1].TAR);
+}
+
+// Scores at evenly spaced ranks in descending order, as the bin edge holding each rank
+static QList<float> sampleScores(const QVector<qint64> &bins, qint64 count, int points, float minScore)
+{
+    QList<float> scores;
+    int bin = bins.size()-1;
+    qint64 above = bins[bin];
+    for (int i=0; i<points; i++) {
+        const qint64 rank = double(i) / double(points-1) * double(count-1);
+        while (above <= rank) above += bins[--bin];
+        scores.append(std::max(binScore(bin), minScore));
+    }
+    return scores;
+}
+
+StreamingEvaluation::StreamingEvaluation(int queries, int reservoirSize)
+    : reservoirSize(reservoirSize), genuineCount(0), impostorCount(0), nanCount(0),
+      minGenuineScore(std::numeric_limits<float>::max()), minImpostorScore(std::numeric_limits<float>::max()),
+      genuineBins(1 << Histogram_Bits, 0), impostorBins(1 << Histogram_Bits, 0),
+      bestGenuines(queries, std::numeric_limits<float>::quiet_NaN()), queryImpostors(queries)
+{}
+
+void StreamingEvaluation::add(const Mat &simmat, const Mat &mask, int rowOffset)
+{
+    if (simmat.size() != mask.size())
+        qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).",
+               simmat.rows, simmat.cols, mask.rows, mask.cols);
+
+    if (simmat.type() != CV_32FC1)
+        qFatal("Invalid simmat format");
+
+    if (mask.type() != CV_8UC1)
+        qFatal("Invalid mask format");
+
+    for (int i=0; i<simmat.rows; i++) {
+        const BEE::SimmatValue *scores = simmat.ptr<BEE::SimmatValue>(i);
+        const BEE::MaskValue *masks = mask.ptr<BEE::MaskValue>(i);
+        for (int j=0; j<simmat.cols; j++)
+            add(scores[j], masks[j], rowOffset + i);
+    }
+}
+
+void StreamingEvaluation::add(float score, uchar mask, int query)
+{
+    if (mask == BEE::DontCare) return;
+    if (score != score) { nanCount++; return; }
+
+    const bool unrenderable = (score == -std::numeric_limits<float>::max());
+    if (mask == BEE::Match) {
+        genuineCount++;
+        genuineBins[scoreBin(score)]++;
+        keepTop(topGenuines, reservoirSize, score);
+        if (!(bestGenuines[query] >= score))
+            bestGenuines[query] = score;
+        if (!unrenderable && (score < minGenuineScore))
+            minGenuineScore = score;
+    } else {
+        impostorCount++;
+        impostorBins[scoreBin(score)]++;
+        keepTop(topImpostors, reservoirSize, score);
+        keepTop(queryImpostors[query], Max_Retrieval, score);
+        if (!unrenderable && (score < minImpostorScore))
+            minImpostorScore = score;
+    }
+}
+
+float StreamingEvaluation::write(const QString &csv, int targets, const QString &target) const
+{
+    if (nanCount > 0) qWarning("Encountered %lld NaN scores!", (long long)nanCount);
+    if (genuineCount == 0) qFatal("No genuine scores!");
+    if (impostorCount == 0) qFatal("No impostor scores!");
+
+    // Scores above the cutoff are all retained exactly
+    float cutoff = -std::numeric_limits<float>::infinity();
+    if (topGenuines.size() == reservoirSize) cutoff = std::max(cutoff, topGenuines.first());
+    if (topImpostors.size() == reservoirSize) cutoff = std::max(cutoff, topImpostors.first());
+
+    QVector<float> genuines, impostors;
+    foreach (float score, topGenuines) if (score > cutoff) genuines.append(score);
+    foreach (float score, topImpostors) if (score > cutoff) impostors.append(score);
+    std::sort(genuines.begin(), genuines.end(), std::greater<float>());
+    std::sort(impostors.begin(), impostors.end(), std::greater<float>());
+
+    QList<OperatingPoint> operatingPoints;
+    qint64 falsePositives = 0, previousFalsePositives = 0;
+    qint64 truePositives = 0, previousTruePositives = 0;
+    int genuineIndex = 0, impostorIndex = 0;
+
+    // Exact operating points, as in Evaluate()
+    while ((genuineIndex < genuines.size()) || (impostorIndex < impostors.size())) {
+        float thresh = -std::numeric_limits<float>::infinity();
+        if (genuineIndex < genuines.size()) thresh = genuines[genuineIndex];
+        if (impostorIndex < impostors.size()) thresh = std::max(thresh, impostors[impostorIndex]);
+        while ((genuineIndex < genuines.size()) && (genuines[genuineIndex] == thresh)) { truePositives++; genuineIndex++; }
+        while ((impostorIndex < impostors.size()) && (impostors[impostorIndex] == thresh)) { falsePositives++; impostorIndex++; }
+
+        if ((falsePositives > previousFalsePositives) &&
+            (truePositives > previousTruePositives)) {
+            operatingPoints.append(OperatingPoint(thresh, float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    // Operating points at bin edges below the cutoff, the counts above each edge are exact
+    const int cutoffBin = scoreBin(cutoff);
+    falsePositives = truePositives = 0;
+    for (int bin=genuineBins.size()-1; bin>=0; bin--) {
+        truePositives += genuineBins[bin];
+        falsePositives += impostorBins[bin];
+        if ((bin <= cutoffBin) &&
+            (falsePositives > previousFalsePositives) &&
+            (truePositives > previousTruePositives)) {
+            operatingPoints.append(OperatingPoint(binScore(bin), float(falsePositives)/impostorCount, float(truePositives)/genuineCount));
+            previousFalsePositives = falsePositives;
+            previousTruePositives = truePositives;
+        }
+    }
+
+    if (operatingPoints.size() == 0) operatingPoints.append(OperatingPoint(1, 1, 1));
+    if (operatingPoints.size() == 1) operatingPoints.prepend(OperatingPoint(0, 0, 0));
+    if (operatingPoints.size() > 2)  operatingPoints.takeLast(); // Remove point (1,1)
+
+    // Rank of the best genuine score of each query, impostors tied with it are ranked ahead
+    QVector<int> firstGenuineReturns(bestGenuines.size(), 0);
+    for (int i=0; i<bestGenuines.size(); i++) {
+        const float bestGenuine = bestGenuines[i];
+        if (bestGenuine != bestGenuine) continue;
+        int higherImpostors = 0;
+        foreach (float score, queryImpostors[i])
+            if (score >= bestGenuine) higherImpostors++;
+        firstGenuineReturns[i] = higherImpostors + 1;
+    }
+
+    // Write Metadata table
+    QStringList lines;
+    lines.append("Plot,X,Y");
+    lines.append("Metadata,"+QString::number(targets)+",Gallery");
+    lines.append("Metadata,"+QString::number(bestGenuines.size())+",Probe");
+    lines.append("Metadata,"+QString::number(genuineCount)+",Genuine");
+    lines.append("Metadata,"+QString::number(impostorCount)+",Impostor");
+    lines.append("Metadata,"+QString::number(qint64(targets)*bestGenuines.size()-(genuineCount+impostorCount))+",Ignored");
+
+    const float result = appendOperatingPoints(lines, operatingPoints, firstGenuineReturns);
+    const size_t maxSize = appendTemplateSize(lines, target);
+
+    // Write SD
+    const int points = qMin(qMin(qint64(Max_Points), genuineCount), impostorCount);
+    if (points > 1) {
+        const QList<float> sampledGenuineScores = sampleScores(genuineBins, genuineCount, points, minGenuineScore);
+        const QList<float> sampledImpostorScores = sampleScores(impostorBins, impostorCount, points, minImpostorScore);
+        for (int i=0; i<points; i++) {
+            lines.append(QString("SD,%1,Genuine").arg(QString::number(sampledGenuineScores[i])));
+            lines.append(QString("SD,%1,Impostor").arg(QString::number(sampledImpostorScores[i])));
+        }
+    }
+
+    appendCMC(lines, firstGenuineReturns);
+    QtUtils::writeFile(csv, lines);
+    printSummary(operatingPoints, firstGenuineReturns, maxSize);
+    foreach (float far, QList<float>() << 0.01 << 0.001 << 0.0001 << 0.00001)
+        qDebug("TAR @ FAR = %g error bound: %.4f", far, getTARErrorBound(operatingPoints, far));
+
+    return result;
+}
+
+float StreamingEvaluate(const QString &simmat, const QString &mask, const QString &csv)
+{
+    qDebug("Streaming evaluation of %s%s%s",
+           qPrintable(simmat),
+           mask.isEmpty() ? "" : qPrintable(" with " + mask),
+           csv.isEmpty() ? "" : qPrintable(" to " + csv));
+
+    BEE::MatrixReader scores(simmat);
+    if (scores.isMask) qFatal("Expected a similarity matrix, got a mask.");
+    const QString target = scores.targetSigset, query = scores.querySigset;
+    const int rows = scores.rows, cols = scores.cols;
+
+    // Read the mask from a matrix or build it from the galleries a block at a time
+    QScopedPointer<BEE::MatrixReader> truth;
+    FileList targetFiles, queryFiles;
+    bool pairwise = false;
+    if (mask.isEmpty()) {
+        if (target.isEmpty()) qFatal("Unspecified target gallery.");
+        if (query.isEmpty()) qFatal("Unspecified query gallery.");
+        targetFiles = TemplateList::fromGallery(target).files();
+        queryFiles = TemplateList::fromGallery(query).files();
+        pairwise = (cols == 1) && (targetFiles.size() == queryFiles.size());
+        if (!pairwise && ((targetFiles.size() != cols) || (queryFiles.size() != rows)))
+            qFatal("Unable to construct mask for %d by %d score matrix from %d element query set, and %d element target set ", rows, cols, queryFiles.size(), targetFiles.size());
+    } else {
+        const QString suffix = File(mask).suffix();
+        if ((suffix != "mtx") && (suffix != "mask")) qFatal("Streaming evaluation requires a .mtx or .mask mask.");
+        truth.reset(new BEE::MatrixReader(mask));
+        if (!truth->isMask) qFatal("Invalid mask format");
+        if ((truth->rows != rows) || (truth->cols != cols))
+            qFatal("Similarity matrix (%ix%i) differs in size from mask matrix (%ix%i).", rows, cols, truth->rows, truth->cols);
+    }
+
+    StreamingEvaluation evaluation(rows);
+    Mat block;
+    int i;
+    while (scores.nextBlock(block, &i)) {
+        const int n = block.rows;
+        if (!truth.isNull())
+            evaluation.add(block, truth->read(i, n), i);
+        else if (pairwise)
+            evaluation.add(block, BEE::makePairwiseMask(FileList(targetFiles.mid(i, n)), FileList(queryFiles.mid(i, n))), i);
+        else
+            evaluation.add(block, BEE::makeMask(targetFiles, FileList(queryFiles.mid(i, n))), i);
+    }
+
+    return evaluation.write(csv, cols, target);
+}
+
 struct GenImpCounts
 {
     GenImpCounts()
@@ -19,6 +19,7 @@
 
 #include <QList>
 #include <QString>
+#include <QVector>
 #include "openbr/openbr_plugin.h"
 
 namespace br
@@ -28,6 +29,46 @@ namespace br
     float Evaluate(const cv::Mat &scores, const cv::Mat &masks, const QString &csv = "", const QString &target = "", const QString &query = "", unsigned int matches = 0);
     void assertEval(const QString &simmat, const QString &mask, float accuracy); // Check to see if -eval achieves a given TAR @ FAR = 0.001
     float InplaceEval(const QString & simmat, const QString & target, const QString & query, const QString & csv = "");
+    float StreamingEvaluate(const QString &simmat, const QString &mask = "", const QString &csv = ""); // Evaluate() in bounded memory, see StreamingEvaluation
+
+    /*!
+     * \brief Evaluates a similarity matrix in bounded memory as it is produced, a block of rows or a score at a time.
+     *
+     * Instead of sorting every comparison like Evaluate(), scores are counted in genuine and impostor histograms
+     * with 2^20 bins over the whole float range (each bin spans 2^-11 of its scores' magnitude).
+     * The top \em reservoirSize genuine and impostor scores are also kept exactly,
+     * as are the top 200 impostor scores of each query for the CMC.
+     * Memory is therefore O(reservoirSize + 200*queries), independent of the number of targets.
+     *
+     * Error bound with respect to Evaluate():
+     * - Operating points above the lowest retained score are exact, so low FAR results are exact
+     *   whenever fewer than \em reservoirSize impostors score above the threshold.
+     * - Below it, operating points are computed at bin edges, where they are also exact.
+     *   TAR @ FAR interpolates linearly between the two points bracketing the requested FAR,
+     *   so it differs from the exact value by at most the TAR difference of those points,
+     *   i.e. the fraction of genuine scores falling in one bin. This bound is printed next to each TAR @ FAR.
+     * - CMC is exact up to rank 200.
+     * - Score distributions (SD) are sampled at bin edges.
+     *
+     * Not thread safe, callers adding from several threads must serialize add().
+     */
+    class StreamingEvaluation
+    {
+    public:
+        StreamingEvaluation(int queries, int reservoirSize = 1 << 20);
+        void add(const cv::Mat &simmat, const cv::Mat &mask, int rowOffset); /*!< \brief Add a block of rows starting at query \em rowOffset. */
+        void add(float score, uchar mask, int query); /*!< \brief Add a single score with its BEE::MaskValue. */
+        float write(const QString &csv, int targets, const QString &target = "") const; /*!< \brief Write results like Evaluate(), returns TAR @ FAR = 0.01. */
+
+    private:
+        int reservoirSize;
+        qint64 genuineCount, impostorCount, nanCount;
+        float minGenuineScore, minImpostorScore;
+        QVector<qint64> genuineBins, impostorBins;
+        QVector<float> topGenuines, topImpostors; // Min-heaps
+        QVector<float> bestGenuines; // Per query, NaN until a genuine score is added
+        QVector< QVector<float> > queryImpostors; // Per query min-heaps
+    };
 
     void EvalClassification(const QString &predictedGallery, const QString &truthGallery, QString predictedProperty = "", QString truthProperty = "");
     float EvalDetection(const QString &predictedGallery, const QString &truthGallery, const QString &csv = "", bool normalize = false, int minSize = 0, int maxSize = 0); // Return average overlap
@@ -28,29 +28,54 @@
 
 using namespace cv;
 
-static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
+// Running statistics of the scores considered by normalizeMatrix()
+struct ScoreStatistics
 {
-    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
-        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
+    float min, max;
+    double mean, sumSquares;
+    qint64 count;
 
-    if (method == "None") return;
+    ScoreStatistics()
+        : min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()), mean(0), sumSquares(0), count(0) {}
+
+    void add(const Mat &matrix, const Mat &mask)
+    {
+        if (matrix.rows != mask.rows && matrix.cols != mask.cols)
+            qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
 
-    QList<float> vals; vals.reserve(matrix.rows*matrix.cols);
-    for (int i=0; i<matrix.rows; i++) {
-        for (int j=0; j<matrix.cols; j++) {
-            float val = matrix.at<float>(i,j);
-            if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
-                (val == -std::numeric_limits<float>::max()) ||
-                (val ==  std::numeric_limits<float>::max()))
-                continue;
-            vals.append(val);
+        for (int i=0; i<matrix.rows; i++) {
+            for (int j=0; j<matrix.cols; j++) {
+                float val = matrix.at<float>(i,j);
+                if ((mask.at<BEE::MaskValue>(i,j) == BEE::DontCare) ||
+                    (val == -std::numeric_limits<float>::max()) ||
+                    (val ==  std::numeric_limits<float>::max()))
+                    continue;
+                min = std::min(min, val);
+                max = std::max(max, val);
+                // Welford's algorithm
+                count++;
+                const double delta = val - mean;
+                mean += delta / count;
+                sumSquares += delta * (val - mean);
+            }
         }
     }
 
-    float min, max;
-    double mean, stddev;
-    Common::MinMax(vals, &min, &max);
-    Common::MeanStdDev(vals, &mean, &stddev);
+    double stddev() const
+    {
+        return count == 0 ? 0 : sqrt(sumSquares / count);
+    }
+};
+
+static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method, const ScoreStatistics &statistics)
+{
+    if (matrix.rows != mask.rows && matrix.cols != mask.cols)
+        qFatal("Similarity matrix (%d, %d) and mask (%d, %d) size mismatch.", matrix.rows, matrix.cols, mask.rows, mask.cols);
+
+    if (method == "None") return;
+
+    const float min = statistics.min, max = statistics.max;
+    const double mean = statistics.mean, stddev = statistics.stddev();
 
     if (method == "MinMax") {
         for (int i=0; i<matrix.rows; i++) {
@@ -78,90 +103,121 @@ static void normalizeMatrix(Mat &matrix, const Mat &mask, const QString &method)
     }
 }
 
+static Mat fuseMatrices(const QList<Mat> &matrices, const Mat &matrix_mask, const QString &fusion)
+{
+    Mat fused;
+    if (fusion == "Max") {
+        max(matrices[0], matrices[1], fused);
+        for (int i=2; i<matrices.size(); i++)
+            max(fused, matrices[i], fused);
+    } else if (fusion == "Min") {
+        min(matrices[0], matrices[1], fused);
+        for (int i=2; i<matrices.size(); i++)
+            min(fused, matrices[i], fused);
+    } else if (fusion.startsWith("Sum")) {
+        QList<float> weights;
+        QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
+        if (words.size() == 0) {
+            for (int k=0; k<matrices.size(); k++)
+                weights.append(1);
+        } else if (words.size() == matrices.size()) {
+            bool ok;
+            for (int k=0; k<matrices.size(); k++) {
+                float weight = words[k].toFloat(&ok);
+                if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
+                weights.append(weight);
+            }
+        } else {
+            qFatal("Number of weights does not match number of similarity matrices.");
+        }
+
+        addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
+        for (int i=2; i<matrices.size(); i++)
+            addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
+    } else if (fusion == "Replace") {
+        if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
+        fused = matrices.first().clone();
+        matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
+    } else if (fusion == "Difference") {
+        if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
+        subtract(matrices[0], matrices[1], fused);
+    } else if (fusion == "None") {
+        fused = matrices[0];
+    } else {
+        qFatal("Invalid fusion method %s.", qPrintable(fusion));
+    }
+    return fused;
+}
+
+// Matrices are processed a block of rows at a time: a first pass collects normalization statistics,
+// a second one normalizes, fuses and writes each block.
 void br::Fuse(const QStringList &inputSimmats, const QString &normalization, const QString &fusion, const QString &outputSimmat)
 {
     qDebug("Fusing %d to %s", inputSimmats.size(), qPrintable(outputSimmat));
 
     QString target, query, previousTarget, previousQuery;
-    QList<Mat> originalMatrices;
+    QList< QSharedPointer<BEE::MatrixReader> > readers;
     foreach (const QString &simmat, inputSimmats) {
-        originalMatrices.append(BEE::readMatrix(simmat,&target,&query));
+        readers.append(QSharedPointer<BEE::MatrixReader>(new BEE::MatrixReader(simmat)));
+        target = readers.last()->targetSigset;
+        query = readers.last()->querySigset;
         // Make we're fusing score matrices for the same set of targets and querys
         if (!previousTarget.isEmpty() && !previousQuery.isEmpty() && (previousTarget != target || previousQuery != query))
             qFatal("Target or query files are not the same across fused matrices.");
+        if ((readers.last()->rows != readers.first()->rows) || (readers.last()->cols != readers.first()->cols))
+            qFatal("Fused matrices differ in size.");
         previousTarget = target; previousQuery = query;
     }
 
-    if ((originalMatrices.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
-    if ((originalMatrices.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
+    if ((readers.size() < 2) && (fusion != "None")) qFatal("Expected at least two similarity matrices.");
+    if ((readers.size() > 1) && (fusion == "None")) qFatal("Expected exactly one similarity matrix.");
 
     const FileList targetFiles = TemplateList::fromGallery(target).files();
     const FileList queryFiles = TemplateList::fromGallery(query).files();
 
-    int partition = 0;
-    int crossValidate = Globals->crossValidate;
-    Mat buffer = Mat::zeros(originalMatrices.last().size(),originalMatrices.last().type());
-
-    do {
-        QList<Mat> matrices;
-        foreach (const Mat& matrix, originalMatrices)
-            matrices.append(matrix.clone());
-
-        Mat matrix_mask = BEE::makeMask(targetFiles,queryFiles,partition);
-        for (int i=0; i<matrices.size(); i++)
-            normalizeMatrix(matrices[i], matrix_mask, normalization);
-
-        Mat fused;
-        if (fusion == "Max") {
-            max(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                max(fused, matrices[i], fused);
-        } else if (fusion == "Min") {
-            min(matrices[0], matrices[1], fused);
-            for (int i=2; i<matrices.size(); i++)
-                min(fused, matrices[i], fused);
-        } else if (fusion.startsWith("Sum")) {
-            QList<float> weights;
-            QStringList words = fusion.right(fusion.size()-3).split(":", QString::SkipEmptyParts);
-            if (words.size() == 0) {
-                for (int k=0; k<matrices.size(); k++)
-                    weights.append(1);
-            } else if (words.size() == matrices.size()) {
-                bool ok;
-                for (int k=0; k<matrices.size(); k++) {
-                    float weight = words[k].toFloat(&ok);
-                    if (!ok) qFatal("Non-numerical weight %s.", qPrintable(words[k]));
-                    weights.append(weight);
-                }
-            } else {
-                qFatal("Number of weights does not match number of similarity matrices.");
+    const int partitions = std::max(1, Globals->crossValidate);
+    const int rows = readers.last()->rows;
+    const int cols = readers.last()->cols;
+    const int blockRows = readers.last()->blockRows;
+
+    // Normalization statistics of each matrix in each partition
+    QVector<ScoreStatistics> statistics(partitions * readers.size());
+    if (normalization != "None") {
+        for (int row=0; row<rows; row+=blockRows) {
+            const int count = std::min(blockRows, rows-row);
+            const FileList blockQueries(queryFiles.mid(row, count));
+            for (int partition=0; partition<partitions; partition++) {
+                Mat matrix_mask = BEE::makeMask(targetFiles, blockQueries, partition);
+                for (int i=0; i<readers.size(); i++)
+                    statistics[partition*readers.size()+i].add(readers[i]->read(row, count), matrix_mask);
             }
-
-            addWeighted(matrices[0], weights[0], matrices[1], weights[1], 0, fused);
-            for (int i=2; i<matrices.size(); i++)
-                addWeighted(fused, 1, matrices[i], weights[i], 0, fused);
-        } else if (fusion == "Replace") {
-            if (matrices.size() != 2) qFatal("Replace fusion requires exactly two matrices.");
-            fused = matrices.first().clone();
-            matrices.last().copyTo(fused, matrix_mask != BEE::DontCare);
-        } else if (fusion == "Difference") {
-            if (matrices.size() != 2) qFatal("Difference fusion requires exactly two matrices.");
-            subtract(matrices[0], matrices[1], fused);
-        } else if (fusion == "None") {
-            fused = matrices[0];
-        } else {
-            qFatal("Invalid fusion method %s.", qPrintable(fusion));
         }
+    }
+
+    BEE::MatrixWriter writer(outputSimmat, rows, cols, CV_32FC1);
+    for (int row=0; row<rows; row+=blockRows) {
+        const int count = std::min(blockRows, rows-row);
+        const FileList blockQueries(queryFiles.mid(row, count));
+        Mat buffer = Mat::zeros(count, cols, CV_32FC1);
 
-        // We don't want to add scores where the mask says we shouldn't care
-        Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
-        buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
+        for (int partition=0; partition<partitions; partition++) {
+            Mat matrix_mask = BEE::makeMask(targetFiles, blockQueries, partition);
 
-        add(buffer,fused,buffer,buffer_mask);
+            QList<Mat> matrices;
+            for (int i=0; i<readers.size(); i++) {
+                matrices.append(readers[i]->read(row, count, true));
+                normalizeMatrix(matrices[i], matrix_mask, normalization, statistics[partition*readers.size()+i]);
+            }
+
+            Mat fused = fuseMatrices(matrices, matrix_mask, fusion);
 
-        partition++;
+            // We don't want to add scores where the mask says we shouldn't care
+            Mat buffer_mask = Mat::ones(matrix_mask.size(),CV_8UC1);
+            buffer_mask.setTo(0,matrix_mask==BEE::DontCare);
 
-    } while (partition < crossValidate);
+            add(buffer,fused,buffer,buffer_mask);
+        }
 
-    BEE::writeMatrix(buffer, outputSimmat);
+        writer.append(buffer);
+    }
 }
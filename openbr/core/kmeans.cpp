@@ -0,0 +1,186 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QRunnable>
+#include <QVector>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+
+#include "kmeans.h"
+#include "opencvutils.h"
+#include "scheduler.h"
+
+using namespace cv;
+
+namespace br
+{
+
+static const int BlockRows = 1024;
+
+struct DrawOrder
+{
+    const QList<int> &draws;
+    DrawOrder(const QList<int> &draws) : draws(draws) {}
+    bool operator()(int a, int b) const { return draws[a] < draws[b]; }
+};
+
+// Fill sample with rows drawn uniformly from the matrices
+static void sampleRows(const QList<Mat> &matrices, int rows, RNG &rng, Mat &sample)
+{
+    QList<int> draws;
+    for (int i=0; i<sample.rows; i++)
+        draws.append(rng.uniform(0, rows));
+    QVector<int> order(draws.size());
+    for (int i=0; i<order.size(); i++)
+        order[i] = i;
+
+    // Walk the matrices once with the draws in increasing order
+    std::sort(order.begin(), order.end(), DrawOrder(draws));
+    int matrix = 0, offset = 0;
+    foreach (int i, order) {
+        while (draws[i] >= offset + matrices[matrix].rows) {
+            offset += matrices[matrix].rows;
+            matrix++;
+        }
+        matrices[matrix].row(draws[i] - offset).convertTo(sample.row(i), CV_32F);
+    }
+}
+
+class NearestTask : public QRunnable
+{
+    const KMeans *kmeans;
+    Mat data, indices;
+    int k;
+
+public:
+    NearestTask(const KMeans *kmeans, const Mat &data, int k, const Mat &indices)
+        : kmeans(kmeans), data(data), indices(indices), k(k) {}
+
+    void run()
+    {
+        Mat result;
+        kmeans->nearest(data, k, result);
+        result.copyTo(indices);
+    }
+};
+
+void KMeans::train(const QList<Mat> &matrices, int k, int batchSize, int iterations)
+{
+    if (batchSize > 0) {
+        trainMiniBatch(matrices, k, batchSize, iterations);
+    } else {
+        Mat bestLabels, centers;
+        const double compactness = kmeans(OpenCVUtils::toMatByRow(matrices), k, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
+        qDebug("KMeans compactness = %f", compactness);
+        setCenters(centers);
+    }
+}
+
+void KMeans::trainMiniBatch(const QList<Mat> &matrices, int k, int batchSize, int iterations)
+{
+    int rows = 0;
+    foreach (const Mat &m, matrices)
+        rows += m.rows;
+    if (rows == 0)
+        qFatal("No data to train KMeans.");
+    const int dims = matrices.first().cols;
+
+    RNG rng;
+    Mat batch(std::min(batchSize, rows), dims, CV_32FC1);
+    // Initialize with k-means++ seeding on a random batch
+    sampleRows(matrices, rows, rng, batch);
+    {
+        Mat labels, centers, seed = batch;
+        if (seed.rows < k) {
+            seed.create(std::min(k, rows), dims, CV_32FC1);
+            sampleRows(matrices, rows, rng, seed);
+        }
+        kmeans(seed, k, labels, TermCriteria(TermCriteria::MAX_ITER, 1, 0), 1, KMEANS_PP_CENTERS, centers);
+        means = centers;
+    }
+
+    QVector<int> counts(means.rows, 0);
+    for (int iteration=0; iteration<iterations; iteration++) {
+        sampleRows(matrices, rows, rng, batch);
+        setCenters(means);
+        Mat assignments;
+        parallelNearest(batch, 1, assignments);
+
+        // Per-center learning rates decay as 1/count
+        for (int i=0; i<batch.rows; i++) {
+            const int c = assignments.at<int>(i, 0);
+            counts[c]++;
+            Mat center = means.row(c);
+            center += (batch.row(i) - center) / counts[c];
+        }
+    }
+    setCenters(means);
+}
+
+void KMeans::nearest(const Mat &data, int k, Mat &indices) const
+{
+    k = std::min(k, means.rows);
+    indices.create(data.rows, k, CV_32SC1);
+    QVector< QPair<float,int> > scores(means.rows);
+    for (int begin=0; begin<data.rows; begin+=BlockRows) {
+        const int end = std::min(begin+BlockRows, data.rows);
+        Mat products;
+        gemm(data.rowRange(begin, end), means, -2, Mat(), 0, products, GEMM_2_T);
+        for (int i=begin; i<end; i++) {
+            const float *product = products.ptr<float>(i-begin);
+            const float *norm = norms.ptr<float>();
+            for (int j=0; j<means.rows; j++)
+                scores[j] = QPair<float,int>(product[j] + norm[j], j);
+            std::partial_sort(scores.begin(), scores.begin()+k, scores.end());
+            for (int j=0; j<k; j++)
+                indices.at<int>(i, j) = scores[j].second;
+        }
+    }
+}
+
+void KMeans::parallelNearest(const Mat &data, int k, Mat &indices) const
+{
+    indices.create(data.rows, std::min(k, means.rows), CV_32SC1);
+    Scheduler::Group tasks;
+    for (int i=0; i<data.rows; i+=BlockRows) {
+        const Range rows(i, std::min(i+BlockRows, data.rows));
+        tasks.start(new NearestTask(this, data.rowRange(rows), k, indices.rowRange(rows)));
+    }
+    tasks.wait();
+}
+
+void KMeans::setCenters(const Mat &centers)
+{
+    means = centers;
+    norms.create(1, means.rows, CV_32FC1);
+    for (int i=0; i<means.rows; i++)
+        norms.at<float>(0, i) = means.row(i).dot(means.row(i));
+}
+
+QDataStream &operator<<(QDataStream &stream, const KMeans &kmeans)
+{
+    return stream << kmeans.centers();
+}
+
+QDataStream &operator>>(QDataStream &stream, KMeans &kmeans)
+{
+    Mat centers;
+    stream >> centers;
+    kmeans.setCenters(centers);
+    return stream;
+}
+
+} // namespace br
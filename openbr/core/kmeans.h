@@ -0,0 +1,62 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_KMEANS_H
+#define BR_KMEANS_H
+
+#include <QDataStream>
+#include <QList>
+#include <opencv2/core/core.hpp>
+
+namespace br
+{
+
+/*!
+ * \brief k-means centers and the search for the nearest of them.
+ *
+ * Training runs OpenCV kmeans on all rows, or mini-batch k-means for many centers on many rows.
+ * Nearest centers are ranked by |c|^2 - 2x.c, so a block of rows is assigned with one matrix product.
+ */
+class KMeans
+{
+public:
+    /*!
+     * \brief Train \em k centers on the rows of \em matrices.
+     *
+     * If \em batchSize is positive, mini-batch k-means runs \em iterations updates, each with \em batchSize rows drawn at random,
+     * so the rows are never copied into one matrix.
+     */
+    void train(const QList<cv::Mat> &matrices, int k, int batchSize = 0, int iterations = 100);
+
+    void nearest(const cv::Mat &data, int k, cv::Mat &indices) const; /*!< \brief Indices of the \em k nearest centers to each row of \em data, nearest first. */
+    void parallelNearest(const cv::Mat &data, int k, cv::Mat &indices) const; /*!< \brief Like nearest(), with blocks of rows assigned in parallel. */
+
+    const cv::Mat &centers() const { return means; } /*!< \brief One center per row. */
+    void setCenters(const cv::Mat &centers);
+
+private:
+    cv::Mat means;
+    cv::Mat norms; // Squared magnitude of each center
+
+    void trainMiniBatch(const QList<cv::Mat> &matrices, int k, int batchSize, int iterations);
+};
+
+QDataStream &operator<<(QDataStream &stream, const KMeans &kmeans);
+QDataStream &operator>>(QDataStream &stream, KMeans &kmeans);
+
+} // namespace br
+
+#endif // BR_KMEANS_H
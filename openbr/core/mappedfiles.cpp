@@ -0,0 +1,107 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QByteArray>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QStringList>
+
+#include "mappedfiles.h"
+
+using namespace br;
+
+struct Mapping
+{
+    QSharedPointer<QFile> file;
+    QByteArray buffer; // The file's contents when it can't be mapped copy-on-write
+    QDateTime lastModified;
+    const uchar *data;
+    qint64 size;
+};
+
+static QMutex lock;
+static QHash<QString, Mapping> mappings; // By absolute file path
+static QHash<QString, QList<Mapping> > replaced; // Outdated mappings matrices may still reference
+static QStringList removals; // Files and directories to remove once unmapped
+
+const uchar *MappedFiles::map(const QString &fileName, qint64 *size)
+{
+    const QFileInfo info(fileName);
+    if (!info.exists())
+        qFatal("File %s does not exist", qPrintable(fileName));
+    const QString key = info.absoluteFilePath();
+
+    QMutexLocker locker(&lock);
+    if (mappings.contains(key)) {
+        const Mapping &mapping = mappings[key];
+        if ((mapping.size == info.size()) && (mapping.lastModified == info.lastModified())) {
+            *size = mapping.size;
+            return mapping.data;
+        }
+        replaced[key].append(mapping);
+    }
+
+    Mapping mapping;
+    mapping.file = QSharedPointer<QFile>(new QFile(key));
+    if (!mapping.file->open(QFile::ReadOnly))
+        qFatal("Unable to open %s for reading.", qPrintable(key));
+    mapping.lastModified = info.lastModified();
+    mapping.size = mapping.file->size();
+    mapping.data = NULL;
+    if (mapping.size > 0) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 4, 0)
+        mapping.data = mapping.file->map(0, mapping.size, QFileDevice::MapPrivateOption);
+        if (!mapping.data)
+            qFatal("Failed to map %s (%s)", qPrintable(key), qPrintable(mapping.file->errorString()));
+#else
+        // Without QFileDevice::MapPrivateOption mappings are read-only
+        mapping.buffer = mapping.file->readAll();
+        if (mapping.buffer.size() != mapping.size)
+            qFatal("Failed to read %s (%s)", qPrintable(key), qPrintable(mapping.file->errorString()));
+        mapping.data = (const uchar*) mapping.buffer.constData();
+#endif
+    }
+
+    mappings.insert(key, mapping);
+    *size = mapping.size;
+    return mapping.data;
+}
+
+void MappedFiles::removeOnFinalize(const QString &path)
+{
+    QMutexLocker locker(&lock);
+    removals.append(path);
+}
+
+void MappedFiles::finalize()
+{
+    QMutexLocker locker(&lock);
+    // Closing the files unmaps them
+    mappings.clear();
+    replaced.clear();
+    foreach (const QString &path, removals)
+        if (QFileInfo(path).isDir())
+            QDir(path).removeRecursively();
+        else
+            QFile::remove(path);
+    removals.clear();
+}
@@ -0,0 +1,44 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_MAPPEDFILES_H
+#define BR_MAPPEDFILES_H
+
+#include <QString>
+
+namespace br
+{
+
+/*!
+ * \brief Process-wide read-only memory mappings of gallery and model files.
+ *
+ * Mappings are copy-on-write, so objects that modify their matrices in place don't fault.
+ * Before Qt 5.4, which can't map files copy-on-write, files are read into memory instead.
+ * Matrices read from a mapping reference it directly, so a mapping is retained until the context is finalized.
+ * A file that changed since it was mapped is mapped again, keeping the outdated mapping until then as well.
+ * Mapped files must not be truncated or rewritten in place while they are in use.
+ */
+class MappedFiles
+{
+public:
+    static const uchar *map(const QString &fileName, qint64 *size); /*!< \brief Map a file, reusing an existing mapping if the file hasn't changed since. Returns \c NULL for an empty file. */
+    static void removeOnFinalize(const QString &path); /*!< \brief Remove a file or directory once every file is unmapped, for mapped scratch files that must outlive their users. */
+    static void finalize(); /*!< \brief Unmap every file, then remove the paths passed to removeOnFinalize(). */
+};
+
+} // namespace br
+
+#endif // BR_MAPPEDFILES_H
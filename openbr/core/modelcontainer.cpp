@@ -0,0 +1,176 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <climits>
+#include <QFile>
+#include <QFileInfo>
+
+#include "mappedfiles.h"
+#include "modelcontainer.h"
+#include "qtutils.h"
+
+namespace br
+{
+
+// Larger than any block written by QtUtils::BlockCompression could be, so the formats can't be confused
+static const quint32 Magic = 0x62726d63; // "brmc"
+static const quint32 Version = 1;
+static const qint64 HeaderSize = 16;
+static const qint64 SectionAlignment = 4096;
+static const qint64 MatrixAlignment = 64;
+
+// Marks devices reading or writing a section
+static const char *SectionProperty = "brModelSection";
+
+static qint64 aligned(qint64 offset, qint64 alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static void pad(QIODevice *device, qint64 alignment)
+{
+    const qint64 padding = aligned(device->pos(), alignment) - device->pos();
+    if ((padding > 0) && (device->write(QByteArray(int(padding), '\0')) != padding))
+        qFatal("Failed to pad model section.");
+}
+
+ModelContainer::Writer::Writer(const QString &fileName)
+    : file(fileName)
+{
+    QtUtils::touchDir(QFileInfo(fileName));
+    if (!file.open(QFile::WriteOnly))
+        qFatal("Failed to open %s for writing.", qPrintable(fileName));
+    file.setProperty(SectionProperty, true);
+
+    stream.setDevice(&file);
+    stream << Magic << Version << quint64(0); // The index offset is written on commit
+}
+
+QDataStream &ModelContainer::Writer::section(const QString &name)
+{
+    endSection();
+    pad(&file, SectionAlignment);
+
+    Section section;
+    section.name = name;
+    section.offset = file.pos();
+    section.size = 0;
+    sections.append(section);
+    return stream;
+}
+
+void ModelContainer::Writer::commit()
+{
+    endSection();
+
+    const quint64 indexOffset = file.pos();
+    stream << quint32(sections.size());
+    foreach (const Section &section, sections)
+        stream << section.name << quint64(section.offset) << quint64(section.size);
+
+    file.seek(8);
+    stream << indexOffset;
+    if ((stream.status() != QDataStream::Ok) || !file.commit())
+        qFatal("Failed to write %s.", qPrintable(file.fileName()));
+}
+
+void ModelContainer::Writer::endSection()
+{
+    if (!sections.isEmpty())
+        sections.last().size = file.pos() - sections.last().offset;
+}
+
+ModelContainer::ModelContainer(const QString &fileName)
+    : fileName(fileName)
+{
+    qint64 size;
+    data = MappedFiles::map(fileName, &size);
+    if (size < HeaderSize)
+        qFatal("%s is not a model container.", qPrintable(fileName));
+
+    QDataStream header(QByteArray::fromRawData((const char*) data, HeaderSize));
+    quint32 magic, version;
+    quint64 indexOffset;
+    header >> magic >> version >> indexOffset;
+    if (magic != Magic)
+        qFatal("%s is not a model container.", qPrintable(fileName));
+    if (version != Version)
+        qFatal("Unsupported model container version %u in %s, expected %u.", version, qPrintable(fileName), Version);
+    if ((indexOffset < quint64(HeaderSize)) || (indexOffset >= quint64(size)) || (size - indexOffset > INT_MAX))
+        qFatal("Malformed model container %s.", qPrintable(fileName));
+
+    QDataStream stream(QByteArray::fromRawData((const char*) data + indexOffset, int(size - indexOffset)));
+    quint32 count;
+    stream >> count;
+    for (quint32 i=0; i<count; i++) {
+        QString name;
+        quint64 offset, sectionSize;
+        stream >> name >> offset >> sectionSize;
+        if ((offset % SectionAlignment != 0) || (offset + sectionSize > indexOffset))
+            qFatal("Malformed model container %s, bad section %s.", qPrintable(fileName), qPrintable(name));
+        sections.insert(name, qMakePair(qint64(offset), qint64(sectionSize)));
+    }
+    if (stream.status() != QDataStream::Ok)
+        qFatal("Malformed model container %s, truncated index.", qPrintable(fileName));
+}
+
+bool ModelContainer::isContainer(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QFile::ReadOnly))
+        return false;
+    QDataStream stream(&file);
+    quint32 magic = 0;
+    stream >> magic;
+    return magic == Magic;
+}
+
+void ModelContainer::open(const QString &name, QBuffer &buffer) const
+{
+    if (!sections.contains(name))
+        qFatal("Model %s has no %s section.", qPrintable(fileName), qPrintable(name));
+
+    const QPair<qint64, qint64> section = sections.value(name);
+    if (section.second > INT_MAX)
+        qFatal("Model section %s of %s exceeds 2 GB.", qPrintable(name), qPrintable(fileName));
+
+    // Shares the mapping, reading doesn't copy it
+    buffer.setData(QByteArray::fromRawData((const char*) data + section.first, int(section.second)));
+    buffer.open(QIODevice::ReadOnly);
+    buffer.setProperty(SectionProperty, true);
+}
+
+void ModelContainer::alignMatrix(QDataStream &stream)
+{
+    QIODevice *device = stream.device();
+    if (device && device->property(SectionProperty).toBool())
+        pad(device, MatrixAlignment);
+}
+
+const uchar *ModelContainer::mapMatrix(QDataStream &stream, qint64 size)
+{
+    QBuffer *buffer = qobject_cast<QBuffer*>(stream.device());
+    if (!buffer || !buffer->property(SectionProperty).toBool())
+        return NULL;
+
+    const qint64 start = aligned(buffer->pos(), MatrixAlignment);
+    if (start + size > buffer->size())
+        qFatal("Malformed model section, matrix data exceeds the section.");
+    buffer->seek(start + size);
+    return (const uchar*) buffer->data().constData() + start;
+}
+
+} // namespace br
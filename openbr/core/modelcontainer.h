@@ -0,0 +1,86 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_MODELCONTAINER_H
+#define BR_MODELCONTAINER_H
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QSaveFile>
+#include <QString>
+
+namespace br
+{
+
+/*!
+ * \brief Model files of named sections that are loaded in place.
+ *
+ * A container is a 16 byte header, the section payloads each starting page aligned, and an index of the sections at the end.
+ * Sections are written with the usual QDataStream operators, except that matrix data within a section starts 64 byte aligned.
+ * Reading maps the file copy-on-write and streams each section from the mapping, so matrices reference the page cache
+ * instead of being copied and processes loading the same model share one copy of it until a page is modified.
+ * Sections are independent, so they can be read when first needed.
+ *
+ * Mappings are shared with galleries and retained as loaded matrices reference them, see br::MappedFiles.
+ * Writing replaces the file rather than rewriting it in place, which leaves existing mappings intact.
+ */
+class ModelContainer
+{
+public:
+    /*!
+     * \brief Writes a container, replacing \em fileName on commit().
+     */
+    class Writer
+    {
+    public:
+        Writer(const QString &fileName);
+        QDataStream &section(const QString &name); /*!< \brief Start the section \em name, ending the previous one. */
+        void commit(); /*!< \brief End the last section, write the index and replace the file. */
+
+    private:
+        struct Section
+        {
+            QString name;
+            qint64 offset, size;
+        };
+
+        QSaveFile file;
+        QDataStream stream;
+        QList<Section> sections;
+
+        void endSection();
+    };
+
+    ModelContainer(const QString &fileName); /*!< \brief Map \em fileName and read its index. */
+    static bool isContainer(const QString &fileName); /*!< \brief Whether \em fileName starts with a container header. */
+
+    void open(const QString &name, QBuffer &buffer) const; /*!< \brief Open \em buffer for reading the section \em name in place. */
+
+    static void alignMatrix(QDataStream &stream); /*!< \brief Pad ahead of matrix data when \em stream writes a section. */
+    static const uchar *mapMatrix(QDataStream &stream, qint64 size); /*!< \brief Skip \em size bytes of matrix data and return it when \em stream reads a section in place, otherwise \c NULL. */
+
+private:
+    QString fileName;
+    const uchar *data;
+    QHash<QString, QPair<qint64, qint64> > sections; // Offset and size
+};
+
+} // namespace br
+
+#endif // BR_MODELCONTAINER_H
@@ -20,6 +20,7 @@
 #include <opencv2/imgproc/imgproc_c.h>
 #include <openbr/openbr_plugin.h>
 
+#include "modelcontainer.h"
 #include "opencvutils.h"
 #include "qtutils.h"
 
@@ -395,6 +396,7 @@ QDataStream &operator<<(QDataStream &stream, const Mat &m)
     stream << len;
     if (len > 0) {
         if (!m.isContinuous()) qFatal("Can't serialize non-continuous matrices.");
+        ModelContainer::alignMatrix(stream);
         int written = stream.writeRawData((const char*)m.data, len);
         if (written != len) qFatal("Mat serialization failure, expected: %d bytes, wrote: %d bytes.", len, written);
     }
@@ -406,10 +408,20 @@ QDataStream &operator>>(QDataStream &stream, Mat &m)
     // Read header
     int rows, cols, type;
     stream >> rows >> cols >> type;
-    m.create(rows, cols, type);
 
     int len;
     stream >> len;
+
+    // Reference matrices loaded from a model container in place
+    if (len > 0) {
+        const uchar *mapped = ModelContainer::mapMatrix(stream, len);
+        if (mapped) {
+            m = Mat(rows, cols, type, (void*) mapped);
+            return stream;
+        }
+    }
+
+    m.create(rows, cols, type);
     char *data = (char*) m.data;
 
     // In certain circumstances, like reading from stdin or sockets, we may not
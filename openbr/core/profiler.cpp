@@ -0,0 +1,311 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QTextStream>
+#include <QThreadStorage>
+#include <QVector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif // _WIN32
+
+#include "profiler.h"
+
+namespace br
+{
+
+// Trace events kept per thread, beyond which only the totals are updated
+static const int MaxEvents = 1 << 18;
+
+struct Totals
+{
+    qint64 calls, templatesIn, templatesOut, bytesIn, bytesOut, wall, cpu;
+
+    Totals() : calls(0), templatesIn(0), templatesOut(0), bytesIn(0), bytesOut(0), wall(0), cpu(0) {}
+
+    void add(const Totals &other)
+    {
+        calls += other.calls;
+        templatesIn += other.templatesIn;
+        templatesOut += other.templatesOut;
+        bytesIn += other.bytesIn;
+        bytesOut += other.bytesOut;
+        wall += other.wall;
+        cpu += other.cpu;
+    }
+};
+
+struct TraceEvent
+{
+    int name; // Index in ThreadLog::names
+    const char *event;
+    qint64 start, duration, cpu, templates, bytesIn, bytesOut;
+};
+
+typedef QPair<int, const char*> TotalsKey;
+
+// Only touched by its thread until the logs are written
+struct ThreadLog
+{
+    int thread;
+    QHash<const Object*, int> nameIndices;
+    QStringList names;
+    QHash<TotalsKey, Totals> totals;
+    QVector<TraceEvent> events;
+    qint64 dropped;
+
+    int name(const Object *node)
+    {
+        QHash<const Object*, int>::const_iterator it = nameIndices.constFind(node);
+        if (it != nameIndices.constEnd())
+            return it.value();
+
+        const Gallery *gallery = qobject_cast<const Gallery*>(node);
+        names.append(gallery ? gallery->objectName() + "(" + gallery->file.name + ")" : node->description());
+        nameIndices.insert(node, names.size()-1);
+        return names.size()-1;
+    }
+
+    void clear()
+    {
+        nameIndices.clear();
+        names.clear();
+        totals.clear();
+        events.clear();
+        dropped = 0;
+    }
+};
+
+static QMutex logsLock;
+static QList< QSharedPointer<ThreadLog> > logs;
+static QThreadStorage< QSharedPointer<ThreadLog> > threadLog;
+static QElapsedTimer profileClock;
+
+static ThreadLog &localLog()
+{
+    if (!threadLog.hasLocalData()) {
+        QSharedPointer<ThreadLog> log(new ThreadLog());
+        log->dropped = 0;
+
+        QMutexLocker locker(&logsLock);
+        if (!profileClock.isValid())
+            profileClock.start();
+        log->thread = logs.size();
+        logs.append(log);
+        threadLog.setLocalData(log);
+    }
+    return *threadLog.localData();
+}
+
+static qint64 threadCpuTime()
+{
+#ifdef _WIN32
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    return ((qint64(kernel.dwHighDateTime) << 32 | kernel.dwLowDateTime) +
+            (qint64(user.dwHighDateTime) << 32 | user.dwLowDateTime)) * 100;
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+    return qint64(time.tv_sec) * 1000000000 + time.tv_nsec;
+#endif // _WIN32
+}
+
+static void record(const Object *node, const char *event, qint64 start, const Totals &totals)
+{
+    ThreadLog &log = localLog();
+    const int name = log.name(node);
+    log.totals[TotalsKey(name, event)].add(totals);
+
+    if (log.events.size() >= MaxEvents) {
+        log.dropped++;
+        return;
+    }
+
+    TraceEvent trace;
+    trace.name = name;
+    trace.event = event;
+    trace.start = start;
+    trace.duration = totals.wall;
+    trace.cpu = totals.cpu;
+    trace.templates = totals.templatesIn;
+    trace.bytesIn = totals.bytesIn;
+    trace.bytesOut = totals.bytesOut;
+    log.events.append(trace);
+}
+
+Profiler::Scope::Scope(const Object *node, const char *event)
+    : node(enabled() ? node : NULL), event(event)
+{
+    if (this->node) begin(0, 0);
+}
+
+Profiler::Scope::Scope(const Object *node, const char *event, const Template &input)
+    : node(enabled() ? node : NULL), event(event)
+{
+    if (this->node) begin(1, input.bytes());
+}
+
+Profiler::Scope::Scope(const Object *node, const char *event, const TemplateList &input)
+    : node(enabled() ? node : NULL), event(event)
+{
+    if (this->node) begin(input.size(), input.bytes<qint64>());
+}
+
+void Profiler::Scope::begin(qint64 templates, qint64 bytes)
+{
+    templatesIn = templates;
+    bytesIn = bytes;
+    templatesOut = 0;
+    bytesOut = 0;
+    cpuStart = threadCpuTime();
+    start = now();
+}
+
+Profiler::Scope::~Scope()
+{
+    if (!node)
+        return;
+
+    Totals totals;
+    totals.calls = 1;
+    totals.wall = now() - start;
+    totals.cpu = threadCpuTime() - cpuStart;
+    totals.templatesIn = templatesIn;
+    totals.templatesOut = templatesOut;
+    totals.bytesIn = bytesIn;
+    totals.bytesOut = bytesOut;
+    record(node, event, start, totals);
+}
+
+void Profiler::Scope::output(const Template &t)
+{
+    if (!node) return;
+    templatesOut += 1;
+    bytesOut += t.bytes();
+}
+
+void Profiler::Scope::output(const TemplateList &templates)
+{
+    if (!node) return;
+    templatesOut += templates.size();
+    bytesOut += templates.bytes<qint64>();
+}
+
+qint64 Profiler::now()
+{
+    localLog(); // Starts the clock
+    return profileClock.nsecsElapsed();
+}
+
+void Profiler::wait(const Object *node, const char *event, qint64 since)
+{
+    if (!enabled())
+        return;
+
+    Totals totals;
+    totals.calls = 1;
+    totals.wall = now() - since;
+    record(node, event, since, totals);
+}
+
+static QString quoted(const QString &string)
+{
+    QString result = "\"";
+    foreach (const QChar &c, string) {
+        if      (c == '"')           result += "\\\"";
+        else if (c == '\\')          result += "\\\\";
+        else if (c.unicode() < 0x20) result += QString("\\u%1").arg(int(c.unicode()), 4, 16, QChar('0'));
+        else                         result += c;
+    }
+    return result + "\"";
+}
+
+static QString microseconds(qint64 nsecs)
+{
+    return QString::number(nsecs / 1000.0, 'f', 3);
+}
+
+void Profiler::finalize()
+{
+    if (!enabled())
+        return;
+
+    QMutexLocker locker(&logsLock);
+    QFile file(Globals->profile);
+    if (!file.open(QFile::WriteOnly | QFile::Text)) {
+        qWarning("Unable to open %s for writing the profile.", qPrintable(Globals->profile));
+        return;
+    }
+
+    QTextStream stream(&file);
+    stream.setCodec("UTF-8");
+    const qint64 pid = QCoreApplication::applicationPid();
+
+    // Chrome trace events, with the totals merged by name and event for the summary
+    QMap< QPair<QString, QString>, Totals> summary;
+    qint64 dropped = 0;
+    bool first = true;
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    foreach (const QSharedPointer<ThreadLog> &log, logs) {
+        stream << (first ? "\n" : ",\n")
+               << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << log->thread
+               << ",\"args\":{\"name\":\"Thread " << log->thread << "\"}}";
+        first = false;
+
+        foreach (const TraceEvent &event, log->events)
+            stream << ",\n{\"name\":" << quoted(log->names[event.name]) << ",\"cat\":\"" << event.event
+                   << "\",\"ph\":\"X\",\"ts\":" << microseconds(event.start) << ",\"dur\":" << microseconds(event.duration)
+                   << ",\"pid\":" << pid << ",\"tid\":" << log->thread
+                   << ",\"args\":{\"cpu\":" << microseconds(event.cpu) << ",\"templates\":" << event.templates
+                   << ",\"bytesIn\":" << event.bytesIn << ",\"bytesOut\":" << event.bytesOut << "}}";
+
+        for (QHash<TotalsKey, Totals>::const_iterator it = log->totals.constBegin(); it != log->totals.constEnd(); ++it)
+            summary[qMakePair(log->names[it.key().first], QString(it.key().second))].add(it.value());
+        dropped += log->dropped;
+        log->clear();
+    }
+    stream << "\n],\"droppedEvents\":" << dropped << ",\"summary\":[";
+
+    first = true;
+    for (QMap< QPair<QString, QString>, Totals>::const_iterator it = summary.constBegin(); it != summary.constEnd(); ++it) {
+        const Totals &totals = it.value();
+        stream << (first ? "\n" : ",\n")
+               << "{\"description\":" << quoted(it.key().first) << ",\"event\":\"" << it.key().second
+               << "\",\"calls\":" << totals.calls << ",\"templatesIn\":" << totals.templatesIn << ",\"templatesOut\":" << totals.templatesOut
+               << ",\"bytesIn\":" << totals.bytesIn << ",\"bytesOut\":" << totals.bytesOut
+               << ",\"wallSeconds\":" << totals.wall / 1e9 << ",\"cpuSeconds\":" << totals.cpu / 1e9 << "}";
+        first = false;
+    }
+    stream << "\n]}\n";
+
+    if (dropped > 0)
+        qWarning("Profile trace is missing %lld events, the summary is complete.", dropped);
+    if (Globals->verbose)
+        qDebug("Profile written to %s.", qPrintable(Globals->profile));
+}
+
+} // namespace br
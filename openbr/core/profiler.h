@@ -0,0 +1,65 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_PROFILER_H
+#define BR_PROFILER_H
+
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Per-node timing of transforms, stream stages and galleries, enabled by the \c profile global.
+ *
+ * Composite transforms and stream stages time the calls to their children, so every node of an algorithm is
+ * recorded once per call by its parent. Each thread accumulates into its own log without locking,
+ * the logs are merged when the context is finalized and written to \c profile as a Chrome trace,
+ * which also opens in Perfetto, with a \c summary of the totals keyed by node description and event.
+ */
+class Profiler
+{
+public:
+    /*!
+     * \brief Records a call from construction to destruction, doing nothing unless profiling is enabled.
+     */
+    class Scope
+    {
+    public:
+        Scope(const Object *node, const char *event);
+        Scope(const Object *node, const char *event, const Template &input);
+        Scope(const Object *node, const char *event, const TemplateList &input);
+        ~Scope();
+        void output(const Template &t); /*!< \brief Count \em t as the result of the call. */
+        void output(const TemplateList &templates); /*!< \brief Count \em templates as the result of the call. */
+
+    private:
+        const Object *node;
+        const char *event;
+        qint64 start, cpuStart, templatesIn, templatesOut, bytesIn, bytesOut;
+
+        void begin(qint64 templates, qint64 bytes);
+    };
+
+    static inline bool enabled() { return Globals && !Globals->profile.isEmpty(); }
+    static qint64 now(); /*!< \brief Nanoseconds on the profiler's clock. */
+    static void wait(const Object *node, const char *event, qint64 since); /*!< \brief Record time \em node spent waiting since \em since. */
+    static void finalize(); /*!< \brief Write and clear the logs, called when the context is finalized. */
+};
+
+} // namespace br
+
+#endif // BR_PROFILER_H
@@ -0,0 +1,308 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QElapsedTimer>
+#include <QThread>
+#include <algorithm>
+#include <openbr/openbr_plugin.h>
+
+#include "scheduler.h"
+
+using namespace br;
+
+class Scheduler::Worker : public QThread
+{
+public:
+    Scheduler *scheduler;
+    int index;
+
+    QMutex lock;
+    QList<Entry> tasks; // Owner pushes and pops at the back, thieves take from the front
+
+    QAtomicInt executed, steals, idleMsecs;
+
+    Worker(Scheduler *scheduler, int index)
+        : scheduler(scheduler), index(index) {}
+
+    void run()
+    {
+        forever {
+            Entry entry;
+            if (scheduler->take(this, NULL, entry)) {
+                execute(entry.task);
+                executed.ref();
+                continue;
+            }
+
+            if (scheduler->stopping.load())
+                return;
+
+            QElapsedTimer timer;
+            timer.start();
+            {
+                QMutexLocker locker(&scheduler->idleLock);
+                if (!scheduler->stopping.load() && (scheduler->queued.load() == 0)) {
+                    scheduler->sleepers.ref();
+                    // Timed, so a wake up racing with the check above can only delay a task briefly
+                    scheduler->idle.wait(&scheduler->idleLock, 10);
+                    scheduler->sleepers.deref();
+                }
+            }
+            idleMsecs.fetchAndAddRelaxed(int(timer.elapsed()));
+        }
+    }
+};
+
+static QMutex instanceLock;
+static Scheduler *globalScheduler = NULL;
+static QAtomicInt helped; // Tasks run by threads that aren't workers
+
+/* Scheduler - public methods */
+QString Scheduler::Statistics::toString() const
+{
+    return QString("Workers: %1, Queued: %2, Executed: %3, Steals: %4, Idle: %5 s").arg(QString::number(workers),
+                                                                                      QString::number(queued),
+                                                                                      QString::number(executed),
+                                                                                      QString::number(steals),
+                                                                                      QString::number(idleMsecs / 1000.0));
+}
+
+Scheduler *Scheduler::instance()
+{
+    QMutexLocker locker(&instanceLock);
+    if (globalScheduler == NULL)
+        globalScheduler = new Scheduler(Globals ? Globals->parallelism : QThread::idealThreadCount());
+    return globalScheduler;
+}
+
+void Scheduler::finalize()
+{
+    QMutexLocker locker(&instanceLock);
+    delete globalScheduler;
+    globalScheduler = NULL;
+}
+
+void Scheduler::start(QRunnable *task, const void *owner)
+{
+    Entry entry;
+    entry.task = task;
+    entry.owner = owner;
+
+    Worker *self = currentWorker();
+    if (self) {
+        QMutexLocker locker(&self->lock);
+        self->tasks.append(entry);
+    } else {
+        QMutexLocker locker(&injectedLock);
+        injected.append(entry);
+    }
+    queued.ref();
+    wakeOne();
+}
+
+bool Scheduler::tryRun(const void *owner)
+{
+    Worker *self = currentWorker();
+    Entry entry;
+    if (!take(self, owner, entry))
+        return false;
+
+    execute(entry.task);
+    if (self) self->executed.ref();
+    else      helped.ref();
+    return true;
+}
+
+Scheduler::Statistics Scheduler::statistics() const
+{
+    Statistics statistics;
+    statistics.workers = workers.size();
+    statistics.queued = queued.load();
+    statistics.executed = helped.load();
+    statistics.steals = 0;
+    statistics.idleMsecs = 0;
+    foreach (const Worker *worker, workers) {
+        statistics.executed += worker->executed.load();
+        statistics.steals += worker->steals.load();
+        statistics.idleMsecs += worker->idleMsecs.load();
+    }
+    return statistics;
+}
+
+/* Scheduler - private methods */
+Scheduler::Scheduler(int threads)
+{
+    for (int i=0; i<std::max(1, threads); i++)
+        workers.append(new Worker(this, i));
+    foreach (Worker *worker, workers)
+        worker->start();
+}
+
+Scheduler::~Scheduler()
+{
+    if (Globals && Globals->verbose)
+        qDebug("Scheduler %s", qPrintable(statistics().toString()));
+
+    stopping.store(1);
+    {
+        QMutexLocker locker(&idleLock);
+        idle.wakeAll();
+    }
+
+    foreach (Worker *worker, workers) {
+        worker->wait();
+        foreach (const Entry &entry, worker->tasks)
+            if (entry.task->autoDelete())
+                delete entry.task;
+        delete worker;
+    }
+
+    foreach (const Entry &entry, injected)
+        if (entry.task->autoDelete())
+            delete entry.task;
+}
+
+Scheduler::Worker *Scheduler::currentWorker() const
+{
+    Worker *worker = dynamic_cast<Worker*>(QThread::currentThread());
+    return (worker && (worker->scheduler == this)) ? worker : NULL;
+}
+
+bool Scheduler::take(Worker *self, const void *owner, Entry &entry)
+{
+    if (queued.load() == 0)
+        return false;
+
+    // Most recently started first from our own deque
+    if (self) {
+        QMutexLocker locker(&self->lock);
+        if (takeLast(self->tasks, owner, entry)) {
+            queued.deref();
+            return true;
+        }
+    }
+
+    {
+        QMutexLocker locker(&injectedLock);
+        if (takeFirst(injected, owner, entry)) {
+            queued.deref();
+            return true;
+        }
+    }
+
+    // Oldest first from everyone else's
+    const int first = self ? self->index + 1 : 0;
+    for (int i=0; i<workers.size(); i++) {
+        Worker *victim = workers[(first + i) % workers.size()];
+        if (victim == self)
+            continue;
+
+        QMutexLocker locker(&victim->lock);
+        if (takeFirst(victim->tasks, owner, entry)) {
+            queued.deref();
+            if (self) self->steals.ref();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Scheduler::takeFirst(QList<Entry> &entries, const void *owner, Entry &entry)
+{
+    for (int i=0; i<entries.size(); i++)
+        if (!owner || (entries[i].owner == owner)) {
+            entry = entries.takeAt(i);
+            return true;
+        }
+    return false;
+}
+
+bool Scheduler::takeLast(QList<Entry> &entries, const void *owner, Entry &entry)
+{
+    for (int i=entries.size()-1; i>=0; i--)
+        if (!owner || (entries[i].owner == owner)) {
+            entry = entries.takeAt(i);
+            return true;
+        }
+    return false;
+}
+
+void Scheduler::execute(QRunnable *task)
+{
+    const bool autoDelete = task->autoDelete();
+    task->run();
+    if (autoDelete)
+        delete task;
+}
+
+void Scheduler::wakeOne()
+{
+    if (sleepers.load() == 0)
+        return;
+    QMutexLocker locker(&idleLock);
+    idle.wakeOne();
+}
+
+/* Scheduler::Group */
+class Scheduler::Group::Task : public QRunnable
+{
+    Group *group;
+    QRunnable *task;
+
+public:
+    Task(Group *group, QRunnable *task)
+        : group(group), task(task) {}
+
+    void run()
+    {
+        Scheduler::execute(task);
+
+        // The waiting thread takes the lock before returning, so the group outlives this
+        QMutexLocker locker(&group->lock);
+        if (!group->remaining.deref())
+            group->finished.wakeAll();
+    }
+};
+
+Scheduler::Group::Group()
+    : scheduler(Scheduler::instance()) {}
+
+Scheduler::Group::~Group()
+{
+    wait();
+}
+
+void Scheduler::Group::start(QRunnable *task)
+{
+    remaining.ref();
+    scheduler->start(new Task(this, task), this);
+}
+
+void Scheduler::Group::wait()
+{
+    while (remaining.load() > 0) {
+        // Help with our own tasks rather than block a worker
+        if (scheduler->tryRun(this))
+            continue;
+
+        QMutexLocker locker(&lock);
+        if (remaining.load() > 0)
+            finished.wait(&lock, 10);
+    }
+
+    QMutexLocker locker(&lock);
+}
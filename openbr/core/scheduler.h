@@ -0,0 +1,228 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_SCHEDULER_H
+#define BR_SCHEDULER_H
+
+#include <QAtomicInt>
+#include <QList>
+#include <QMutex>
+#include <QRunnable>
+#include <QString>
+#include <QWaitCondition>
+
+namespace br
+{
+
+/*!
+ * \brief Process-wide work-stealing executor.
+ *
+ * Each worker thread owns a deque. Tasks started from a worker go on its own deque and are popped LIFO,
+ * so a task spawned by a running one usually runs next on the same thread while its data is still in cache.
+ * Idle workers steal FIFO from the other deques, and from a shared queue holding tasks started by other threads.
+ *
+ * Tasks can be tagged with an owner. Threads waiting for their own tasks (br::Scheduler::Group::wait(), Stream)
+ * run queued tasks with the same owner instead of blocking, so nested parallel regions share the same workers
+ * without deadlocking or oversubscribing the machine.
+ * The instance is created on first use with Globals->parallelism workers.
+ */
+class Scheduler
+{
+public:
+    /*!
+     * \brief Counters describing the scheduler since it was created.
+     */
+    struct Statistics
+    {
+        int workers;
+        int queued; /*!< \brief Tasks currently waiting to run. */
+        qint64 executed;
+        qint64 steals; /*!< \brief Tasks a worker took from another worker's deque. */
+        qint64 idleMsecs; /*!< \brief Total time workers spent waiting for tasks. */
+
+        QString toString() const;
+    };
+
+    /*!
+     * \brief A set of tasks that can be waited on, like QFutureSynchronizer.
+     */
+    class Group
+    {
+    public:
+        Group();
+        ~Group(); /*!< \brief Waits for the tasks to finish. */
+        void start(QRunnable *task); /*!< \brief Queue a task, deleting it after it runs if QRunnable::autoDelete() is set. */
+        void wait(); /*!< \brief Run or wait for the queued tasks until all of them have finished. */
+
+    private:
+        class Task;
+        Scheduler *scheduler;
+        QAtomicInt remaining;
+        QMutex lock;
+        QWaitCondition finished;
+    };
+
+    static Scheduler *instance(); /*!< \brief The process-wide scheduler. */
+    static void finalize(); /*!< \brief Stop the workers of the instance, if it was created. */
+
+    /*!
+     * \brief Queue a task, deleting it after it runs if QRunnable::autoDelete() is set.
+     * \em owner identifies the tasks a waiting thread may run, see tryRun().
+     */
+    void start(QRunnable *task, const void *owner = NULL);
+
+    /*!
+     * \brief Run one queued task on the calling thread.
+     * Only tasks with the given \em owner are considered, unless it is \c NULL.
+     * Returns \c false if there was nothing to run.
+     */
+    bool tryRun(const void *owner = NULL);
+
+    Statistics statistics() const;
+
+private:
+    class Worker;
+
+    struct Entry
+    {
+        QRunnable *task;
+        const void *owner;
+    };
+
+    QList<Worker*> workers;
+    mutable QMutex injectedLock;
+    QList<Entry> injected; // Tasks started outside the workers
+    QAtomicInt queued;
+    QAtomicInt sleepers;
+    QMutex idleLock;
+    QWaitCondition idle;
+    QAtomicInt stopping;
+
+    explicit Scheduler(int threads);
+    ~Scheduler();
+    Worker *currentWorker() const;
+    bool take(Worker *self, const void *owner, Entry &entry);
+    static bool takeFirst(QList<Entry> &entries, const void *owner, Entry &entry);
+    static bool takeLast(QList<Entry> &entries, const void *owner, Entry &entry);
+    static void execute(QRunnable *task);
+    void wakeOne();
+};
+
+template <typename T> struct TaskArgument { typedef T Type; };
+template <typename T> struct TaskArgument<const T&> { typedef T Type; };
+
+/*!
+ * \brief Calls a const member function with copies of its arguments, like QtConcurrent::run.
+ * \see newTask
+ */
+template <typename Class, typename P1, typename P2, typename P3, typename P4, typename P5>
+class MemberTask : public QRunnable
+{
+    typedef void (Class::*Method)(P1, P2, P3, P4, P5) const;
+
+    const Class *object;
+    Method method;
+    typename TaskArgument<P1>::Type a1;
+    typename TaskArgument<P2>::Type a2;
+    typename TaskArgument<P3>::Type a3;
+    typename TaskArgument<P4>::Type a4;
+    typename TaskArgument<P5>::Type a5;
+
+public:
+    MemberTask(const Class *object, Method method, P1 a1, P2 a2, P3 a3, P4 a4, P5 a5)
+        : object(object), method(method), a1(a1), a2(a2), a3(a3), a4(a4), a5(a5) {}
+
+    void run()
+    {
+        (object->*method)(a1, a2, a3, a4, a5);
+    }
+};
+
+/*!
+ * \brief Make a br::MemberTask for br::Scheduler::start() or br::Scheduler::Group::start().
+ */
+template <typename Class, typename P1, typename P2, typename P3, typename P4, typename P5,
+          typename A1, typename A2, typename A3, typename A4, typename A5>
+QRunnable *newTask(const Class *object, void (Class::*method)(P1, P2, P3, P4, P5) const,
+                   const A1 &a1, const A2 &a2, const A3 &a3, const A4 &a4, const A5 &a5)
+{
+    return new MemberTask<Class, P1, P2, P3, P4, P5>(object, method, a1, a2, a3, a4, a5);
+}
+
+/*!
+ * \brief Calls a function with copies of its arguments, like QtConcurrent::run.
+ * \see newTask
+ */
+template <typename P1, typename P2, typename P3 = void>
+class FunctionTask : public QRunnable
+{
+    typedef void (*Function)(P1, P2, P3);
+
+    Function function;
+    typename TaskArgument<P1>::Type a1;
+    typename TaskArgument<P2>::Type a2;
+    typename TaskArgument<P3>::Type a3;
+
+public:
+    FunctionTask(Function function, P1 a1, P2 a2, P3 a3)
+        : function(function), a1(a1), a2(a2), a3(a3) {}
+
+    void run()
+    {
+        function(a1, a2, a3);
+    }
+};
+
+template <typename P1, typename P2>
+class FunctionTask<P1, P2, void> : public QRunnable
+{
+    typedef void (*Function)(P1, P2);
+
+    Function function;
+    typename TaskArgument<P1>::Type a1;
+    typename TaskArgument<P2>::Type a2;
+
+public:
+    FunctionTask(Function function, P1 a1, P2 a2)
+        : function(function), a1(a1), a2(a2) {}
+
+    void run()
+    {
+        function(a1, a2);
+    }
+};
+
+/*!
+ * \brief Make a br::FunctionTask for br::Scheduler::start() or br::Scheduler::Group::start().
+ */
+template <typename P1, typename P2, typename A1, typename A2>
+QRunnable *newTask(void (*function)(P1, P2), const A1 &a1, const A2 &a2)
+{
+    return new FunctionTask<P1, P2>(function, a1, a2);
+}
+
+/*!
+ * \brief Make a br::FunctionTask for br::Scheduler::start() or br::Scheduler::Group::start().
+ */
+template <typename P1, typename P2, typename P3, typename A1, typename A2, typename A3>
+QRunnable *newTask(void (*function)(P1, P2, P3), const A1 &a1, const A2 &a2, const A3 &a3)
+{
+    return new FunctionTask<P1, P2, P3>(function, a1, a2, a3);
+}
+
+} // namespace br
+
+#endif // BR_SCHEDULER_H
@@ -0,0 +1,516 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <cstddef>
+#include <QDataStream>
+#include <QPointF>
+#include <QRectF>
+
+#include "templatecodec.h"
+
+using namespace cv;
+
+namespace br
+{
+
+static const quint32 Version = 1;
+
+enum RecordKind
+{
+    SegmentRecord = 0x74726262, // "bbrt"
+    KeysRecord = 1,
+    TemplateRecord = 2
+};
+
+enum ValueType
+{
+    NullValue,
+    BoolValue,
+    IntValue,
+    UIntValue,
+    LongLongValue,
+    ULongLongValue,
+    DoubleValue,
+    FloatValue,
+    StringValue,
+    StringListValue,
+    PointFValue,
+    RectFValue,
+    PointFListValue,
+    RectFListValue,
+    OtherValue // QDataStream
+};
+
+enum TemplateFlags
+{
+    FailureToEnroll = 1
+};
+
+struct RecordHeader
+{
+    quint32 kind;
+    quint32 version;
+    quint64 size; // Of the body, a multiple of 16
+};
+
+namespace
+{
+
+// Appends to a buffer whose records start at multiples of 16 bytes
+class Writer
+{
+    QByteArray &buffer;
+    int record;
+
+public:
+    Writer(QByteArray &buffer, RecordKind kind, quint32 version = 0)
+        : buffer(buffer), record(buffer.size())
+    {
+        RecordHeader header;
+        header.kind = kind;
+        header.version = version;
+        header.size = 0;
+        put(header);
+    }
+
+    // Pad the body and set its size in the header
+    ~Writer()
+    {
+        pad(16);
+        const quint64 size = buffer.size() - record - TemplateCodec::HeaderSize;
+        memcpy(buffer.data() + record + offsetof(RecordHeader, size), &size, sizeof(size));
+    }
+
+    template <typename T>
+    void put(const T &value)
+    {
+        buffer.append((const char*) &value, sizeof(T));
+    }
+
+    void put(const char *data, qint64 size)
+    {
+        buffer.append(data, int(size));
+    }
+
+    void pad(int alignment)
+    {
+        const int padding = (alignment - (buffer.size() - record) % alignment) % alignment;
+        buffer.append(QByteArray(padding, '\0'));
+    }
+
+    void bytes(const QByteArray &data)
+    {
+        put(quint32(data.size()));
+        put(quint32(0));
+        put(data.constData(), data.size());
+        pad(8);
+    }
+
+    void string(const QString &string)
+    {
+        bytes(string.toUtf8());
+    }
+
+    void point(const QPointF &point)
+    {
+        put(double(point.x()));
+        put(double(point.y()));
+    }
+
+    void rect(const QRectF &rect)
+    {
+        put(double(rect.x()));
+        put(double(rect.y()));
+        put(double(rect.width()));
+        put(double(rect.height()));
+    }
+};
+
+class Reader
+{
+    const char *record, *data, *end;
+
+public:
+    Reader(const char *record)
+        : record(record), data(record + TemplateCodec::HeaderSize)
+    {
+        RecordHeader header;
+        memcpy(&header, record, sizeof(header));
+        end = data + header.size;
+    }
+
+    const char *skip(qint64 size)
+    {
+        if ((size < 0) || (size > end - data))
+            qFatal("Malformed template encoding.");
+        const char *result = data;
+        data += size;
+        return result;
+    }
+
+    template <typename T>
+    T get()
+    {
+        T value;
+        memcpy(&value, skip(sizeof(T)), sizeof(T)); // data may be unaligned
+        return value;
+    }
+
+    void align(int alignment)
+    {
+        skip((alignment - (data - record) % alignment) % alignment);
+    }
+
+    QByteArray bytes()
+    {
+        const quint32 size = get<quint32>();
+        get<quint32>();
+        const char *bytes = skip(size);
+        align(8);
+        return QByteArray(bytes, size);
+    }
+
+    QString string()
+    {
+        const quint32 size = get<quint32>();
+        get<quint32>();
+        const char *bytes = skip(size);
+        align(8);
+        return QString::fromUtf8(bytes, size);
+    }
+
+    QPointF point()
+    {
+        const double x = get<double>();
+        const double y = get<double>();
+        return QPointF(x, y);
+    }
+
+    QRectF rect()
+    {
+        const double x = get<double>();
+        const double y = get<double>();
+        const double width = get<double>();
+        const double height = get<double>();
+        return QRectF(x, y, width, height);
+    }
+};
+
+} // namespace
+
+static bool allOfType(const QVariantList &list, int type)
+{
+    if (list.isEmpty())
+        return false;
+    foreach (const QVariant &item, list)
+        if (item.userType() != type)
+            return false;
+    return true;
+}
+
+static void writeValue(Writer &writer, quint32 key, const QVariant &value)
+{
+    ValueType type;
+    switch (value.userType()) {
+      case QMetaType::Bool:      type = BoolValue; break;
+      case QMetaType::Int:       type = IntValue; break;
+      case QMetaType::UInt:      type = UIntValue; break;
+      case QMetaType::LongLong:  type = LongLongValue; break;
+      case QMetaType::ULongLong: type = ULongLongValue; break;
+      case QMetaType::Double:    type = DoubleValue; break;
+      case QMetaType::Float:     type = FloatValue; break;
+      case QMetaType::QString:   type = StringValue; break;
+      case QMetaType::QStringList: type = StringListValue; break;
+      case QMetaType::QPointF:   type = PointFValue; break;
+      case QMetaType::QRectF:    type = RectFValue; break;
+      case QMetaType::QVariantList:
+        if      (allOfType(value.toList(), QMetaType::QPointF)) type = PointFListValue;
+        else if (allOfType(value.toList(), QMetaType::QRectF))  type = RectFListValue;
+        else                                                    type = OtherValue;
+        break;
+      default:
+        type = value.isValid() ? OtherValue : NullValue;
+    }
+
+    writer.put(key);
+    writer.put(quint32(type));
+    switch (type) {
+      case NullValue:
+        break;
+      case BoolValue:
+      case IntValue:
+      case LongLongValue:
+        writer.put(qint64(value.toLongLong()));
+        break;
+      case UIntValue:
+      case ULongLongValue:
+        writer.put(quint64(value.toULongLong()));
+        break;
+      case DoubleValue:
+      case FloatValue:
+        writer.put(value.toDouble());
+        break;
+      case StringValue:
+        writer.string(value.toString());
+        break;
+      case StringListValue: {
+        const QStringList strings = value.toStringList();
+        writer.put(quint32(strings.size()));
+        writer.put(quint32(0));
+        foreach (const QString &string, strings)
+            writer.string(string);
+        break;
+      }
+      case PointFValue:
+        writer.point(value.toPointF());
+        break;
+      case RectFValue:
+        writer.rect(value.toRectF());
+        break;
+      case PointFListValue:
+      case RectFListValue: {
+        const QVariantList items = value.toList();
+        writer.put(quint32(items.size()));
+        writer.put(quint32(0));
+        foreach (const QVariant &item, items)
+            if (type == PointFListValue) writer.point(item.toPointF());
+            else                         writer.rect(item.toRectF());
+        break;
+      }
+      case OtherValue: {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream << value;
+        writer.bytes(data);
+        break;
+      }
+    }
+}
+
+static QVariant readValue(Reader &reader, ValueType type)
+{
+    switch (type) {
+      case NullValue:      return QVariant();
+      case BoolValue:      return QVariant(reader.get<qint64>() != 0);
+      case IntValue:       return QVariant(int(reader.get<qint64>()));
+      case UIntValue:      return QVariant(uint(reader.get<quint64>()));
+      case LongLongValue:  return QVariant(qlonglong(reader.get<qint64>()));
+      case ULongLongValue: return QVariant(qulonglong(reader.get<quint64>()));
+      case DoubleValue:    return QVariant(reader.get<double>());
+      case FloatValue:     return QVariant(float(reader.get<double>()));
+      case StringValue:    return QVariant(reader.string());
+      case StringListValue: {
+        QStringList strings;
+        const quint32 count = reader.get<quint32>();
+        reader.get<quint32>();
+        for (quint32 i=0; i<count; i++)
+            strings.append(reader.string());
+        return QVariant(strings);
+      }
+      case PointFValue:    return QVariant(reader.point());
+      case RectFValue:     return QVariant(reader.rect());
+      case PointFListValue:
+      case RectFListValue: {
+        QVariantList items;
+        const quint32 count = reader.get<quint32>();
+        reader.get<quint32>();
+        for (quint32 i=0; i<count; i++)
+            items.append((type == PointFListValue) ? QVariant(reader.point()) : QVariant(reader.rect()));
+        return QVariant(items);
+      }
+      case OtherValue: {
+        QVariant value;
+        QDataStream stream(reader.bytes());
+        stream >> value;
+        return value;
+      }
+    }
+
+    qFatal("Unknown template metadata type %d.", int(type));
+    return QVariant();
+}
+
+TemplateCodec::TemplateCodec()
+    : fteAtom(Metadata::atom("FTE")), started(false)
+{}
+
+void TemplateCodec::write(const Template &t, QByteArray &buffer)
+{
+    if (!started) {
+        Writer(buffer, SegmentRecord, Version);
+        keyIndices.clear();
+        started = true;
+    }
+
+    const Metadata &metadata = t.file.metadata();
+    const int metadataCount = metadata.size() - (metadata.contains(fteAtom) ? 1 : 0);
+
+    QList<int> newAtoms;
+    for (int i=0; i<metadata.size(); i++) {
+        const int atom = metadata.atomAt(i);
+        if ((atom != fteAtom) && !keyIndices.contains(atom)) {
+            keyIndices.insert(atom, keyIndices.size());
+            newAtoms.append(atom);
+        }
+    }
+
+    if (!newAtoms.isEmpty()) {
+        Writer writer(buffer, KeysRecord);
+        writer.put(quint32(newAtoms.size()));
+        writer.put(quint32(0));
+        foreach (int atom, newAtoms)
+            writer.string(Metadata::key(atom));
+    }
+
+    Writer writer(buffer, TemplateRecord);
+    writer.put(quint32(t.file.fte ? FailureToEnroll : 0));
+    writer.put(quint32(metadataCount));
+    writer.put(quint32(t.size()));
+    writer.put(quint32(0));
+    writer.string(t.file.name);
+    for (int i=0; i<metadata.size(); i++)
+        if (metadata.atomAt(i) != fteAtom)
+            writeValue(writer, keyIndices[metadata.atomAt(i)], metadata.valueAt(i));
+
+    foreach (const Mat &m, t) {
+        const Mat data = m.isContinuous() ? m : m.clone();
+        writer.pad(16);
+        writer.put(qint32(data.rows));
+        writer.put(qint32(data.cols));
+        writer.put(qint32(data.type()));
+        // Matrices with more than two dimensions list their sizes, rows and cols are -1
+        writer.put(qint32(data.dims > 2 ? data.dims : 0));
+        if (data.dims > 2) {
+            for (int i=0; i<data.dims; i++)
+                writer.put(qint32(data.size[i]));
+            writer.pad(16);
+        }
+        writer.put((const char*) data.data, qint64(data.total()) * data.elemSize());
+    }
+}
+
+qint64 TemplateCodec::recordSize(const char *header)
+{
+    RecordHeader recordHeader;
+    memcpy(&recordHeader, header, sizeof(recordHeader));
+    if ((recordHeader.kind != SegmentRecord) && (recordHeader.kind != KeysRecord) && (recordHeader.kind != TemplateRecord))
+        return -1;
+    return HeaderSize + qint64(recordHeader.size);
+}
+
+bool TemplateCodec::read(const char *record, Template &t, bool copy)
+{
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    Reader reader(record);
+
+    if (header.kind == SegmentRecord) {
+        if (header.version != Version)
+            qFatal("Unsupported template encoding version %u, expected %u.", header.version, Version);
+        atoms.clear();
+        return false;
+    }
+
+    if (header.kind == KeysRecord) {
+        const quint32 count = reader.get<quint32>();
+        reader.get<quint32>();
+        for (quint32 i=0; i<count; i++)
+            atoms.append(Metadata::atom(reader.string()));
+        return false;
+    }
+
+    if (header.kind != TemplateRecord)
+        qFatal("Unknown template encoding record %u.", header.kind);
+
+    const quint32 flags = reader.get<quint32>();
+    const quint32 metadataCount = reader.get<quint32>();
+    const quint32 matrixCount = reader.get<quint32>();
+    reader.get<quint32>();
+
+    const QString name = reader.string();
+    Metadata metadata;
+    for (quint32 i=0; i<metadataCount; i++) {
+        const quint32 key = reader.get<quint32>();
+        const ValueType type = ValueType(reader.get<quint32>());
+        if (key >= quint32(atoms.size()))
+            qFatal("Malformed template encoding, unknown key %u.", key);
+        metadata.insert(atoms[key], readValue(reader, type));
+    }
+
+    t = Template(File(metadata));
+    t.file.name = name;
+    t.file.fte = (flags & FailureToEnroll) != 0;
+    for (quint32 i=0; i<matrixCount; i++) {
+        reader.align(16);
+        const int rows = reader.get<qint32>();
+        const int cols = reader.get<qint32>();
+        const int type = reader.get<qint32>();
+        const int dims = reader.get<qint32>();
+        if (dims > 2) {
+            QVector<int> sizes(dims);
+            qint64 total = 1;
+            for (int j=0; j<dims; j++) {
+                sizes[j] = reader.get<qint32>();
+                total *= sizes[j];
+            }
+            reader.align(16);
+            const Mat m(dims, sizes.data(), type, (void*) reader.skip(total * CV_ELEM_SIZE(type)));
+            t.append(copy ? m.clone() : m);
+            continue;
+        }
+        const Mat m(rows, cols, type, (void*) reader.skip(qint64(rows) * cols * CV_ELEM_SIZE(type)));
+        t.append(copy ? m.clone() : m);
+    }
+    return true;
+}
+
+bool TemplateCodec::isEncoded(const QByteArray &buffer)
+{
+    if (buffer.size() < HeaderSize)
+        return false;
+    RecordHeader header;
+    memcpy(&header, buffer.constData(), sizeof(header));
+    return header.kind == SegmentRecord;
+}
+
+QByteArray TemplateCodec::encode(const TemplateList &templates)
+{
+    QByteArray buffer;
+    TemplateCodec codec;
+    foreach (const Template &t, templates)
+        codec.write(t, buffer);
+    return buffer;
+}
+
+TemplateList TemplateCodec::decode(const char *data, qint64 size, bool copy)
+{
+    TemplateList templates;
+    TemplateCodec codec;
+    qint64 offset = 0;
+    while (offset + HeaderSize <= size) {
+        const qint64 recordSize = TemplateCodec::recordSize(data + offset);
+        if ((recordSize < 0) || (offset + recordSize > size))
+            qFatal("Malformed template encoding at offset %lld.", offset);
+
+        Template t;
+        if (codec.read(data + offset, t, copy))
+            templates.append(t);
+        offset += recordSize;
+    }
+    return templates;
+}
+
+} // namespace br
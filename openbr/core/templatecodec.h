@@ -0,0 +1,76 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_TEMPLATECODEC_H
+#define BR_TEMPLATECODEC_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QVector>
+#include <openbr/openbr_plugin.h>
+
+namespace br
+{
+
+/*!
+ * \brief Compact binary encoding of templates, an alternative to their QDataStream operators.
+ *
+ * An encoding is a sequence of records, each a 16 byte header followed by a body padded to 16 bytes.
+ * A segment record starts the encoding and carries the version. Metadata keys are interned:
+ * a key record lists the keys first used by the next template, which refers to them by index until the next segment.
+ * Numbers, points, rects and lists of points or rects have fixed width encodings, other values use QDataStream.
+ * Matrix data starts 16 byte aligned relative to the encoding, so a reader can reference it in place.
+ *
+ * Appending the encodings of several writers is valid, since each starts a segment.
+ * Values are stored in native byte order.
+ */
+class TemplateCodec
+{
+public:
+    static const int HeaderSize = 16; /*!< \brief Bytes in a record header. */
+
+    TemplateCodec();
+
+    /*!
+     * \brief Append the records encoding \em t, starting a segment on first use.
+     */
+    void write(const Template &t, QByteArray &buffer);
+
+    /*!
+     * \brief Size of the record starting with \em header, including the header, or -1 if it isn't one.
+     */
+    static qint64 recordSize(const char *header);
+
+    /*!
+     * \brief Parse a complete record. Returns \c true if it encodes a template, which is assigned to \em t.
+     * Matrices reference \em record unless \em copy is set.
+     */
+    bool read(const char *record, Template &t, bool copy);
+
+    static bool isEncoded(const QByteArray &buffer); /*!< \brief Whether \em buffer starts with a segment record. */
+    static QByteArray encode(const TemplateList &templates); /*!< \brief Encode templates in a new segment. */
+    static TemplateList decode(const char *data, qint64 size, bool copy); /*!< \brief Decode every template in \em data. */
+
+private:
+    int fteAtom; // Carried by the record flags instead
+    QHash<int, quint32> keyIndices; // Atoms to key indices, for writing
+    QVector<int> atoms; // Key indices to atoms, for reading
+    bool started;
+};
+
+} // namespace br
+
+#endif // BR_TEMPLATECODEC_H
@@ -1,8 +1,11 @@
+#include <functional>
 #include "iarpa_janus.h"
 #include "iarpa_janus_io.h"
+#include "janus_prepared_gallery.h"
 #include "openbr_plugin.h"
 #include "openbr/core/opencvutils.h"
 #include "openbr/core/common.h"
+#include "openbr/core/scheduler.h"
 using namespace br;
 
 static QSharedPointer<Transform> transform;
@@ -175,29 +178,22 @@ janus_error janus_flatten_gallery(janus_gallery gallery, janus_flat_gallery flat
     return JANUS_SUCCESS;
 }
 
-janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
+// Matrix headers over the templates in a flat template, without copying them
+static QList<cv::Mat> unflatten(const janus_flat_template flat_template, const size_t bytes)
 {
-    *similarity = 0;
-
-    int comparisons = 0;
-    janus_flat_template a_template = a;
-    while (a_template < a + a_bytes) {
-        const size_t a_template_bytes = *reinterpret_cast<size_t*>(a_template);
-        a_template += sizeof(a_template_bytes);
-        janus_flat_template b_template = b;
-        while (b_template < b + b_bytes) {
-                const size_t b_template_bytes = *reinterpret_cast<size_t*>(b_template);
-                b_template += sizeof(b_template_bytes);
-                *similarity += distance->compare(cv::Mat(1, a_template_bytes, CV_8UC1, a_template),
-                                                 cv::Mat(1, b_template_bytes, CV_8UC1, b_template));
-                comparisons++;
-
-                b_template += b_template_bytes;
-        }
-
-        a_template += a_template_bytes;
+    QList<cv::Mat> templates;
+    janus_flat_template template_ = flat_template;
+    while (template_ < flat_template + bytes) {
+        const size_t template_bytes = *reinterpret_cast<size_t*>(template_);
+        template_ += sizeof(template_bytes);
+        templates.append(cv::Mat(1, template_bytes, CV_8UC1, template_));
+        template_ += template_bytes;
     }
+    return templates;
+}
 
+static janus_error average(float *similarity, int comparisons)
+{
     if (*similarity != *similarity) // True for NaN
         return JANUS_UNKNOWN_ERROR;
 
@@ -206,43 +202,185 @@ janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, cons
     return JANUS_SUCCESS;
 }
 
-janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+static janus_error verify(const QList<cv::Mat> &a, const QList<cv::Mat> &b, float *similarity)
+{
+    *similarity = 0;
+
+    int comparisons = 0;
+    foreach (const cv::Mat &a_template, a)
+        foreach (const cv::Mat &b_template, b) {
+            *similarity += distance->compare(a_template, b_template);
+            comparisons++;
+        }
+
+    return average(similarity, comparisons);
+}
+
+// As above, reading the templates of b in place, in the same order
+static janus_error verify(const QList<cv::Mat> &a, const janus_flat_template b, const size_t b_bytes, float *similarity)
+{
+    *similarity = 0;
+
+    int comparisons = 0;
+    foreach (const cv::Mat &a_template, a) {
+        janus_flat_template template_ = b;
+        while (template_ < b + b_bytes) {
+            const size_t template_bytes = *reinterpret_cast<size_t*>(template_);
+            template_ += sizeof(template_bytes);
+            *similarity += distance->compare(a_template, cv::Mat(1, template_bytes, CV_8UC1, template_));
+            comparisons++;
+            template_ += template_bytes;
+        }
+    }
+
+    return average(similarity, comparisons);
+}
+
+janus_error janus_verify(const janus_flat_template a, const size_t a_bytes, const janus_flat_template b, const size_t b_bytes, float *similarity)
+{
+    return verify(unflatten(a, a_bytes), unflatten(b, b_bytes), similarity);
+}
+
+struct janus_prepared_gallery_type
 {
-    typedef QPair<float, int> Pair;
-    QList<Pair> comparisons; comparisons.reserve(requested_returns);
+    QVector<janus_template_id> template_ids;
+    QVector< QList<cv::Mat> > templates;
+};
+
+janus_error janus_prepare_gallery(const janus_flat_gallery gallery, const size_t gallery_bytes, janus_prepared_gallery *prepared_gallery)
+{
+    *prepared_gallery = new janus_prepared_gallery_type();
     janus_flat_gallery target_gallery = gallery;
     while (target_gallery < gallery + gallery_bytes) {
-        janus_template_id target_id = *reinterpret_cast<janus_template_id*>(target_gallery);
+        const janus_template_id target_id = *reinterpret_cast<janus_template_id*>(target_gallery);
         target_gallery += sizeof(target_id);
 
         const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
         target_gallery += sizeof(target_template_bytes);
-        janus_flat_template target_template_flat = new janus_data[target_template_bytes];
-        memcpy(target_template_flat, target_gallery, target_template_bytes);
+
+        (*prepared_gallery)->template_ids.append(target_id);
+        (*prepared_gallery)->templates.append(unflatten(target_gallery, target_template_bytes));
         target_gallery += target_template_bytes;
+    }
+    return JANUS_SUCCESS;
+}
 
-        float similarity;
-        JANUS_ASSERT(janus_verify(probe, probe_bytes, target_template_flat, target_template_bytes, &similarity))
-        if (comparisons.size() < requested_returns) {
-            comparisons.append(Pair(similarity, target_id));
-            std::sort(comparisons.begin(), comparisons.end());
-        } else {
-            Pair temp = comparisons.first();
-            if (temp.first < similarity) {
-                comparisons.removeFirst();
-                comparisons.append(Pair(similarity, target_id));
-                std::sort(comparisons.begin(), comparisons.end());
+janus_error janus_free_prepared_gallery(janus_prepared_gallery prepared_gallery)
+{
+    delete prepared_gallery;
+    return JANUS_SUCCESS;
+}
+
+typedef QPair<float, janus_template_id> Candidate;
+
+// Keeps the best requested_returns candidates of a range of the gallery in a min-heap.
+// The gallery is either prepared, or the offsets of the entries in a flat gallery.
+class SearchTask : public QRunnable
+{
+    const QList<cv::Mat> *probe;
+    const janus_prepared_gallery_type *gallery;
+    const QVector<janus_flat_gallery> *entries;
+    int begin, end, requested_returns;
+
+public:
+    std::vector<Candidate> candidates;
+    janus_error error;
+
+    SearchTask(const QList<cv::Mat> *probe, const janus_prepared_gallery_type *gallery, const QVector<janus_flat_gallery> *entries, int begin, int end, int requested_returns)
+        : probe(probe), gallery(gallery), entries(entries), begin(begin), end(end), requested_returns(requested_returns), error(JANUS_SUCCESS)
+    {
+        setAutoDelete(false);
+        candidates.reserve(requested_returns);
+    }
+
+    void run()
+    {
+        for (int i=begin; i<end; i++) {
+            float similarity;
+            janus_template_id template_id;
+            if (gallery) {
+                template_id = gallery->template_ids[i];
+                error = verify(*probe, gallery->templates[i], &similarity);
+            } else {
+                janus_flat_gallery entry = (*entries)[i];
+                template_id = *reinterpret_cast<janus_template_id*>(entry);
+                entry += sizeof(template_id);
+                const size_t template_bytes = *reinterpret_cast<size_t*>(entry);
+                entry += sizeof(template_bytes);
+                error = verify(*probe, entry, template_bytes, &similarity);
+            }
+            if (error != JANUS_SUCCESS)
+                return;
+
+            const Candidate candidate(similarity, template_id);
+            if (int(candidates.size()) < requested_returns) {
+                candidates.push_back(candidate);
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<Candidate>());
+            } else if (candidates.front() < candidate) {
+                std::pop_heap(candidates.begin(), candidates.end(), std::greater<Candidate>());
+                candidates.back() = candidate;
+                std::push_heap(candidates.begin(), candidates.end(), std::greater<Candidate>());
             }
         }
-        delete[] target_template_flat;
     }
-    *actual_returns = comparisons.size();
-    QList<Pair> temp; temp.reserve(comparisons.size());
-    std::reverse_copy(comparisons.begin(), comparisons.end(), std::back_inserter(temp));
-    comparisons = temp;
-    foreach(const Pair &comparison, comparisons) {
-        *similarities = comparison.first; similarities++;
-        *template_ids = comparison.second; template_ids++;
+};
+
+static janus_error search(const janus_flat_template probe, const size_t probe_bytes, const janus_prepared_gallery_type *gallery, const QVector<janus_flat_gallery> *entries, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+{
+    *actual_returns = 0;
+    if (requested_returns <= 0)
+        return JANUS_SUCCESS;
+
+    const QList<cv::Mat> probe_templates = unflatten(probe, probe_bytes);
+
+    // Enough ranges to balance the load, but not so small that scheduling dominates
+    const int size = gallery ? gallery->templates.size() : entries->size();
+    const int ranges = std::max(1, std::min(4 * std::max(1, Globals->parallelism), size / 64));
+
+    QList<SearchTask*> tasks;
+    Scheduler::Group group;
+    for (int i=0; i<ranges; i++) {
+        tasks.append(new SearchTask(&probe_templates, gallery, entries, qint64(size) * i / ranges, qint64(size) * (i+1) / ranges, requested_returns));
+        if (ranges > 1) group.start(tasks.last());
+        else            tasks.last()->run();
+    }
+    group.wait();
+
+    janus_error error = JANUS_SUCCESS;
+    std::vector<Candidate> candidates;
+    foreach (SearchTask *task, tasks) {
+        if (task->error != JANUS_SUCCESS)
+            error = task->error;
+        candidates.insert(candidates.end(), task->candidates.begin(), task->candidates.end());
+        delete task;
+    }
+    if (error != JANUS_SUCCESS)
+        return error;
+
+    *actual_returns = std::min(requested_returns, int(candidates.size()));
+    std::partial_sort(candidates.begin(), candidates.begin() + *actual_returns, candidates.end(), std::greater<Candidate>());
+    for (int i=0; i<*actual_returns; i++) {
+        similarities[i] = candidates[i].first;
+        template_ids[i] = candidates[i].second;
     }
     return JANUS_SUCCESS;
 }
+
+janus_error janus_search_prepared(const janus_flat_template probe, const size_t probe_bytes, const janus_prepared_gallery prepared_gallery, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+{
+    return search(probe, probe_bytes, prepared_gallery, NULL, requested_returns, template_ids, similarities, actual_returns);
+}
+
+janus_error janus_search(const janus_flat_template probe, const size_t probe_bytes, const janus_flat_gallery gallery, const size_t gallery_bytes, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns)
+{
+    // Only the entry offsets are needed to split the gallery into ranges, the templates are read in place
+    QVector<janus_flat_gallery> entries;
+    janus_flat_gallery target_gallery = gallery;
+    while (target_gallery < gallery + gallery_bytes) {
+        entries.append(target_gallery);
+        target_gallery += sizeof(janus_template_id);
+        const size_t target_template_bytes = *reinterpret_cast<size_t*>(target_gallery);
+        target_gallery += sizeof(target_template_bytes) + target_template_bytes;
+    }
+    return search(probe, probe_bytes, NULL, &entries, requested_returns, template_ids, similarities, actual_returns);
+}
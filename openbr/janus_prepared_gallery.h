@@ -0,0 +1,53 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef BR_JANUS_PREPARED_GALLERY_H
+#define BR_JANUS_PREPARED_GALLERY_H
+
+#include <iarpa_janus.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*!
+ * \brief A janus_flat_gallery with the offsets of its templates parsed once, for repeated searches.
+ *
+ * It refers to the flat gallery it was prepared from, which must outlive it.
+ * \see janus_prepare_gallery janus_search_prepared janus_free_prepared_gallery
+ */
+typedef struct janus_prepared_gallery_type *janus_prepared_gallery;
+
+/*!
+ * \brief Parse a flat gallery for janus_search_prepared.
+ */
+JANUS_EXPORT janus_error janus_prepare_gallery(const janus_flat_gallery gallery, const size_t gallery_bytes, janus_prepared_gallery *prepared_gallery);
+
+/*!
+ * \brief Equivalent to janus_search against the gallery \em prepared_gallery was prepared from.
+ */
+JANUS_EXPORT janus_error janus_search_prepared(const janus_flat_template probe, const size_t probe_bytes, const janus_prepared_gallery prepared_gallery, int requested_returns, janus_template_id *template_ids, float *similarities, int *actual_returns);
+
+/*!
+ * \brief Free a gallery returned by janus_prepare_gallery, the flat gallery is not affected.
+ */
+JANUS_EXPORT janus_error janus_free_prepared_gallery(janus_prepared_gallery prepared_gallery);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BR_JANUS_PREPARED_GALLERY_H
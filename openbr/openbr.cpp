@@ -328,7 +328,8 @@ unsigned char *br_unload_img(br_template tmpl)
 
 br_template_list br_template_list_from_buffer(const char *buf, int len)
 {
-    QByteArray arr(buf, len);
+    // Templates are copied out of the buffer
+    const QByteArray arr = QByteArray::fromRawData(buf, len);
     TemplateList *tl = new TemplateList();
     *tl = TemplateList::fromBuffer(arr);
     return (br_template_list)tl;
@@ -151,6 +151,9 @@ BR_EXPORT void br_project(const char *input, const char *output);
 
 /*!
  * \brief Creates a \c .csv file containing performance metrics from evaluating the similarity matrix using the mask matrix.
+ *
+ * \c .mtx matrices with more than 2^31 comparisons, or given as \c simmat.mtx[streaming], are evaluated a block of rows at a time
+ * in bounded memory, see br::StreamingEvaluation for the accuracy of the results.
  * \param simmat The \ref simmat to use.
  * \param mask The \ref mask to use.
  * \param csv Optional \c .csv file to contain performance metrics.
@@ -504,7 +507,8 @@ BR_EXPORT unsigned char* br_unload_img(br_template tmpl);
 /*!
   * \brief Deserialize a br::TemplateList from a buffer.
   *        Can be the buffer for a .gal file,
-  *        since they are just a TemplateList serialized to disk.
+  *        since they are just a TemplateList serialized to disk,
+  *        or for a .brt file.
   */
 BR_EXPORT br_template_list br_template_list_from_buffer(const char *buf, int len);
 /*!
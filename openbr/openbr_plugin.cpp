@@ -14,18 +14,18 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QAtomicPointer>
 #include <QCoreApplication>
 #include <QCryptographicHash>
-#include <QFutureSynchronizer>
 #include <QLocalSocket>
 #include <QMetaProperty>
+#include <QMutex>
 #include <qnumeric.h>
 #include <QPointF>
 #include <QProcess>
 #include <QRect>
 #include <QRegExp>
 #include <QThreadPool>
-#include <QtConcurrentRun>
 #include <algorithm>
 #include <iostream>
 
@@ -37,8 +37,12 @@
 #include "version.h"
 #include "core/bee.h"
 #include "core/common.h"
+#include "core/mappedfiles.h"
 #include "core/opencvutils.h"
+#include "core/profiler.h"
 #include "core/qtutils.h"
+#include "core/scheduler.h"
+#include "core/templatecodec.h"
 #include "openbr/plugins/openbr_internal.h"
 
 using namespace br;
@@ -56,6 +60,137 @@ static const QMetaObject *getInterface(const QObject *obj)
     return baseClass;
 }
 
+/* Metadata - public methods */
+// Readers look up keys without locking in an immutable table, inserting a key publishes a copy
+struct MetadataAtoms
+{
+    QHash<QString, int> atoms;
+    QStringList keys;
+};
+
+struct MetadataTable
+{
+    QMutex lock; // Serializes insertions
+    QAtomicPointer<const MetadataAtoms> current;
+    QList<const MetadataAtoms*> tables; // Every published table, since readers may still hold an outdated one
+
+    MetadataTable()
+    {
+        MetadataAtoms *table = new MetadataAtoms();
+        // In the order of Metadata::Key
+        table->keys << "Label" << "Rects" << "Points" << "FrameNumber" << "progress";
+        for (int i=0; i<table->keys.size(); i++)
+            table->atoms.insert(table->keys[i], i);
+        tables.append(table);
+        current.storeRelease(table);
+    }
+
+    ~MetadataTable()
+    {
+        qDeleteAll(tables);
+    }
+};
+
+Q_GLOBAL_STATIC(MetadataTable, metadataTable)
+
+int Metadata::atom(const QString &key)
+{
+    const int atom = find(key);
+    if (atom != -1)
+        return atom;
+
+    MetadataTable *table = metadataTable();
+    QMutexLocker locker(&table->lock);
+    const MetadataAtoms *atoms = table->current.loadAcquire();
+    QHash<QString, int>::const_iterator it = atoms->atoms.constFind(key);
+    if (it != atoms->atoms.constEnd())
+        return it.value();
+
+    MetadataAtoms *inserted = new MetadataAtoms(*atoms);
+    inserted->keys.append(key);
+    inserted->atoms.insert(key, inserted->keys.size()-1);
+    table->tables.append(inserted);
+    table->current.storeRelease(inserted);
+    return inserted->keys.size()-1;
+}
+
+int Metadata::find(const QString &key)
+{
+    return metadataTable()->current.loadAcquire()->atoms.value(key, -1);
+}
+
+QString Metadata::key(int atom)
+{
+    return metadataTable()->current.loadAcquire()->keys.value(atom);
+}
+
+QVariant &Metadata::operator[](int atom)
+{
+    const int i = indexOf(atom);
+    if (i != -1)
+        return entries[i].value;
+
+    Entry entry;
+    entry.atom = atom;
+    entries.append(entry);
+    return entries.last().value;
+}
+
+void Metadata::insert(int atom, const QVariant &value)
+{
+    (*this)[atom] = value;
+}
+
+void Metadata::remove(int atom)
+{
+    const int i = indexOf(atom);
+    if (i != -1)
+        entries.remove(i);
+}
+
+QStringList Metadata::keys() const
+{
+    QStringList keys;
+    keys.reserve(entries.size());
+    foreach (const Entry &entry, entries)
+        keys.append(key(entry.atom));
+    keys.sort();
+    return keys;
+}
+
+QVariantMap Metadata::toMap() const
+{
+    QVariantMap map;
+    foreach (const Entry &entry, entries)
+        map.insert(key(entry.atom), entry.value);
+    return map;
+}
+
+Metadata Metadata::fromMap(const QVariantMap &map)
+{
+    Metadata metadata;
+    metadata.entries.reserve(map.size());
+    for (QVariantMap::const_iterator it = map.constBegin(); it != map.constEnd(); ++it) {
+        Entry entry;
+        entry.atom = atom(it.key());
+        entry.value = it.value();
+        metadata.entries.append(entry);
+    }
+    return metadata;
+}
+
+bool Metadata::operator==(const Metadata &other) const
+{
+    if (entries.size() != other.entries.size())
+        return false;
+    foreach (const Entry &entry, entries) {
+        const QVariant *value = other.lookup(entry.atom);
+        if (!value || (*value != entry.value))
+            return false;
+    }
+    return true;
+}
+
 /* File - public methods */
 // Note that the convention for displaying metadata is as follows:
 // [] for lists in which argument order does not matter (e.g. [FTO=false, Index=0]),
@@ -82,8 +217,8 @@ QString File::hash() const
 
 void File::append(const QVariantMap &metadata)
 {
-    foreach (const QString &key, metadata.keys())
-        set(key, metadata[key]);
+    for (QVariantMap::const_iterator it = metadata.constBegin(); it != metadata.constEnd(); ++it)
+        set(it.key(), it.value());
 }
 
 void File::append(const File &other)
@@ -96,7 +231,13 @@ void File::append(const File &other)
             name += value("separator").toString() + other.name;
         }
     }
-    append(other.m_metadata);
+
+    if (m_metadata.isEmpty()) {
+        m_metadata = other.m_metadata;
+    } else {
+        for (int i=0; i<other.m_metadata.size(); i++)
+            m_metadata.insert(other.m_metadata.atomAt(i), other.m_metadata.valueAt(i));
+    }
 }
 
 QList<File> File::split() const
@@ -111,7 +252,7 @@ QList<File> File::split(const QString &separator) const
     QList<File> files;
     foreach (const QString &word, name.split(separator, QString::SkipEmptyParts)) {
         File file(word);
-        file.append(m_metadata);
+        file.m_metadata = m_metadata;
         files.append(file);
     }
     return files;
@@ -134,7 +275,8 @@ QString File::resolved() const
 
 bool File::contains(const QString &key) const
 {
-    return m_metadata.contains(key) || Globals->contains(key) || key == "name";
+    const int atom = Metadata::find(key);
+    return ((atom != -1) && m_metadata.contains(atom)) || Globals->contains(key) || key == "name";
 }
 
 bool File::contains(const QStringList &keys) const
@@ -147,7 +289,8 @@ bool File::contains(const QStringList &keys) const
 
 QVariant File::value(const QString &key) const
 {
-    return m_metadata.contains(key) ? m_metadata.value(key) : (key == "name" ? name : Globals->property(qPrintable(key)));
+    const QVariant *value = m_metadata.lookup(Metadata::find(key));
+    return value ? *value : (key == "name" ? name : Globals->property(qPrintable(key)));
 }
 
 QVariant File::parse(const QString &value)
@@ -187,8 +330,8 @@ bool File::getBool(const QString &key, bool defaultValue) const
 QList<QPointF> File::namedPoints() const
 {
     QList<QPointF> landmarks;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(Metadata::find(key));
         if (variant.canConvert<QPointF>()) {
             const QPointF point = variant.value<QPointF>();
             if (!qIsNaN(point.x()) && !qIsNaN(point.y()))
@@ -201,31 +344,41 @@ QList<QPointF> File::namedPoints() const
 QList<QPointF> File::points() const
 {
     QList<QPointF> points;
-    foreach (const QVariant &point, m_metadata["Points"].toList())
+    foreach (const QVariant &point, m_metadata.value(Metadata::Points).toList())
         points.append(point.toPointF());
     return points;
 }
 
+// Release the variant's reference to the list so appending to it doesn't copy
+static QVariantList takeList(QVariant &variant)
+{
+    QVariantList list = variant.toList();
+    variant = QVariant();
+    return list;
+}
+
 void File::appendPoint(const QPointF &point)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QVariant &variant = m_metadata[Metadata::Points];
+    QVariantList newPoints = takeList(variant);
     newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    variant = newPoints;
 }
 
 void File::appendPoints(const QList<QPointF> &points)
 {
-    QList<QVariant> newPoints = m_metadata["Points"].toList();
+    QVariant &variant = m_metadata[Metadata::Points];
+    QVariantList newPoints = takeList(variant);
     foreach (const QPointF &point, points)
         newPoints.append(point);
-    m_metadata["Points"] = newPoints;
+    variant = newPoints;
 }
 
 QList<QRectF> File::namedRects() const
 {
     QList<QRectF> rects;
-    foreach (const QString &key, localMetadata().keys()) {
-        const QVariant &variant = m_metadata[key];
+    foreach (const QString &key, localKeys()) {
+        const QVariant variant = m_metadata.value(Metadata::find(key));
         if (variant.canConvert<QRectF>())
             rects.append(variant.value<QRectF>());
         else if (variant.canConvert<QList<QRectF> >()) {
@@ -242,16 +395,17 @@ QList<QRectF> File::namedRects() const
 QList<QRectF> File::rects() const
 {
     QList<QRectF> rects;
-    foreach (const QVariant &rect, m_metadata["Rects"].toList())
+    foreach (const QVariant &rect, m_metadata.value(Metadata::Rects).toList())
         rects.append(rect.toRect());
     return rects;
 }
 
 void File::appendRect(const QRectF &rect)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QVariant &variant = m_metadata[Metadata::Rects];
+    QVariantList newRects = takeList(variant);
     newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    variant = newRects;
 }
 
 void File::appendRect(const cv::Rect &rect)
@@ -261,10 +415,11 @@ void File::appendRect(const cv::Rect &rect)
 
 void File::appendRects(const QList<QRectF> &rects)
 {
-    QList<QVariant> newRects = m_metadata["Rects"].toList();
+    QVariant &variant = m_metadata[Metadata::Rects];
+    QVariantList newRects = takeList(variant);
     foreach (const QRectF &rect, rects)
         newRects.append(rect);
-    m_metadata["Rects"] = newRects;
+    variant = newRects;
 }
 
 void File::appendRects(const QList<cv::Rect> &rects)
@@ -317,14 +472,16 @@ QDebug br::operator<<(QDebug dbg, const File &file)
 
 QDataStream &br::operator<<(QDataStream &stream, const File &file)
 {
-    File temp = file;
-    temp.set("FTE",QVariant::fromValue(file.fte));
-    return stream << temp.name << temp.m_metadata;
+    QVariantMap metadata = file.m_metadata.toMap();
+    metadata.insert("FTE", QVariant::fromValue(file.fte));
+    return stream << file.name << metadata;
 }
 
 QDataStream &br::operator>>(QDataStream &stream, File &file)
 {
-    stream >> file.name >> file.m_metadata;
+    QVariantMap metadata;
+    stream >> file.name >> metadata;
+    file.m_metadata = Metadata::fromMap(metadata);
     file.fte = file.getBool("FTE", false);
     return stream;
 }
@@ -519,6 +676,9 @@ TemplateList TemplateList::fromGallery(const br::File &gallery)
 
 TemplateList TemplateList::fromBuffer(const QByteArray &buffer)
 {
+    if (TemplateCodec::isEncoded(buffer))
+        return TemplateCodec::decode(buffer.constData(), buffer.size(), true);
+
     TemplateList templateList;
     QDataStream stream(buffer);
     while (!stream.atEnd()) {
@@ -1194,6 +1354,9 @@ void br::Context::finalize()
     foreach (const QSharedPointer<Initializer> &initializer, initializers)
         initializer->finalize();
 
+    Scheduler::finalize();
+    Profiler::finalize();
+    MappedFiles::finalize();
     delete Globals;
     Globals = NULL;
 
@@ -1332,6 +1495,20 @@ void Output::setRelative(float value, int i, int j)
     if (!next.isNull()) next->setRelative(value, i, j);
 }
 
+void Output::setRow(const float *values, int count, int i, int j)
+{
+    setRange(values, count, i+offset.y(), j+offset.x());
+    if (!next.isNull()) next->setRow(values, count, i, j);
+}
+
+void Output::setRows(const Mat &values, int i, int j)
+{
+    if (values.type() != CV_32FC1)
+        qFatal("Expected CV_32FC1 scores.");
+    for (int k=0; k<values.rows; k++)
+        setRow(values.ptr<float>(k), values.cols, i+k, j);
+}
+
 Output *Output::make(const File &file, const FileList &targetFiles, const FileList &queryFiles)
 {
     Output *output = NULL;
@@ -1346,6 +1523,13 @@ Output *Output::make(const File &file, const FileList &targetFiles, const FileLi
     return output;
 }
 
+/* Output - private methods */
+void Output::setRange(const float *values, int count, int i, int j)
+{
+    for (int k=0; k<count; k++)
+        set(values[k], i, j+k);
+}
+
 /* MatrixOutput - public methods */
 void MatrixOutput::initialize(const FileList &targetFiles, const FileList &queryFiles)
 {
@@ -1370,6 +1554,11 @@ void MatrixOutput::set(float value, int i, int j)
     data.at<float>(i,j) = value;
 }
 
+void MatrixOutput::setRange(const float *values, int count, int i, int j)
+{
+    memcpy(data.ptr<float>(i) + j, values, count * sizeof(float));
+}
+
 BR_REGISTER(Output, MatrixOutput)
 
 /* Format - public methods */
@@ -1388,7 +1577,12 @@ TemplateList Gallery::read()
 {
     TemplateList templates;
     bool done = false;
-    while (!done) templates.append(readBlock(&done));
+    while (!done) {
+        Profiler::Scope scope(this, "read");
+        const TemplateList block = readBlock(&done);
+        scope.output(block);
+        templates.append(block);
+    }
     return templates;
 }
 
@@ -1402,7 +1596,10 @@ FileList Gallery::files()
 
 void Gallery::writeBlock(const TemplateList &templates)
 {
-    foreach (const Template &t, templates) write(t);
+    {
+        Profiler::Scope scope(this, "write", templates);
+        foreach (const Template &t, templates) write(t);
+    }
     if (!next.isNull()) next->writeBlock(templates);
 }
 
@@ -1519,6 +1716,22 @@ static void _project(const Transform *transform, const Template *src, Template *
     }
 }
 
+class ProjectTask : public QRunnable
+{
+    const Transform *transform;
+    const Template *src;
+    Template *dst;
+
+public:
+    ProjectTask(const Transform *transform, const Template *src, Template *dst)
+        : transform(transform), src(src), dst(dst) {}
+
+    void run()
+    {
+        _project(transform, src, dst);
+    }
+};
+
 // Default project(TemplateList) calls project(Template) separately for each element
 void Transform::project(const TemplateList &src, TemplateList &dst) const
 {
@@ -1526,11 +1739,11 @@ void Transform::project(const TemplateList &src, TemplateList &dst) const
 
     for (int i=0; i<src.size(); i++)
         dst.append(Template());
-    QFutureSynchronizer<void> futures;
+    Scheduler::Group tasks;
     for (int i=0; i<dst.size(); i++)
-        if (Globals->parallelism > 1) futures.addFuture(QtConcurrent::run(_project, this, &src[i], &dst[i]));
+        if (Globals->parallelism > 1) tasks.start(new ProjectTask(this, &src[i], &dst[i]));
         else                          _project(this, &src[i], &dst[i]);
-    futures.waitForFinished();
+    tasks.wait();
 }
 
 TemplateEvent *Transform::getEvent(const QString &name)
@@ -1564,6 +1777,27 @@ void Transform::train(const QList<TemplateList> &data)
     train(combined);
 }
 
+// Wrap the single matrix of each template without copying it,
+// fails unless they are already consecutive rows of one buffer of the given shape.
+static bool contiguousTemplates(const TemplateList &templates, int rows, int cols, int type, Mat &packed)
+{
+    if (templates.isEmpty() || (templates.first().size() != 1))
+        return false;
+
+    const uchar *data = templates.first().first().data;
+    const size_t size = rows * cols * CV_ELEM_SIZE(type);
+    for (int i=0; i<templates.size(); i++) {
+        if (templates[i].size() != 1)
+            return false;
+        const Mat &m = templates[i].first();
+        if ((m.rows != rows) || (m.cols != cols) || (m.type() != type) || !m.isContinuous() || (m.data != data + i*size))
+            return false;
+    }
+
+    packed = Mat(templates.size(), size, CV_8UC1, (void*)data);
+    return true;
+}
+
 /* Distance - public methods */
 Distance *Distance::make(QString str, QObject *parent)
 {
@@ -1586,23 +1820,35 @@ Distance *Distance::make(QString str, QObject *parent)
 
 void Distance::compare(const TemplateList &target, const TemplateList &query, Output *output) const
 {
+    if (compareTiled(target, query, output))
+        return;
+
     const bool stepTarget = target.size() > query.size();
     const int totalSize = std::max(target.size(), query.size());
     int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
-    QFutureSynchronizer<void> futures;
+    Scheduler::Group tasks;
     for (int i=0; i<totalSize; i+=stepSize) {
         const TemplateList &targets(stepTarget ? TemplateList(target.mid(i, stepSize)) : target);
         const TemplateList &queries(stepTarget ? query : TemplateList(query.mid(i, stepSize)));
         const int targetOffset = stepTarget ? i : 0;
         const int queryOffset = stepTarget ? 0 : i;
-        if (Globals->parallelism) futures.addFuture(QtConcurrent::run(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
-        else                                                                           compareBlock (targets, queries, output, targetOffset, queryOffset);
+        if (Globals->parallelism) tasks.start(newTask(this, &Distance::compareBlock, targets, queries, output, targetOffset, queryOffset));
+        else                                                     compareBlock (targets, queries, output, targetOffset, queryOffset);
     }
-    futures.waitForFinished();
+    tasks.wait();
 }
 
 QList<float> Distance::compare(const TemplateList &targets, const Template &query) const
 {
+    // Templates read from an fvGallery are compared as one matrix
+    Mat packed;
+    if ((query.size() == 1) && !query.m().empty() && query.m().isContinuous() &&
+        contiguousTemplates(targets, query.m().rows, query.m().cols, query.m().type(), packed)) {
+        QVector<float> batch(packed.rows);
+        if (compareBatch(query.m().data, packed.data, 1, packed.rows, packed.cols, batch.data()))
+            return batch.toList();
+    }
+
     QList<float> scores; scores.reserve(targets.size());
     foreach (const Template &target, targets)
         scores.append(compare(target, query));
@@ -1642,13 +1888,103 @@ float Distance::compare(const uchar *, const uchar *, size_t) const
     return -std::numeric_limits<float>::max();
 }
 
+bool Distance::compareBatch(const uchar *, const uchar *, int, int, size_t, float *) const
+{
+    return false;
+}
+
 /* Distance - private methods */
 void Distance::compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const
 {
-    for (int i=0; i<query.size(); i++)
+    QVector<float> scores(target.size());
+    for (int i=0; i<query.size(); i++) {
         for (int j=0; j<target.size(); j++)
-            if (target[j].isEmpty() || query[i].isEmpty()) output->setRelative(-std::numeric_limits<float>::max(),i+queryOffset, j+targetOffset);
-            else output->setRelative(compare(target[j], query[i]), i+queryOffset, j+targetOffset);
+            if (target[j].isEmpty() || query[i].isEmpty()) scores[j] = -std::numeric_limits<float>::max();
+            else scores[j] = compare(target[j], query[i]);
+        output->setRow(scores.constData(), scores.size(), i+queryOffset, targetOffset);
+    }
+}
+
+// Copy the single matrix of each template into a row of one contiguous buffer (unless it already is one),
+// fails if any template can't be compared as a raw buffer of the given shape.
+static bool packTemplates(const TemplateList &templates, int rows, int cols, int type, Mat &packed)
+{
+    if (contiguousTemplates(templates, rows, cols, type, packed))
+        return true;
+
+    packed.create(templates.size(), rows * cols * CV_ELEM_SIZE(type), CV_8UC1);
+    for (int i=0; i<templates.size(); i++) {
+        if (templates[i].size() != 1)
+            return false;
+        const Mat &m = templates[i].first();
+        if ((m.rows != rows) || (m.cols != cols) || (m.type() != type) || !m.isContinuous())
+            return false;
+        memcpy(packed.ptr(i), m.data, packed.cols);
+    }
+    return true;
+}
+
+// Tiles are sized so a block of targets stays resident in L2 while each query streams through L1
+static const size_t TargetTileBytes = 1 << 17;
+static const size_t QueryTileBytes = 1 << 15;
+static const int MaxTileTargets = 1024;
+static const int MaxTileQueries = 256;
+
+bool Distance::compareTiled(const TemplateList &target, const TemplateList &query, Output *output) const
+{
+    if (target.isEmpty() || query.isEmpty() || (target.first().size() != 1))
+        return false;
+
+    const Mat &m = target.first().first();
+    if (m.empty() || !m.isContinuous() || (query.first().size() != 1))
+        return false;
+
+    // Probe for a batched implementation with the first pair, before copying either gallery
+    const Mat &q = query.first().first();
+    if ((q.rows != m.rows) || (q.cols != m.cols) || (q.type() != m.type()) || !q.isContinuous())
+        return false;
+    float score;
+    if (!compareBatch(q.data, m.data, 1, 1, m.total() * m.elemSize(), &score))
+        return false;
+
+    Mat targets, queries;
+    if (!packTemplates(target, m.rows, m.cols, m.type(), targets) ||
+        !packTemplates(query, m.rows, m.cols, m.type(), queries))
+        return false;
+
+    const bool stepTarget = targets.rows > queries.rows;
+    const int totalSize = std::max(targets.rows, queries.rows);
+    const int stepSize = ceil(float(totalSize) / float(std::max(1, abs(Globals->parallelism))));
+    Scheduler::Group tasks;
+    for (int i=0; i<totalSize; i+=stepSize) {
+        const int end = std::min(i+stepSize, totalSize);
+        const Mat targetRows = stepTarget ? targets.rowRange(i, end) : targets;
+        const Mat queryRows = stepTarget ? queries : queries.rowRange(i, end);
+        const int targetOffset = stepTarget ? i : 0;
+        const int queryOffset = stepTarget ? 0 : i;
+        if (Globals->parallelism) tasks.start(newTask(this, &Distance::compareTiles, targetRows, queryRows, output, targetOffset, queryOffset));
+        else                                                     compareTiles (targetRows, queryRows, output, targetOffset, queryOffset);
+    }
+    tasks.wait();
+    return true;
+}
+
+void Distance::compareTiles(const Mat &targets, const Mat &queries, Output *output, int targetOffset, int queryOffset) const
+{
+    const size_t size = targets.cols;
+    const int tileTargets = std::max(1, std::min(MaxTileTargets, int(TargetTileBytes / size)));
+    const int tileQueries = std::max(1, std::min(MaxTileQueries, int(QueryTileBytes / size)));
+    QVector<float> scores(tileTargets * tileQueries);
+
+    for (int t=0; t<targets.rows; t+=tileTargets) {
+        const int targetCount = std::min(tileTargets, targets.rows - t);
+        for (int q=0; q<queries.rows; q+=tileQueries) {
+            const int queryCount = std::min(tileQueries, queries.rows - q);
+            compareBatch(queries.ptr(q), targets.ptr(t), queryCount, targetCount, size, scores.data());
+            for (int i=0; i<queryCount; i++)
+                output->setRow(&scores[i*targetCount], targetCount, q+i+queryOffset, t+targetOffset);
+        }
+    }
 }
 
 void br::applyAdditionalProperties(const File &temp, Transform *target)
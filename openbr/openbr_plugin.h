@@ -109,6 +109,66 @@ TYPE get_##NAME() const { return NAME; }                \
 void set_##NAME(TYPE the_##NAME) { NAME = the_##NAME; } \
 void reset_##NAME() { NAME = DEFAULT; }
 
+/*!
+ * \brief The local metadata table of a br::File.
+ *
+ * Keys are interned in a process-wide table as integer atoms, the most frequently used keys have the fixed atoms in #Key.
+ * Entries are kept unsorted in a small implicitly shared vector, so the handful of keys a file typically carries are found by
+ * comparing integers and copies of a file share one table until either is modified.
+ */
+class BR_EXPORT Metadata
+{
+public:
+    /*!
+     * \brief Atoms of frequently used keys, for use with the br::File overloads taking a br::Metadata::Key.
+     */
+    enum Key { Label, /*!< \brief \c Label */
+               Rects, /*!< \brief \c Rects */
+               Points, /*!< \brief \c Points */
+               FrameNumber, /*!< \brief \c FrameNumber */
+               Progress /*!< \brief \c progress */ };
+
+    static int atom(const QString &key); /*!< \brief Returns the atom for \em key, interning it if necessary. */
+    static int find(const QString &key); /*!< \brief Returns the atom for \em key, or -1 if it has not been interned. */
+    static QString key(int atom); /*!< \brief Returns the key interned as \em atom. */
+
+    inline int size() const { return entries.size(); } /*!< \brief Returns the number of entries. */
+    inline bool isEmpty() const { return entries.isEmpty(); } /*!< \brief Returns \c true if there are no entries. */
+    inline int atomAt(int i) const { return entries.at(i).atom; } /*!< \brief Returns the atom of the <em>i</em>th entry. */
+    inline const QVariant &valueAt(int i) const { return entries.at(i).value; } /*!< \brief Returns the value of the <em>i</em>th entry. */
+
+    inline bool contains(int atom) const { return indexOf(atom) != -1; } /*!< \brief Returns \c true if \em atom has an entry. */
+    inline const QVariant *lookup(int atom) const { const int i = indexOf(atom);
+                                                    return i == -1 ? NULL : &entries.at(i).value; } /*!< \brief Returns the value for \em atom, or \c NULL. */
+    inline QVariant value(int atom) const { const QVariant *value = lookup(atom);
+                                            return value ? *value : QVariant(); } /*!< \brief Returns the value for \em atom, or a null variant. */
+    QVariant &operator[](int atom); /*!< \brief Returns the value for \em atom, inserting a null variant if necessary. */
+    void insert(int atom, const QVariant &value); /*!< \brief Insert or overwrite the value for \em atom. */
+    void remove(int atom); /*!< \brief Remove the entry for \em atom. */
+
+    QStringList keys() const; /*!< \brief Returns the sorted keys. */
+    QVariantMap toMap() const; /*!< \brief Returns the table as a map. */
+    static Metadata fromMap(const QVariantMap &map); /*!< \brief Construct a table from a map. */
+    bool operator==(const Metadata &other) const; /*!< \brief Compare entries regardless of order. */
+
+private:
+    struct Entry
+    {
+        int atom;
+        QVariant value;
+    };
+    QVector<Entry> entries;
+
+    inline int indexOf(int atom) const
+    {
+        const Entry *data = entries.constData();
+        for (int i=0; i<entries.size(); i++)
+            if (data[i].atom == atom)
+                return i;
+        return -1;
+    }
+};
+
 /*!
  * \brief A file path with associated metadata.
  *
@@ -119,6 +179,7 @@ void reset_##NAME() { NAME = DEFAULT; }
  * When querying the value of a metadata key, the value will first try to be resolved against the file's private metadata table.
  * If the key does not exist in its local table then it will be resolved against the properities in the global Context.
  * By design file metadata may be set globally using Context::setProperty to operate on all files.
+ * The private table is a br::Metadata, the overloads taking a br::Metadata::Key avoid the string lookup for frequently used keys.
  *
  * Files have a simple grammar that allow them to be converted to and from strings.
  * If a string ends with a \c ] or \c ) then the text within the final \c [] or \c () are parsed as comma sperated metadata fields.
@@ -172,15 +233,17 @@ struct BR_EXPORT File
 
     File() { fte = false; }
     File(const QString &file) { init(file); } /*!< \brief Construct a file from a string. */
-    File(const QString &file, const QVariant &label) { init(file); set("Label", label); } /*!< \brief Construct a file from a string and assign a label. */
+    File(const QString &file, const QVariant &label) { init(file); set(Metadata::Label, label); } /*!< \brief Construct a file from a string and assign a label. */
     File(const char *file) { init(file); } /*!< \brief Construct a file from a c-style string. */
-    File(const QVariantMap &metadata) : fte(false), m_metadata(metadata) {} /*!< \brief Construct a file from metadata. */
+    File(const QVariantMap &metadata) : fte(false), m_metadata(Metadata::fromMap(metadata)) {} /*!< \brief Construct a file from metadata. */
+    File(const Metadata &metadata) : fte(false), m_metadata(metadata) {} /*!< \brief Construct a file from metadata. */
     inline operator QString() const { return name; } /*!< \brief Returns #name. */
     QString flat() const; /*!< \brief A stringified version of the file with metadata. */
     QString hash() const; /*!< \brief A hash of the file. */
 
     inline QStringList localKeys() const { return m_metadata.keys(); } /*!< \brief Returns the private metadata keys. */
-    inline QVariantMap localMetadata() const { return m_metadata; } /*!< \brief Returns the private metadata. */
+    inline QVariantMap localMetadata() const { return m_metadata.toMap(); } /*!< \brief Returns a copy of the private metadata as a map. */
+    inline const Metadata &metadata() const { return m_metadata; } /*!< \brief Returns the private metadata table. */
 
     void append(const QVariantMap &localMetadata); /*!< \brief Add new metadata fields. */
     void append(const File &other); /*!< \brief Append another file using \c separator. */
@@ -216,9 +279,15 @@ struct BR_EXPORT File
     bool contains(const QStringList &keys) const; /*!< \brief Returns \c true if all keys have associated values, \c false otherwise. */
     QVariant value(const QString &key) const; /*!< \brief Returns the value for the specified key. */
     static QVariant parse(const QString &value); /*!< \brief Try to convert the QString to a QPointF or QRectF if possible. */
-    inline void set(const QString &key, const QVariant &value) { m_metadata.insert(key, value); } /*!< \brief Insert or overwrite the metadata key with the specified value. */
+    inline void set(const QString &key, const QVariant &value) { m_metadata.insert(Metadata::atom(key), value); } /*!< \brief Insert or overwrite the metadata key with the specified value. */
     void set(const QString &key, const QString &value); /*!< \brief Insert or overwrite the metadata key with the specified value. */
 
+    inline bool contains(Metadata::Key key) const { return m_metadata.contains(key) || contains(Metadata::key(key)); } /*!< \brief Returns \c true if the key has an associated value, \c false otherwise. */
+    inline QVariant value(Metadata::Key key) const { const QVariant *value = m_metadata.lookup(key);
+                                                     return value ? *value : this->value(Metadata::key(key)); } /*!< \brief Returns the value for the specified key. */
+    inline void set(Metadata::Key key, const QVariant &value) { m_metadata.insert(key, value); } /*!< \brief Insert or overwrite the metadata key with the specified value, which is not parsed. */
+    inline void remove(Metadata::Key key) { m_metadata.remove(key); } /*!< \brief Remove the metadata key. */
+
     /*!< \brief Specialization for list type. Insert or overwrite the metadata key with the specified value. */
     template <typename T>
     void setList(const QString &key, const QList<T> &value)
@@ -230,7 +299,8 @@ struct BR_EXPORT File
         set(key, variantList);
     }
 
-    inline void remove(const QString &key) { m_metadata.remove(key); } /*!< \brief Remove the metadata key. */
+    inline void remove(const QString &key) { const int atom = Metadata::find(key);
+                                             if (atom != -1) m_metadata.remove(atom); } /*!< \brief Remove the metadata key. */
 
     /*!< \brief Returns a value for the key, throwing an error if the key does not exist. */
     template <typename T>
@@ -252,6 +322,26 @@ struct BR_EXPORT File
         return variant.value<T>();
     }
 
+    /*!< \brief Returns a value for the key, throwing an error if the key does not exist. */
+    template <typename T>
+    T get(Metadata::Key key) const
+    {
+        const QVariant *variant = m_metadata.lookup(key);
+        if (!variant) return get<T>(Metadata::key(key));
+        if (!variant->canConvert<T>()) qFatal("Can't convert: %s in: %s", qPrintable(Metadata::key(key)), qPrintable(flat()));
+        return variant->value<T>();
+    }
+
+    /*!< \brief Returns a value for the key, returning \em defaultValue if the key does not exist or can't be converted. */
+    template <typename T>
+    T get(Metadata::Key key, const T &defaultValue) const
+    {
+        const QVariant *variant = m_metadata.lookup(key);
+        if (!variant) return get<T>(Metadata::key(key), defaultValue);
+        if (!variant->canConvert<T>()) return defaultValue;
+        return variant->value<T>();
+    }
+
     /*!< \brief Specialization for boolean type. */
     bool getBool(const QString &key, bool defaultValue = false) const;
 
@@ -261,7 +351,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) qFatal("Missing key: %s in: %s", qPrintable(key), qPrintable(flat()));
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(Metadata::find(key)).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else qFatal("Failed to convert value for key %s in: %s", qPrintable(key), qPrintable(flat()));
         }
@@ -274,7 +364,7 @@ struct BR_EXPORT File
     {
         if (!contains(key)) return defaultValue;
         QList<T> list;
-        foreach (const QVariant &item, m_metadata[key].toList()) {
+        foreach (const QVariant &item, m_metadata.value(Metadata::find(key)).toList()) {
             if (item.canConvert<T>()) list.append(item.value<T>());
             else return defaultValue;
         }
@@ -312,7 +402,7 @@ struct BR_EXPORT File
     QList<QPointF> points() const; /*!< \brief Returns the file's points list. */
     void appendPoint(const QPointF &point); /*!< \brief Adds a point to the file's point list. */
     void appendPoints(const QList<QPointF> &points); /*!< \brief Adds landmarks to the file's landmark list. */
-    inline void clearPoints() { m_metadata["Points"] = QList<QVariant>(); } /*!< \brief Clears the file's landmark list. */
+    inline void clearPoints() { m_metadata.insert(Metadata::Points, QList<QVariant>()); } /*!< \brief Clears the file's landmark list. */
     inline void setPoints(const QList<QPointF> &points) { clearPoints(); appendPoints(points); } /*!< \brief Overwrites the file's landmark list. */
 
     QList<QRectF> namedRects() const; /*!< \brief Returns rects convertible from metadata values. */
@@ -321,13 +411,13 @@ struct BR_EXPORT File
     void appendRect(const cv::Rect &rect); /*!< \brief Adds a rect to the file's rect list. */
     void appendRects(const QList<QRectF> &rects); /*!< \brief Adds rects to the file's rect list. */
     void appendRects(const QList<cv::Rect> &rects); /*!< \brief Adds rects to the file's rect list. */
-    inline void clearRects() { m_metadata["Rects"] = QList<QVariant>(); } /*!< \brief Clears the file's rect list. */
+    inline void clearRects() { m_metadata.insert(Metadata::Rects, QList<QVariant>()); } /*!< \brief Clears the file's rect list. */
     inline void setRects(const QList<QRectF> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
     inline void setRects(const QList<cv::Rect> &rects) { clearRects(); appendRects(rects); } /*!< \brief Overwrites the file's rect list. */
 
     bool fte;
 private:
-    QVariantMap m_metadata;
+    Metadata m_metadata;
     BR_EXPORT friend QDataStream &operator<<(QDataStream &stream, const File &file);
     BR_EXPORT friend QDataStream &operator>>(QDataStream &stream, File &file);
 
@@ -452,7 +542,7 @@ struct TemplateList : public QList<Template>
     TemplateList(const QList<File> &files) { foreach (const File &file, files) append(file); } /*!< \brief Initialize the template list from a file list. */
     BR_EXPORT static TemplateList fromGallery(const File &gallery); /*!< \brief Create a template list from a br::Gallery. */
 
-    /*!< \brief Create a template list from a memory buffer of individual templates. Compatible with '.gal' galleries. */
+    /*!< \brief Create a template list from a memory buffer of individual templates. Compatible with '.gal' and '.brt' galleries. */
     BR_EXPORT static TemplateList fromBuffer(const QByteArray &buffer);
 
     /*!< \brief Ensure labels are in the range [0,numClasses-1]. */
@@ -699,6 +789,13 @@ public:
     Q_PROPERTY(bool verbose READ get_verbose WRITE set_verbose RESET reset_verbose)
     BR_PROPERTY(bool, verbose, false)
 
+    /*!
+     * \brief If set, transform, stream stage and gallery timings are written to this file as a Chrome trace when the context is finalized.
+     * \see br::Profiler
+     */
+    Q_PROPERTY(QString profile READ get_profile WRITE set_profile RESET reset_profile)
+    BR_PROPERTY(QString, profile, "")
+
     /*!
      * \brief The most resent message sent to the terminal.
      */
@@ -754,6 +851,19 @@ public:
     Q_PROPERTY(int crossValidate READ get_crossValidate WRITE set_crossValidate RESET reset_crossValidate)
     BR_PROPERTY(int, crossValidate, 0)
 
+    /*!
+     * \brief Megabytes of intermediate templates br::PipeTransform keeps in memory while training, 0 (default) for no limit.
+     * Beyond it they are spilled to a scratch gallery under \em trainingScratch and read back memory mapped.
+     */
+    Q_PROPERTY(int trainingMemory READ get_trainingMemory WRITE set_trainingMemory RESET reset_trainingMemory)
+    BR_PROPERTY(int, trainingMemory, 0)
+
+    /*!
+     * \brief Directory for spilled training templates, the system temporary directory by default.
+     */
+    Q_PROPERTY(QString trainingScratch READ get_trainingScratch WRITE set_trainingScratch RESET reset_trainingScratch)
+    BR_PROPERTY(QString, trainingScratch, "")
+
     /*!
      * \brief List of paths sub-models will be searched for on
      */
@@ -1046,6 +1156,8 @@ public:
     virtual void initialize(const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Initializes class data members. */
     virtual void setBlock(int rowBlock, int columnBlock); /*!< \brief Set the current block. */
     virtual void setRelative(float value, int i, int j); /*!< \brief Set a score relative to the current block. */
+    virtual void setRow(const float *values, int count, int i, int j); /*!< \brief Set \em count consecutive scores of row \em i starting at column \em j, relative to the current block. */
+    void setRows(const cv::Mat &values, int i, int j); /*!< \brief Set a \c CV_32FC1 matrix of scores starting at row \em i and column \em j, relative to the current block. */
 
     static Output *make(const File &file, const FileList &targetFiles, const FileList &queryFiles); /*!< \brief Make an output from a file and gallery/probe file lists. */
 
@@ -1053,6 +1165,7 @@ private:
     QSharedPointer<Output> next;
     QPoint offset;
     virtual void set(float value, int i, int j) = 0;
+    virtual void setRange(const float *values, int count, int i, int j); /*!< \brief Defaults to calling set() for each value. */
 };
 
 /*!
@@ -1077,6 +1190,7 @@ protected:
 private:
     void initialize(const FileList &targetFiles, const FileList &queryFiles);
     void set(float value, int i, int j);
+    void setRange(const float *values, int count, int i, int j);
 };
 
 /*!
@@ -1381,11 +1495,23 @@ public:
     virtual float compare(const cv::Mat &a, const cv::Mat &b) const; /*!< \brief Compute the distance between two biometric signatures. */
     virtual float compare(const uchar *a, const uchar *b, size_t size) const; /*!< \brief Compute the distance between two buffers. */
 
+    /*!
+     * \brief Compute the distances between every pair of \em queryCount and \em targetCount packed buffers.
+     *
+     * Buffers are \em size bytes each and stored contiguously. Scores are written row-major to \em scores,
+     * one row of \em targetCount values per query. Returns \c false if the distance does not provide a batched
+     * implementation, in which case br::Distance::compare(const TemplateList&, const TemplateList&, Output*)
+     * falls back to comparing templates one pair at a time.
+     */
+    virtual bool compareBatch(const uchar *queries, const uchar *targets, int queryCount, int targetCount, size_t size, float *scores) const;
+
 protected:
     inline Distance *make(const QString &description) { return make(description, this); } /*!< \brief Make a subdistance. */
 
 private:
     virtual void compareBlock(const TemplateList &target, const TemplateList &query, Output *output, int targetOffset, int queryOffset) const;
+    bool compareTiled(const TemplateList &target, const TemplateList &query, Output *output) const;
+    void compareTiles(const cv::Mat &targets, const cv::Mat &queries, Output *output, int targetOffset, int queryOffset) const;
 
     friend struct AlgorithmCore;
     virtual bool compare(const File &targetGallery, const File &queryGallery, const File &output) const /*!< \brief Escape hatch for algorithms that need customized file I/O during comparison. */
@@ -23,6 +23,7 @@
 #include <openbr/core/common.h>
 #include <openbr/core/eigenutils.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -45,9 +46,108 @@ class EigenInitializer : public Initializer
 
 BR_REGISTER(Initializer, EigenInitializer)
 
+// Training templates as the columns of a data matrix, converted one block at a time
+class TemplateColumns : public EigenUtils::ColumnBlocks
+{
+    const TemplateList &templates;
+    const int dims;
+
+public:
+    TemplateColumns(const TemplateList &templates)
+        : templates(templates), dims(templates.first().m().rows * templates.first().m().cols) {}
+
+    int rows() const { return dims; }
+    int cols() const { return templates.size(); }
+
+    Eigen::MatrixXd block(int begin, int end) const
+    {
+        Eigen::MatrixXd data(dims, end - begin);
+        for (int i=begin; i<end; i++)
+            data.col(i-begin) = Eigen::Map<const Eigen::MatrixXf>(templates[i].m().ptr<float>(), dims, 1).cast<double>();
+        return data;
+    }
+};
+
+// Columns of a matrix already in memory
+class MatrixColumns : public EigenUtils::ColumnBlocks
+{
+    const Eigen::MatrixXf &data;
+
+public:
+    MatrixColumns(const Eigen::MatrixXf &data) : data(data) {}
+
+    int rows() const { return data.rows(); }
+    int cols() const { return data.cols(); }
+
+    Eigen::MatrixXd block(int begin, int end) const
+    {
+        return data.middleCols(begin, end - begin).cast<double>();
+    }
+};
+
+// Projects a block of templates stacked as columns, so the block is one matrix-matrix product
+class ProjectColumnsTask : public QRunnable
+{
+    const Eigen::MatrixXf &weights;
+    const bool transpose;
+    const Eigen::VectorXf &mean;
+    const float * const *inputs;
+    float * const *outputs;
+    const int count;
+
+public:
+    ProjectColumnsTask(const Eigen::MatrixXf &weights, bool transpose, const Eigen::VectorXf &mean, const float * const *inputs, float * const *outputs, int count)
+        : weights(weights), transpose(transpose), mean(mean), inputs(inputs), outputs(outputs), count(count) {}
+
+    void run()
+    {
+        Eigen::MatrixXf data(mean.rows(), count);
+        for (int i=0; i<count; i++)
+            data.col(i) = Eigen::Map<const Eigen::VectorXf>(inputs[i], mean.rows()) - mean;
+
+        Eigen::MatrixXf result;
+        if (transpose) result.noalias() = weights.transpose() * data;
+        else           result.noalias() = weights * data;
+
+        for (int i=0; i<count; i++)
+            Eigen::Map<Eigen::VectorXf>(outputs[i], result.rows()) = result.col(i);
+    }
+};
+
+// Batched counterpart of outMap = weights * (inMap - mean), or weights.transpose() * (inMap - mean) if transpose is set.
+// Returns false, leaving dst empty, unless every template is a continuous float matrix of mean.rows() elements.
+static bool projectColumns(const Eigen::MatrixXf &weights, bool transpose, const Eigen::VectorXf &mean, const TemplateList &src, TemplateList &dst)
+{
+    foreach (const Template &t, src)
+        if ((t.size() != 1) || (t.m().type() != CV_32FC1) || !t.m().isContinuous() || (int(t.m().total()) != mean.rows()))
+            return false;
+
+    const int dimsOut = transpose ? weights.cols() : weights.rows();
+    QVector<const float*> inputs(src.size());
+    QVector<float*> outputs(src.size());
+    dst.reserve(src.size());
+    for (int i=0; i<src.size(); i++) {
+        dst.append(Template(src[i].file, cv::Mat(1, dimsOut, CV_32FC1)));
+        inputs[i] = src[i].m().ptr<float>();
+        outputs[i] = dst[i].m().ptr<float>();
+    }
+
+    // Blocks small enough to stay in cache, large enough to amortize reading the weights
+    const int blockSize = 256;
+    Scheduler::Group tasks;
+    for (int i=0; i<src.size(); i+=blockSize)
+        tasks.start(new ProjectColumnsTask(weights, transpose, mean, inputs.data() + i, outputs.data() + i, std::min(blockSize, src.size() - i)));
+    tasks.wait();
+    return true;
+}
+
 /*!
  * \ingroup transforms
  * \brief Projects input into learned Principal Component Analysis subspace.
+ *
+ * With \em randomized, only the leading components are estimated, by randomized range finding with \em powerIterations passes over the data.
+ * It avoids forming the covariance matrix, so it scales to high dimensional inputs and many samples.
+ * At most \em rank components are estimated when \em keep is a fraction of the variance.
  * \author Brendan Klare \cite bklare
  * \author Josh Klontz \cite jklontz
  */
@@ -61,6 +161,9 @@ protected:
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
     Q_PROPERTY(int drop READ get_drop WRITE set_drop RESET reset_drop STORED false)
     Q_PROPERTY(bool whiten READ get_whiten WRITE set_whiten RESET reset_whiten STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
+    Q_PROPERTY(int rank READ get_rank WRITE set_rank RESET reset_rank STORED false)
+    Q_PROPERTY(int powerIterations READ get_powerIterations WRITE set_powerIterations RESET reset_powerIterations STORED false)
 
     /*!
      *     keep <  0: All eigenvalues are retained.
@@ -71,6 +174,9 @@ protected:
     BR_PROPERTY(float, keep, 0.95)
     BR_PROPERTY(int, drop, 0)
     BR_PROPERTY(bool, whiten, false)
+    BR_PROPERTY(bool, randomized, false)
+    BR_PROPERTY(int, rank, 256)
+    BR_PROPERTY(int, powerIterations, 2)
 
     Eigen::VectorXf mean, eVals;
     Eigen::MatrixXf eVecs;
@@ -78,7 +184,7 @@ protected:
     int originalRows;
 
 public:
-    PCATransform() : keep(0.95), drop(0), whiten(false) {}
+    PCATransform() : keep(0.95), drop(0), whiten(false), randomized(false), rank(256), powerIterations(2) {}
 
 private:
     double residualReconstructionError(const Template &src) const
@@ -98,9 +204,21 @@ private:
             qFatal("Requires single channel 32-bit floating point matrices.");
 
         originalRows = trainingSet.first().m().rows;
+        if (randomized && (keep != 0)) {
+            trainRandomized(TemplateColumns(trainingSet));
+            return;
+        }
+
         int dimsIn = trainingSet.first().m().rows * trainingSet.first().m().cols;
         const int instances = trainingSet.size();
 
+        // When training data may be spilled, the covariance is accumulated a block of templates at a time,
+        // so spilled templates are paged in rather than copied into one matrix
+        if ((Globals->trainingMemory > 0) && (keep != 0) && (dimsIn <= instances)) {
+            trainCovariance(TemplateColumns(trainingSet));
+            return;
+        }
+
         // Map into 64-bit Eigen matrix
         Eigen::MatrixXd data(dimsIn, instances);
         for (int i=0; i<instances; i++)
@@ -121,6 +239,13 @@ private:
         outMap = eVecs.transpose() * (inMap - mean);
     }
 
+    // Stacks the templates, so a list is projected by matrix-matrix products instead of one matrix-vector product per template
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectColumns(eVecs, true, mean, src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << keep << drop << whiten << originalRows << mean << eVals << eVecs;
@@ -162,11 +287,47 @@ protected:
             allEVals = Eigen::VectorXd::Ones(dimsIn);
         }
 
+        keepComponents(allEVals, allEVecs, allEVals.sum());
+    }
+
+    void trainCovariance(const EigenUtils::ColumnBlocks &data)
+    {
+        Eigen::VectorXd meanD;
+        Eigen::MatrixXd cov;
+        EigenUtils::covariance(data, meanD, cov);
+        mean = meanD.cast<float>();
+
+        // Compute eigendecomposition. Returns eigenvectors/eigenvalues in increasing order by eigenvalue.
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eSolver(cov);
+        keepComponents(eSolver.eigenvalues(), eSolver.eigenvectors(), eSolver.eigenvalues().sum());
+    }
+
+    void trainRandomized(const EigenUtils::ColumnBlocks &data)
+    {
+        const int components = (keep >= 1) ? int(keep) + drop : rank;
+
+        Eigen::VectorXd meanD, allEVals;
+        Eigen::MatrixXd allEVecs;
+        double totalVariance;
+        EigenUtils::randomizedPCA(data, components, powerIterations, meanD, allEVals, allEVecs, totalVariance);
+        mean = meanD.cast<float>();
+
+        // keepComponents() expects increasing order, like Eigen::SelfAdjointEigenSolver
+        allEVals.reverseInPlace();
+        allEVecs = allEVecs.rowwise().reverse().eval();
+        if ((keep > 0) && (keep < 1) && (allEVals.sum() < keep * totalVariance))
+            qWarning("The leading %d components retain less than the requested variance, increase rank.", int(allEVals.rows()));
+        keepComponents(allEVals, allEVecs, totalVariance);
+    }
+
+    // Select eigenvectors, given in increasing order by eigenvalue, according to keep and drop
+    void keepComponents(const Eigen::MatrixXd &allEVals, const Eigen::MatrixXd &allEVecs, double totalEnergy)
+    {
+        const int dimsIn = allEVecs.rows();
         if (keep <= 0) {
-            keep = dimsIn - drop;
+            keep = std::min(dimsIn, int(allEVals.rows())) - drop;
         } else if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const double totalEnergy = allEVals.sum();
             if (totalEnergy == 0) {
                 keep = 0;
             } else {
@@ -264,6 +425,12 @@ class RowWisePCATransform : public PCATransform
             outMap = eVecs.transpose() * (inMap - mean);
         }
     }
+
+    // Each row is projected separately
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        Transform::project(src, dst);
+    }
 };
 
 BR_REGISTER(Transform, RowWisePCATransform)
@@ -325,6 +492,7 @@ class LDATransform : public Transform
     Q_OBJECT
     Q_PROPERTY(float pcaKeep READ get_pcaKeep WRITE set_pcaKeep RESET reset_pcaKeep STORED false)
     Q_PROPERTY(bool pcaWhiten READ get_pcaWhiten WRITE set_pcaWhiten RESET reset_pcaWhiten STORED false)
+    Q_PROPERTY(bool pcaRandomized READ get_pcaRandomized WRITE set_pcaRandomized RESET reset_pcaRandomized STORED false)
     Q_PROPERTY(int directLDA READ get_directLDA WRITE set_directLDA RESET reset_directLDA STORED false)
     Q_PROPERTY(float directDrop READ get_directDrop WRITE set_directDrop RESET reset_directDrop STORED false)
     Q_PROPERTY(QString inputVariable READ get_inputVariable WRITE set_inputVariable RESET reset_inputVariable STORED false)
@@ -332,6 +500,7 @@ class LDATransform : public Transform
     Q_PROPERTY(bool normalize READ get_normalize WRITE set_normalize RESET reset_normalize STORED false)
     BR_PROPERTY(float, pcaKeep, 0.98)
     BR_PROPERTY(bool, pcaWhiten, false)
+    BR_PROPERTY(bool, pcaRandomized, false)
     BR_PROPERTY(int, directLDA, 0)
     BR_PROPERTY(float, directDrop, 0.1)
     BR_PROPERTY(QString, inputVariable, "Label")
@@ -353,6 +522,7 @@ class LDATransform : public Transform
         PCATransform pca;
         pca.keep = pcaKeep;
         pca.whiten = pcaWhiten;
+        pca.randomized = pcaRandomized;
         pca.train(trainingSet);
         mean = pca.mean;
 
@@ -529,6 +699,18 @@ class LDATransform : public Transform
             dst.m().at<float>(0,0) = dst.m().at<float>(0,0) / stdDev;
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectColumns(projection, true, mean, src, dst)) {
+            Transform::project(src, dst);
+            return;
+        }
+
+        if (normalize && isBinary)
+            for (int i=0; i<dst.size(); i++)
+                dst[i].m().at<float>(0,0) = dst[i].m().at<float>(0,0) / stdDev;
+    }
+
     void store(QDataStream &stream) const
     {
         stream << pcaKeep;
@@ -662,6 +844,7 @@ using namespace cv;
  * \brief Projects input into a within-class minimizing subspace.
  *
  * Like LDA but without the explicit between-class consideration.
+ * With \em randomized, the initial PCA is estimated as in PCATransform, with at most \em rank components and \em powerIterations passes over the data.
  *
  * \par Compression
  * Projection matricies can become quite large, resulting in proportionally large model files.
@@ -675,7 +858,13 @@ class WCDATransform : public Transform
 {
     Q_OBJECT
     Q_PROPERTY(float keep READ get_keep WRITE set_keep RESET reset_keep STORED false)
+    Q_PROPERTY(bool randomized READ get_randomized WRITE set_randomized RESET reset_randomized STORED false)
+    Q_PROPERTY(int rank READ get_rank WRITE set_rank RESET reset_rank STORED false)
+    Q_PROPERTY(int powerIterations READ get_powerIterations WRITE set_powerIterations RESET reset_powerIterations STORED false)
     BR_PROPERTY(float, keep, 0.98)
+    BR_PROPERTY(bool, randomized, false)
+    BR_PROPERTY(int, rank, 256)
+    BR_PROPERTY(int, powerIterations, 2)
 
     VectorXf mean;
     MatrixXf projection;
@@ -722,7 +911,8 @@ class WCDATransform : public Transform
         // Perform PCA dimensionality reduction
         VectorXf pcaEvals;
         MatrixXf pcaEvecs;
-        trainCore(data, keep, mean, pcaEvals, pcaEvecs);
+        if (randomized) trainRandomized(data, keep, rank, powerIterations, mean, pcaEvals, pcaEvecs);
+        else            trainCore(data, keep, mean, pcaEvals, pcaEvecs);
         data = pcaEvecs.transpose() * (data.colwise() - mean);
 
         // Get ground truth
@@ -776,9 +966,29 @@ class WCDATransform : public Transform
         if (dominantEigenEstimation)
             allEVecs = data * allEVecs;
 
+        keepComponents(allEVals, allEVecs, allEVals.sum(), keep, eVals, eVecs);
+    }
+
+    static void trainRandomized(const MatrixXf &data, float keep, int rank, int powerIterations, VectorXf &mean, VectorXf &eVals, MatrixXf &eVecs)
+    {
+        VectorXd meanD, allEValsD;
+        MatrixXd allEVecsD;
+        double totalVariance;
+        EigenUtils::randomizedPCA(MatrixColumns(data), (keep >= 1) ? int(keep) : rank, powerIterations, meanD, allEValsD, allEVecsD, totalVariance);
+        mean = meanD.cast<float>();
+
+        // Increasing order, like SelfAdjointEigenSolver
+        const VectorXf allEVals = allEValsD.reverse().cast<float>();
+        const MatrixXf allEVecs = allEVecsD.rowwise().reverse().cast<float>();
+        keepComponents(allEVals, allEVecs, totalVariance, keep, eVals, eVecs);
+    }
+
+    // Select eigenvectors, given in increasing order by eigenvalue
+    static void keepComponents(const VectorXf &allEVals, const MatrixXf &allEVecs, float totalEnergy, float keep, VectorXf &eVals, MatrixXf &eVecs)
+    {
         if (keep < 1) {
             // Keep eigenvectors that retain a certain energy percentage.
-            const float desiredEnergy = keep * allEVals.sum();
+            const float desiredEnergy = keep * totalEnergy;
             float currentEnergy = 0;
             int i = 0;
             while ((currentEnergy < desiredEnergy) && (i < allEVals.rows())) {
@@ -811,6 +1021,12 @@ class WCDATransform : public Transform
         outMap = projection * (inMap - mean);
     }
 
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (!projectColumns(projection, false, mean, src, dst))
+            Transform::project(src, dst);
+    }
+
     void store(QDataStream &stream) const
     {
         stream << mean << compressed << a << b;
@@ -0,0 +1,280 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
+#include <openbr/core/kmeans.h>
+#include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
+
+using namespace cv;
+
+namespace br
+{
+
+typedef QPair<float, int> Neighbor;
+
+static Mat vectorize(const Mat &m)
+{
+    Mat vector;
+    (m.isContinuous() ? m : m.clone()).reshape(1, 1).convertTo(vector, CV_32F);
+    return vector;
+}
+
+/*!
+ * \ingroup transforms
+ * \brief Approximate nearest neighbors in a fixed gallery, using an inverted file over product quantized residuals \cite jegou11.
+ *
+ * Each gallery template is assigned to the nearest of \em lists k-means centers, \c sqrt(n) if \em lists is 0.
+ * Its residual from that center is encoded by \em subspaces quantizers of 256 centers each.
+ * A probe visits the lists of its \em probes nearest centers and ranks their members by the L2 distance to their codes.
+ * The \em candidates best are then re-scored with \em distance.
+ * dst is a 1 by \em k vector of the best scores in descending order.
+ * The matching gallery file names are set in \em outputVariable.
+ *
+ * Templates are indexed as flattened \c float vectors, so their L2 distance should order neighbors like \em distance does.
+ * The quantizers are trained on at most \em trainingSize evenly spaced templates, by mini-batch k-means if \em batchSize is positive.
+ * \see GalleryCompareTransform KNNTransform for exhaustive search
+ * \see KMeansTransform
+ * \author Josh Klontz \cite jklontz
+ */
+class ANNIndexTransform : public Transform
+{
+    Q_OBJECT
+    Q_PROPERTY(br::Distance *distance READ get_distance WRITE set_distance RESET reset_distance STORED true)
+    Q_PROPERTY(QString galleryName READ get_galleryName WRITE set_galleryName RESET reset_galleryName STORED false)
+    Q_PROPERTY(int lists READ get_lists WRITE set_lists RESET reset_lists STORED false)
+    Q_PROPERTY(int subspaces READ get_subspaces WRITE set_subspaces RESET reset_subspaces STORED false)
+    Q_PROPERTY(int probes READ get_probes WRITE set_probes RESET reset_probes STORED false)
+    Q_PROPERTY(int candidates READ get_candidates WRITE set_candidates RESET reset_candidates STORED false)
+    Q_PROPERTY(int k READ get_k WRITE set_k RESET reset_k STORED false)
+    Q_PROPERTY(int trainingSize READ get_trainingSize WRITE set_trainingSize RESET reset_trainingSize STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
+    Q_PROPERTY(QString outputVariable READ get_outputVariable WRITE set_outputVariable RESET reset_outputVariable STORED false)
+    BR_PROPERTY(br::Distance*, distance, NULL)
+    BR_PROPERTY(QString, galleryName, "")
+    BR_PROPERTY(int, lists, 0)
+    BR_PROPERTY(int, subspaces, 8)
+    BR_PROPERTY(int, probes, 8)
+    BR_PROPERTY(int, candidates, 100)
+    BR_PROPERTY(int, k, 10)
+    BR_PROPERTY(int, trainingSize, 65536)
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
+    BR_PROPERTY(QString, outputVariable, "Neighbors")
+
+    TemplateList gallery;
+    QString indexedGallery; // The galleryName the index was built from, so init() doesn't rebuild it
+    KMeans coarse;
+    QList<KMeans> codebooks; // One per subspace
+    QVector< QVector<int> > members; // Gallery indices in each list
+    QList<Mat> codes; // One per list, the subspace codes of its members interleaved for pq_scan()
+
+    Range subspace(int i, int dims) const
+    {
+        return Range(dims * i / codebooks.size(), dims * (i+1) / codebooks.size());
+    }
+
+    // Assigns rows to lists and encodes their residuals, a block at a time
+    class EncodeTask : public QRunnable
+    {
+        const ANNIndexTransform *index;
+        int begin, end;
+        int *assignments;
+        Mat *encoded;
+
+    public:
+        EncodeTask(const ANNIndexTransform *index, int begin, int end, int *assignments, Mat *encoded)
+            : index(index), begin(begin), end(end), assignments(assignments), encoded(encoded) {}
+
+        void run()
+        {
+            QList<Mat> rows;
+            for (int i=begin; i<end; i++)
+                rows.append(vectorize(index->gallery[i]));
+            Mat residuals = OpenCVUtils::toMatByRow(rows);
+
+            Mat lists;
+            index->coarse.nearest(residuals, 1, lists);
+            for (int i=0; i<residuals.rows; i++) {
+                assignments[begin+i] = lists.at<int>(i, 0);
+                Mat residual = residuals.row(i);
+                residual -= index->coarse.centers().row(assignments[begin+i]);
+            }
+
+            for (int j=0; j<index->codebooks.size(); j++) {
+                Mat subspaceCodes;
+                index->codebooks[j].nearest(residuals.colRange(index->subspace(j, residuals.cols)), 1, subspaceCodes);
+                for (int i=0; i<residuals.rows; i++)
+                    encoded->at<uchar>(begin+i, j) = uchar(subspaceCodes.at<int>(i, 0));
+            }
+        }
+    };
+
+    void build()
+    {
+        coarse = KMeans();
+        codebooks.clear();
+        members.clear();
+        codes.clear();
+        const int n = gallery.size();
+        if (n == 0)
+            return;
+
+        QList<Mat> sample;
+        const int samples = std::min(n, trainingSize);
+        for (int i=0; i<samples; i++)
+            sample.append(vectorize(gallery[int(qint64(i) * n / samples)]));
+        const Mat data = OpenCVUtils::toMatByRow(sample);
+
+        const int listCount = std::min(samples, lists > 0 ? lists : std::max(1, int(sqrt(double(n)))));
+        coarse.train(sample, listCount, batchSize, iterations);
+
+        Mat labels;
+        coarse.parallelNearest(data, 1, labels);
+        Mat residuals = data.clone();
+        for (int i=0; i<residuals.rows; i++) {
+            Mat residual = residuals.row(i);
+            residual -= coarse.centers().row(labels.at<int>(i, 0));
+        }
+
+        const int subspaceCount = std::min(subspaces, data.cols);
+        for (int i=0; i<subspaceCount; i++)
+            codebooks.append(KMeans());
+        for (int i=0; i<subspaceCount; i++)
+            codebooks[i].train(QList<Mat>() << residuals.colRange(subspace(i, data.cols)).clone(), std::min(256, samples), batchSize, iterations);
+
+        QVector<int> assignments(n);
+        Mat encoded(n, subspaceCount, CV_8UC1);
+        const int blockSize = 1024;
+        Scheduler::Group tasks;
+        for (int i=0; i<n; i+=blockSize)
+            tasks.start(new EncodeTask(this, i, std::min(n, i+blockSize), assignments.data(), &encoded));
+        tasks.wait();
+
+        members.resize(coarse.centers().rows);
+        for (int i=0; i<n; i++)
+            members[assignments[i]].append(i);
+        for (int i=0; i<members.size(); i++) {
+            Mat listCodes(members[i].size(), subspaceCount, CV_8UC1);
+            for (int j=0; j<members[i].size(); j++)
+                encoded.row(members[i][j]).copyTo(listCodes.row(j));
+            codes.append(Mat(1, (members[i].size() + 15) / 16 * 16 * subspaceCount, CV_8UC1));
+            pq_interleave(listCodes.data, listCodes.rows, subspaceCount, subspaceCount, codes.last().data);
+        }
+
+        qDebug("ANNIndex: %d templates in %d lists with %d subspaces.", n, members.size(), subspaceCount);
+    }
+
+    void train(const TemplateList &data)
+    {
+        distance->train(data);
+        gallery = data;
+        build();
+        indexedGallery = galleryName;
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        dst = src;
+        if (gallery.isEmpty())
+            return;
+
+        const Mat query = vectorize(src);
+        Mat nearestLists;
+        coarse.nearest(query, probes, nearestLists);
+
+        // Nearest codes in a max-heap
+        std::vector<Neighbor> heap;
+        heap.reserve(candidates);
+        Mat table(codebooks.size(), 256, CV_32FC1, Scalar(0));
+        QVector<float> distances;
+        for (int p=0; p<nearestLists.cols; p++) {
+            const int list = nearestLists.at<int>(0, p);
+            const int count = members[list].size();
+            if (count == 0)
+                continue;
+
+            // Distances from the query's residual to every center of each subspace, so a code is scored by table lookups
+            const Mat residual = query - coarse.centers().row(list);
+            for (int i=0; i<codebooks.size(); i++) {
+                const Mat part = residual.colRange(subspace(i, residual.cols));
+                const Mat &centers = codebooks[i].centers();
+                float *row = table.ptr<float>(i);
+                for (int j=0; j<centers.rows; j++)
+                    row[j] = norm(part, centers.row(j), NORM_L2SQR);
+            }
+
+            distances.resize((count + 15) / 16 * 16);
+            pq_scan(codes[list].data, distances.size(), codebooks.size(), table.ptr<float>(), distances.data());
+
+            for (int i=0; i<count; i++) {
+                const Neighbor neighbor(distances[i], members[list][i]);
+                if (int(heap.size()) < candidates) {
+                    heap.push_back(neighbor);
+                    std::push_heap(heap.begin(), heap.end());
+                } else if (neighbor < heap.front()) {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = neighbor;
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+        }
+
+        QList<Neighbor> scores;
+        foreach (const Neighbor &candidate, heap)
+            scores.append(Neighbor(distance->compare(gallery[candidate.second], src), candidate.second));
+        std::sort(scores.begin(), scores.end(), std::greater<Neighbor>());
+
+        const int count = std::min(k, scores.size());
+        Mat result(1, count, CV_32FC1);
+        QStringList names;
+        for (int i=0; i<count; i++) {
+            result.at<float>(0, i) = scores[i].first;
+            names.append(gallery[scores[i].second].file.name);
+        }
+        dst.m() = result;
+        dst.file.set(outputVariable, names);
+    }
+
+    void init()
+    {
+        if (galleryName.isEmpty() || (galleryName == indexedGallery))
+            return;
+        gallery = TemplateList::fromGallery(galleryName);
+        build();
+        indexedGallery = galleryName;
+    }
+
+    void store(QDataStream &stream) const
+    {
+        br::Object::store(stream);
+        stream << gallery << coarse << codebooks << members << codes;
+    }
+
+    void load(QDataStream &stream)
+    {
+        br::Object::load(stream);
+        stream >> gallery >> coarse >> codebooks >> members >> codes;
+    }
+};
+
+BR_REGISTER(Transform, ANNIndexTransform)
+
+} // namespace br
+
+#include "cluster/annindex.moc"
@@ -39,7 +39,7 @@ class CollectNNTransform : public UntrainableMetaTransform
         Neighbors neighbors;
         for (int i=0; i < src.m().cols;i++) {
             // skip self compares
-            if (i == src.file.get<int>("FrameNumber"))
+            if (i == src.file.get<int>(Metadata::FrameNumber))
                 continue;
             neighbors.append(Neighbor(i, src.m().at<float>(0,i)));
         }
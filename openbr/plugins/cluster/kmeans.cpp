@@ -14,10 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <opencv2/flann/flann.hpp>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/kmeans.h>
 
 using namespace cv;
 
@@ -26,7 +25,11 @@ namespace br
 
 /*!
  * \ingroup transforms
- * \brief Wraps OpenCV kmeans and flann.
+ * \brief Wraps OpenCV kmeans, projecting to the indices of the \em kSearch nearest centers.
+ *
+ * If \em batchSize is positive, training uses mini-batch k-means instead.
+ * It runs \em iterations updates, each with \em batchSize rows drawn at random,
+ * so many centers can be trained on many descriptors without copying them into one matrix.
  * \author Josh Klontz \cite jklontz
  */
 class KMeansTransform : public Transform
@@ -34,43 +37,51 @@ class KMeansTransform : public Transform
     Q_OBJECT
     Q_PROPERTY(int kTrain READ get_kTrain WRITE set_kTrain RESET reset_kTrain STORED false)
     Q_PROPERTY(int kSearch READ get_kSearch WRITE set_kSearch RESET reset_kSearch STORED false)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize STORED false)
+    Q_PROPERTY(int iterations READ get_iterations WRITE set_iterations RESET reset_iterations STORED false)
     BR_PROPERTY(int, kTrain, 256)
     BR_PROPERTY(int, kSearch, 1)
+    BR_PROPERTY(int, batchSize, 0)
+    BR_PROPERTY(int, iterations, 100)
 
-    Mat centers;
-    mutable QScopedPointer<flann::Index> index;
-    mutable QMutex mutex;
-
-    void reindex()
-    {
-        index.reset(new flann::Index(centers, flann::LinearIndexParams()));
-    }
+    KMeans kmeans;
 
     void train(const TemplateList &data)
     {
-        Mat bestLabels;
-        const double compactness = kmeans(OpenCVUtils::toMatByRow(data.data()), kTrain, bestLabels, TermCriteria(TermCriteria::MAX_ITER, 10, 0), 3, KMEANS_PP_CENTERS, centers);
-        qDebug("KMeans compactness = %f", compactness);
-        reindex();
+        kmeans.train(data.data(), kTrain, batchSize, iterations);
     }
 
     void project(const Template &src, Template &dst) const
     {
-        QMutexLocker locker(&mutex);
-        Mat dists, indicies;
-        index->knnSearch(src, indicies, dists, kSearch);
+        Mat indicies;
+        kmeans.nearest(src, kSearch, indicies);
         dst = indicies.reshape(1, 1);
     }
 
+    // Assigns the rows of all templates at once
+    void project(const TemplateList &src, TemplateList &dst) const
+    {
+        if (src.isEmpty())
+            return;
+
+        Mat indicies;
+        kmeans.parallelNearest(OpenCVUtils::toMatByRow(src.data()), kSearch, indicies);
+
+        int row = 0;
+        foreach (const Template &t, src) {
+            dst.append(Template(t.file, indicies.rowRange(row, row + t.m().rows).clone().reshape(1, 1)));
+            row += t.m().rows;
+        }
+    }
+
     void load(QDataStream &stream)
     {
-        stream >> centers;
-        reindex();
+        stream >> kmeans;
     }
 
     void store(QDataStream &stream) const
     {
-        stream << centers;
+        stream << kmeans;
     }
 };
 
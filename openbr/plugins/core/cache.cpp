@@ -14,56 +14,293 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QLockFile>
 #include <openbr/plugins/openbr_internal.h>
 
 namespace br
 {
 
+struct CacheKey
+{
+    quint64 high, low;
+};
+
+inline bool operator==(const CacheKey &a, const CacheKey &b)
+{
+    return (a.high == b.high) && (a.low == b.low);
+}
+
+inline uint qHash(const CacheKey &key)
+{
+    return uint(key.low);
+}
+
+/*!
+ * \brief On-disk store of serialized templates, shared by every CacheTransform and process using the same directory.
+ *
+ * Keys are spread over shards, each with its own lock, index file and append-only segment files.
+ * Segments are preallocated and memory-mapped, so a lookup is a hash lookup and a read from the map.
+ * Recently used templates are also kept deserialized, within a memory budget.
+ *
+ * Appends hold a per-shard lock file, so several processes can share a directory,
+ * and each picks up the records of the others from the index when it misses.
+ * A record's index entry is written after its data, so an interrupted process loses at most the record it was writing.
+ */
+class TemplateStore
+{
+    static const int Shards = 16;
+    static const qint64 SegmentSize = qint64(256) << 20;
+
+    struct Location
+    {
+        qint32 segment, size;
+        qint64 offset;
+    };
+
+    struct Record // As stored in the index files
+    {
+        CacheKey key;
+        Location location;
+    };
+
+    struct Shard
+    {
+        QMutex lock;
+        QFile indexFile;
+        qint64 indexRead; // Bytes of the index file already loaded
+        QHash<CacheKey, Location> index;
+        QList< QSharedPointer<QFile> > segments;
+        QList<const uchar*> maps;
+        int lastSegment; // Where records are appended
+        qint64 end; // End of the data in the last segment
+        QCache<CacheKey, Template> memory; // Cost in KB
+    };
+
+    QString path;
+    Shard shards[Shards];
+
+    Shard &shardFor(const CacheKey &key)
+    {
+        return shards[key.high % Shards];
+    }
+
+    QString fileName(int shard, const QString &suffix) const
+    {
+        return path + "/" + QString::number(shard, 16).rightJustified(2, '0') + suffix;
+    }
+
+    // Open and map segments up to and including the given one
+    const uchar *segmentData(Shard &shard, int segment, qint64 capacity = 0)
+    {
+        const int shardIndex = &shard - shards;
+        while (shard.segments.size() <= segment) {
+            QSharedPointer<QFile> file(new QFile(fileName(shardIndex, "-" + QString::number(shard.segments.size()) + ".seg")));
+            if (!file->open(QFile::ReadWrite))
+                qFatal("Unable to open %s for writing.", qPrintable(file->fileName()));
+            if (file->size() < capacity)
+                file->resize(capacity);
+            const uchar *data = file->map(0, file->size());
+            if (!data) qFatal("Unable to map %s.", qPrintable(file->fileName()));
+            shard.segments.append(file);
+            shard.maps.append(data);
+        }
+        return shard.maps[segment];
+    }
+
+    // Load index records written since the last refresh, by this process or others
+    void refresh(Shard &shard)
+    {
+        const qint64 available = shard.indexFile.size() / sizeof(Record) * sizeof(Record);
+        if (available <= shard.indexRead) return;
+
+        shard.indexFile.seek(shard.indexRead);
+        const QByteArray data = shard.indexFile.read(available - shard.indexRead);
+        const Record *records = (const Record*) data.constData();
+        for (int i=0; i<data.size()/int(sizeof(Record)); i++) {
+            const Location &location = records[i].location;
+            shard.index.insert(records[i].key, location);
+            if (location.segment > shard.lastSegment) {
+                shard.lastSegment = location.segment;
+                shard.end = 0;
+            }
+            if (location.segment == shard.lastSegment)
+                shard.end = std::max(shard.end, location.offset + location.size);
+        }
+        shard.indexRead += data.size() / sizeof(Record) * sizeof(Record);
+    }
+
+    static int cost(const Template &t)
+    {
+        return std::max(1, int(t.bytes() / 1024));
+    }
+
+public:
+    TemplateStore(const QString &path, int memory)
+        : path(path)
+    {
+        if (QFileInfo(path).isFile())
+            qFatal("%s is a cache file from an earlier version, remove it or choose another Cache path.", qPrintable(path));
+        QDir().mkpath(path);
+
+        for (int i=0; i<Shards; i++) {
+            Shard &shard = shards[i];
+            shard.indexFile.setFileName(fileName(i, ".idx"));
+            if (!shard.indexFile.open(QFile::ReadWrite))
+                qFatal("Unable to open %s for writing.", qPrintable(shard.indexFile.fileName()));
+            shard.indexRead = 0;
+            shard.lastSegment = -1;
+            shard.end = 0;
+            shard.memory.setMaxCost(std::max(1, int(qint64(memory) * 1024 / Shards)));
+            refresh(shard);
+        }
+    }
+
+    bool lookup(const CacheKey &key, Template &dst)
+    {
+        Shard &shard = shardFor(key);
+        const char *data;
+        int size;
+        {
+            QMutexLocker locker(&shard.lock);
+            const Template *cached = shard.memory.object(key);
+            if (cached) {
+                dst = *cached;
+                return true;
+            }
+
+            QHash<CacheKey, Location>::const_iterator it = shard.index.constFind(key);
+            if (it == shard.index.constEnd()) {
+                refresh(shard);
+                it = shard.index.constFind(key);
+                if (it == shard.index.constEnd())
+                    return false;
+            }
+            data = (const char*) segmentData(shard, it->segment) + it->offset;
+            size = it->size;
+        }
+
+        // Segments stay mapped, so deserialize without holding the lock
+        QDataStream stream(QByteArray::fromRawData(data, size));
+        stream >> dst;
+
+        QMutexLocker locker(&shard.lock);
+        shard.memory.insert(key, new Template(dst), cost(dst));
+        return true;
+    }
+
+    void insert(const CacheKey &key, const Template &t)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QFile::WriteOnly);
+        stream << t;
+
+        Shard &shard = shardFor(key);
+        QMutexLocker locker(&shard.lock);
+        QLockFile lockFile(fileName(&shard - shards, ".lock"));
+        if (!lockFile.lock())
+            qFatal("Unable to lock %s.", qPrintable(lockFile.fileName()));
+
+        refresh(shard);
+        if (!shard.index.contains(key)) {
+            // Start a new segment if the record doesn't fit in the current one
+            if (shard.lastSegment != -1)
+                segmentData(shard, shard.lastSegment);
+            if ((shard.lastSegment == -1) || (shard.end + data.size() > shard.segments[shard.lastSegment]->size())) {
+                shard.lastSegment++;
+                shard.end = 0;
+            }
+            segmentData(shard, shard.lastSegment, std::max(qint64(SegmentSize), qint64(data.size())));
+
+            Record record;
+            record.key = key;
+            record.location.segment = shard.lastSegment;
+            record.location.size = data.size();
+            record.location.offset = shard.end;
+
+            QFile &segment = *shard.segments[shard.lastSegment];
+            segment.seek(shard.end);
+            segment.write(data);
+            segment.flush();
+
+            shard.indexFile.seek(shard.indexRead);
+            shard.indexFile.write((const char*) &record, sizeof(Record));
+            shard.indexFile.flush();
+
+            shard.indexRead += sizeof(Record);
+            shard.index.insert(key, record.location);
+            shard.end += data.size();
+        }
+
+        shard.memory.insert(key, new Template(t), cost(t));
+    }
+};
+
+/*!
+ * \brief Stores opened by CacheTransform, released when the context is finalized.
+ */
+class TemplateStores : public Initializer
+{
+    Q_OBJECT
+
+    static QMutex lock;
+    static QHash<QString, QSharedPointer<TemplateStore> > stores;
+
+    void initialize() const {}
+
+    void finalize() const
+    {
+        QMutexLocker locker(&lock);
+        stores.clear();
+    }
+
+public:
+    static QSharedPointer<TemplateStore> open(const QString &path, int memory)
+    {
+        const QString key = QFileInfo(path).absoluteFilePath();
+        QMutexLocker locker(&lock);
+        if (!stores.contains(key))
+            stores.insert(key, QSharedPointer<TemplateStore>(new TemplateStore(key, memory)));
+        return stores[key];
+    }
+};
+
+QMutex TemplateStores::lock;
+QHash<QString, QSharedPointer<TemplateStore> > TemplateStores::stores;
+
+BR_REGISTER(Initializer, TemplateStores)
+
 /*!
  * \ingroup transforms
  * \brief Caches br::Transform::project() results.
+ *
+ * Results are keyed by the transform description and the input file name, size and modification time,
+ * and are kept in a store on disk under \em path that persists across runs and can be shared by concurrent processes.
+ * Up to \em memory megabytes of recently used results are also kept deserialized.
  * \author Josh Klontz \cite jklontz
  */
 class CacheTransform : public MetaTransform
 {
     Q_OBJECT
     Q_PROPERTY(br::Transform* transform READ get_transform WRITE set_transform RESET reset_transform)
+    Q_PROPERTY(QString path READ get_path WRITE set_path RESET reset_path STORED false)
+    Q_PROPERTY(int memory READ get_memory WRITE set_memory RESET reset_memory STORED false)
     BR_PROPERTY(br::Transform*, transform, NULL)
+    BR_PROPERTY(QString, path, "Cache")
+    BR_PROPERTY(int, memory, 256)
 
-    static QHash<QString, Template> cache;
-    static QMutex cacheLock;
-
-public:
-    ~CacheTransform()
-    {
-        if (cache.isEmpty()) return;
-
-        // Write to cache
-        QFile file("Cache");
-        if (!file.open(QFile::WriteOnly))
-            qFatal("Unable to open %s for writing.", qPrintable(file.fileName()));
-        QDataStream stream(&file);
-        stream << cache;
-        file.close();
-    }
+    QSharedPointer<TemplateStore> store;
+    QByteArray description;
 
-private:
     void init()
     {
         if (!transform) return;
 
         trainable = transform->trainable;
-        if (!cache.isEmpty()) return;
-
-        // Read from cache
-        QFile file("Cache");
-        if (file.exists()) {
-            if (!file.open(QFile::ReadOnly))
-                qFatal("Unable to open %s for reading.", qPrintable(file.fileName()));
-            QDataStream stream(&file);
-            stream >> cache;
-            file.close();
-        }
+        description = transform->description().toUtf8();
+        store = TemplateStores::open(path, memory);
     }
 
     void train(const QList<TemplateList> &data)
@@ -71,23 +308,31 @@ private:
         transform->train(data);
     }
 
+    CacheKey key(const File &file) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(description);
+        hash.addData(file.name.toUtf8());
+        const QFileInfo info(file.resolved());
+        if (info.isFile())
+            hash.addData(QByteArray::number(info.size()) + " " + QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+
+        const QByteArray result = hash.result();
+        CacheKey key;
+        memcpy(&key, result.constData(), sizeof(CacheKey));
+        return key;
+    }
+
     void project(const Template &src, Template &dst) const
     {
-        const QString &file = src.file;
-        if (cache.contains(file)) {
-            dst = cache[file];
-        } else {
-            transform->project(src, dst);
-            cacheLock.lock();
-            cache[file] = dst;
-            cacheLock.unlock();
-        }
+        const CacheKey key = this->key(src.file);
+        if (store->lookup(key, dst))
+            return;
+        transform->project(src, dst);
+        store->insert(key, dst);
     }
 };
 
-QHash<QString, Template> CacheTransform::cache;
-QMutex CacheTransform::cacheLock;
-
 BR_REGISTER(Transform, CacheTransform)
 
 } // namespace br
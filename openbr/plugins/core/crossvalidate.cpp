@@ -14,10 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -66,7 +65,7 @@ class CrossValidateTransform : public MetaTransform
             return;
         }
 
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<numPartitions; i++) {
             QList<int> partitionsBuffer = partitions;
             TemplateList partitionedData = data;
@@ -108,9 +107,9 @@ class CrossValidateTransform : public MetaTransform
                 } else j--;
             }
             // Train on the remaining templates
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], partitionedData));
+            tasks.start(newTask(_train, transforms[i], partitionedData));
         }
-        futures.waitForFinished();
+        tasks.wait();
     }
 
     void project(const Template &src, Template &dst) const
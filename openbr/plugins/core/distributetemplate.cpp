@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -93,29 +92,20 @@ public:
         QList<TemplateList> input_buffer;
         input_buffer.reserve(src.size());
 
-        QFutureSynchronizer<void> futures;
-
         for (int i =0; i < src.size();i++) {
             input_buffer.append(TemplateList());
             output_buffer.append(TemplateList());
         }
-        QList<QFuture<void> > temp;
-        temp.reserve(src.size());
+
+        // The waiting thread runs queued templates rather than blocking
+        Scheduler::Group tasks;
         for (int i=0; i<src.size(); i++) {
             input_buffer[i].append(src[i]);
 
-            if (Globals->parallelism > 1) temp.append(QtConcurrent::run(_projectList, transform, &input_buffer[i], &output_buffer[i]));
+            if (Globals->parallelism > 1) tasks.start(newTask(_projectList, transform, &input_buffer[i], &output_buffer[i]));
             else _projectList(transform, &input_buffer[i], &output_buffer[i]);
         }
-        // We add the futures in reverse order, since in Qt 5.1 at least the
-        // waiting thread will wait on them in the order added (which for uniform priority
-        // threads is the order of execution), and we want the waiting thread to go in the opposite order
-        // so that it can steal runnables and do something besides wait.
-        for (int i = temp.size() - 1; i >= 0; i--) {
-            futures.addFuture(temp[i]);
-        }
-
-        futures.waitForFinished();
+        tasks.wait();
 
         for (int i=0; i<src.size(); i++) dst.append(output_buffer[i]);
     }
@@ -14,15 +14,16 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/profiler.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
 
 static void _train(Transform *transform, const QList<TemplateList> *data)
 {
+    Profiler::Scope scope(transform, "train");
     transform->train(*data);
 }
 
@@ -42,10 +43,10 @@ class ForkTransform : public CompositeTransform
     void train(const QList<TemplateList> &data)
     {
         if (!trainable) return;
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<transforms.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &data));
-        futures.waitForFinished();
+            tasks.start(newTask(_train, transforms[i], &data));
+        tasks.wait();
     }
 
     // same as _project, but calls projectUpdate on sub-transforms
@@ -54,7 +55,9 @@ class ForkTransform : public CompositeTransform
         foreach (Transform *f, transforms) {
             try {
                 Template res;
+                Profiler::Scope scope(f, "projectUpdate", src);
                 f->projectUpdate(src, res);
+                scope.output(res);
                 dst.merge(res);
             } catch (...) {
                 qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
@@ -71,7 +74,9 @@ class ForkTransform : public CompositeTransform
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
         foreach (Transform *f, transforms) {
             TemplateList m;
+            Profiler::Scope scope(f, "projectUpdate", src);
             f->projectUpdate(src, m);
+            scope.output(m);
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -112,7 +117,10 @@ protected:
     {
         foreach (const Transform *f, transforms) {
             try {
-                dst.merge((*f)(src));
+                Profiler::Scope scope(f, "project", src);
+                const Template res = (*f)(src);
+                scope.output(res);
+                dst.merge(res);
             } catch (...) {
                 qWarning("Exception triggered when processing %s with transform %s", qPrintable(src.file.flat()), qPrintable(f->objectName()));
                 dst = Template(src.file);
@@ -128,7 +136,9 @@ protected:
         for (int i=0; i<src.size(); i++) dst.append(Template(src[i].file));
         foreach (const Transform *f, transforms) {
             TemplateList m;
+            Profiler::Scope scope(f, "project", src);
             f->project(src, m);
+            scope.output(m);
             if (m.size() != dst.size()) qFatal("TemplateList is of an unexpected size.");
             for (int i=0; i<src.size(); i++) dst[i].merge(m[i]);
         }
@@ -14,9 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -149,10 +148,10 @@ class IndependentTransform : public MetaTransform
         while (transforms.size() < templatesList.size())
             transforms.append(transform->clone());
 
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<templatesList.size(); i++)
-            futures.addFuture(QtConcurrent::run(_train, transforms[i], &templatesList[i]));
-        futures.waitForFinished();
+            tasks.start(newTask(_train, transforms[i], &templatesList[i]));
+        tasks.wait();
     }
 
     void project(const Template &src, Template &dst) const
@@ -15,6 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/modelcontainer.h>
 #include <openbr/core/qtutils.h>
 
 namespace br
@@ -85,20 +86,11 @@ private:
         transform->train(data);
 
         qDebug("Storing %s", qPrintable(fileName));
-        QtUtils::BlockCompression compressedOut;
-        QFile fout(fileName);
-        QtUtils::touchDir(fout);
-        compressedOut.setBasis(&fout);
-
-        QDataStream stream(&compressedOut);
-        QString desc = transform->description();
-
-        if (!compressedOut.open(QFile::WriteOnly))
-            qFatal("Failed to open %s for writing.", qPrintable(file));
-
-        stream << desc;
+        ModelContainer::Writer writer(fileName);
+        QDataStream &stream = writer.section("transform");
+        stream << transform->description();
         transform->store(stream);
-        compressedOut.close();
+        writer.commit();
     }
 
     void project(const Template &src, Template &dst) const
@@ -144,6 +136,18 @@ private:
         if (file.isEmpty()) return false;
 
         qDebug("Loading %s", qPrintable(file));
+        if (ModelContainer::isContainer(file)) {
+            QBuffer buffer;
+            ModelContainer(file).open("transform", buffer);
+            QDataStream stream(&buffer);
+            stream >> transformString;
+
+            transform = Transform::make(transformString);
+            transform->load(stream);
+            return true;
+        }
+
+        // Models stored before model containers
         QFile fin(file);
         QtUtils::BlockCompression reader(&fin);
         if (!reader.open(QIODevice::ReadOnly)) {
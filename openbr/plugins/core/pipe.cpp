@@ -14,9 +14,12 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
+#include <QTemporaryDir>
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/mappedfiles.h>
+#include <openbr/core/profiler.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -27,6 +30,8 @@ namespace br
  * \author Josh Klontz \cite jklontz
  *
  * The source br::Template is given to the first transform and the resulting br::Template is passed to the next transform, etc.
+ * While training, templates projected for the next trainable transform beyond br::Context::trainingMemory are spilled to disk.
+ * Trained transforms may keep the spilled templates, so they stay mapped and on disk until the context is finalized.
  *
  * \see ExpandTransform
  * \see ForkTransform
@@ -35,16 +40,58 @@ class PipeTransform : public CompositeTransform
 {
     Q_OBJECT
 
-    void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex)
+    void _projectPartial(TemplateList *srcdst, int startIndex, int stopIndex, QString scratch, qint64 budget) const
     {
         TemplateList ftes;
-        for (int i=startIndex; i<stopIndex; i++) {
-            TemplateList res;
-            transforms[i]->project(*srcdst, res);
+        if (budget <= 0) {
+            for (int i=startIndex; i<stopIndex; i++) {
+                TemplateList res;
+                Profiler::Scope scope(transforms[i], "project", *srcdst);
+                transforms[i]->project(*srcdst, res);
+                scope.output(res);
 
-            splitFTEs(res, ftes);
-            *srcdst = res;
+                splitFTEs(res, ftes);
+                *srcdst = res;
+            }
+            return;
+        }
+
+        // Project a block at a time, once the results exceed the budget they are written to the scratch gallery
+        // and read back memory mapped, so the next trainable transform pages them in as it reads them
+        TemplateList projected;
+        QScopedPointer<Gallery> spill;
+        qint64 bytes = 0;
+        for (int begin=0; begin<srcdst->size(); begin+=Globals->blockSize) {
+            TemplateList block = srcdst->mid(begin, Globals->blockSize);
+            for (int i=startIndex; i<stopIndex; i++) {
+                TemplateList res;
+                Profiler::Scope scope(transforms[i], "project", block);
+                transforms[i]->project(block, res);
+                scope.output(res);
+
+                splitFTEs(res, ftes);
+                block = res;
+            }
+
+            if (spill.isNull()) {
+                projected.append(block);
+                bytes += block.bytes<qint64>();
+                if (bytes > budget) {
+                    spill.reset(Gallery::make(scratch));
+                    spill->writeBlock(projected);
+                    projected.clear();
+                }
+            } else {
+                spill->writeBlock(block);
+            }
         }
+
+        if (!spill.isNull()) {
+            spill.reset();
+            srcdst->clear();
+            projected = QScopedPointer<Gallery>(Gallery::make(scratch + "[mmap]"))->read();
+        }
+        *srcdst = projected;
     }
 
     void train(const QList<TemplateList> &data)
@@ -53,11 +100,24 @@ class PipeTransform : public CompositeTransform
 
         QList<TemplateList> dataLines(data);
 
+        // Intermediate templates beyond the memory budget are spilled here
+        QScopedPointer<QTemporaryDir> scratch;
+        const qint64 budget = (qint64(Globals->trainingMemory) << 20) / std::max(1, dataLines.size());
+        if (budget > 0) {
+            scratch.reset(new QTemporaryDir((Globals->trainingScratch.isEmpty() ? QDir::tempPath() : Globals->trainingScratch) + "/openbr-train-XXXXXX"));
+            if (!scratch->isValid())
+                qFatal("Unable to create a scratch directory for training.");
+            // Removed after the spills are unmapped, which is required on Windows
+            scratch->setAutoRemove(false);
+            MappedFiles::removeOnFinalize(scratch->path());
+        }
+
         int i = 0;
         while (i < transforms.size()) {
             // Conditional statement covers likely case that first transform is untrainable
             if (transforms[i]->trainable) {
                 qDebug() << "Training " << transforms[i]->description() << "\n...";
+                Profiler::Scope scope(transforms[i], "train");
                 transforms[i]->train(dataLines);
             }
 
@@ -68,7 +128,9 @@ class PipeTransform : public CompositeTransform
                     TemplateList junk;
                     splitFTEs(dataLines[j], junk);
 
+                    Profiler::Scope scope(transforms[i], "projectUpdate", dataLines[j]);
                     transforms[i]->projectUpdate(dataLines[j], dataLines[j]);
+                    scope.output(dataLines[j]);
                 }
 
                 // advance i since we already projected for this stage.
@@ -99,10 +161,11 @@ class PipeTransform : public CompositeTransform
             fprintf(stderr, "\n...\n");
             fflush(stderr);
 
-            QFutureSynchronizer<void> futures;
+            Scheduler::Group tasks;
             for (int j=0; j < dataLines.size(); j++)
-                futures.addFuture(QtConcurrent::run(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform));
-            futures.waitForFinished();
+                tasks.start(newTask(this, &PipeTransform::_projectPartial, &dataLines[j], i, nextTrainableTransform,
+                                    budget > 0 ? QString("%1/%2-%3.brt").arg(scratch->path(), QString::number(i), QString::number(j)) : QString(), budget));
+            tasks.wait();
 
             i = nextTrainableTransform;
         }
@@ -113,7 +176,9 @@ class PipeTransform : public CompositeTransform
         dst = src;
         foreach (Transform *f, transforms) {
             try {
+                Profiler::Scope scope(f, "projectUpdate", dst);
                 f->projectUpdate(dst);
+                scope.output(dst);
                 if (dst.file.fte)
                     break;
             } catch (...) {
@@ -133,7 +198,9 @@ class PipeTransform : public CompositeTransform
         dst = src;
         foreach (Transform *f, transforms) {
             TemplateList res;
+            Profiler::Scope scope(f, "projectUpdate", dst);
             f->projectUpdate(dst, res);
+            scope.output(res);
             splitFTEs(res, ftes);
             dst = res;
         }
@@ -189,7 +256,9 @@ protected:
         dst = src;
         foreach (const Transform *f, transforms) {
             TemplateList res;
+            Profiler::Scope scope(f, "project", dst);
             f->project(dst, res);
+            scope.output(res);
             splitFTEs(res, ftes);
             dst = res;
         }
@@ -202,7 +271,9 @@ protected:
        dst = src;
        foreach (const Transform *f, transforms) {
            try {
+               Profiler::Scope scope(f, "project", dst);
                dst >> *f;
+               scope.output(dst);
                if (dst.file.fte)
                    break;
            } catch (...) {
@@ -20,17 +20,71 @@
 #include <QLocalSocket>
 #include <QMutex>
 #include <QProcess>
+#include <QSharedMemory>
 #include <QUuid>
 #include <QWaitCondition>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/templatecodec.h>
 
 using namespace cv;
 
 namespace br
 {
 
+/*!
+ * \brief Shared memory holding the matrix data of the templates sent in one direction between two processes.
+ *
+ * Exchanges are synchronous, the sender waits for a reply before sending again, so the receiver may use the data in place
+ * until it replies. One buffer per direction is enough, it is replaced by a larger one under a new key when a message doesn't fit.
+ */
+class SharedSlab
+{
+    QSharedMemory memory;
+    int generation;
+
+public:
+    QString baseKey;
+
+    SharedSlab() : generation(0) {}
+
+    // Writer side, returns NULL if shared memory is unavailable
+    char *reserve(qint64 size)
+    {
+        if (memory.isAttached() && (memory.size() >= size))
+            return (char*) memory.data();
+
+        memory.detach();
+        const qint64 capacity = qMax(qint64(16) << 20, size + size / 2);
+        if (capacity > INT_MAX)
+            return NULL;
+        memory.setKey(baseKey + "_" + QString::number(generation++));
+        if (!memory.create(int(capacity))) {
+            qWarning("Unable to create shared memory: %s", qPrintable(memory.errorString()));
+            return NULL;
+        }
+        return (char*) memory.data();
+    }
+
+    // Reader side
+    char *attach(const QString &key)
+    {
+        if (!memory.isAttached() || (memory.key() != key)) {
+            memory.detach();
+            memory.setKey(key);
+            if (!memory.attach())
+                qFatal("Unable to attach shared memory: %s", qPrintable(memory.errorString()));
+        }
+        return (char*) memory.data();
+    }
+
+    QString key() const
+    {
+        return memory.key();
+    }
+};
+
 class CommunicationManager : public QObject
 {
     Q_OBJECT
@@ -89,6 +143,17 @@ public:
         SHOULD_END
     };
 
+    // How the matrices of a template list are sent, recorded in each message
+    enum Transport
+    {
+        SERIALIZED, // In the socket message, encoded by TemplateCodec after the 16 byte message header
+        SHARED_MEMORY // In a SharedSlab, with only their headers in the socket message
+    };
+
+    // Template list messages start with these, so mismatched master and worker builds fail loudly
+    static const quint32 MessageMagic = 0x6272706d;
+    static const quint32 MessageVersion = 2;
+
 
 public slots:
     // matching server signals
@@ -347,12 +412,44 @@ public:
     }
 
 
-    template<typename T>
-    bool readData(T &input)
+    SharedSlab inboundSlab, outboundSlab;
+    Transport receivedTransport;
+
+    // Matrices are wrapped in place unless copy is set, then they are only valid until the next message is sent
+    bool readTemplates(TemplateList &templates, bool copy)
     {
         emit pulseReadSerialized();
         QDataStream deserializer(readArray);
-        deserializer >> input;
+
+        quint32 magic, version, transport;
+        deserializer >> magic >> version >> transport;
+        if ((magic != MessageMagic) || (version != MessageVersion))
+            qFatal("Incompatible ProcessWrapper message version %u, expected %u.", version, MessageVersion);
+        receivedTransport = Transport(transport);
+
+        if (receivedTransport == SERIALIZED) {
+            templates = TemplateCodec::decode(readArray.constData() + 16, readArray.size() - 16, copy);
+            return true;
+        }
+
+        QString slabKey;
+        int count;
+        deserializer >> slabKey >> count;
+        char *data = inboundSlab.attach(slabKey);
+        for (int i=0; i<count; i++) {
+            Template t;
+            int size;
+            deserializer >> t.file >> size;
+            for (int j=0; j<size; j++) {
+                int rows, cols, type;
+                qint64 offset;
+                deserializer >> rows >> cols >> type >> offset;
+                if (rows * cols == 0) t.append(Mat(rows, cols, type));
+                else if (copy)        t.append(Mat(rows, cols, type, data + offset).clone());
+                else                  t.append(Mat(rows, cols, type, data + offset));
+            }
+            templates.append(t);
+        }
         return true;
     }
 
@@ -367,14 +464,51 @@ public:
         return res;
     }
 
-    template<typename T>
-    bool sendData(const T &output)
+    static qint64 sharedSize(const Mat &m)
     {
+        return (qint64(m.total()) * m.elemSize() + 63) & ~qint64(63);
+    }
+
+    bool sendTemplates(const TemplateList &templates, Transport transport)
+    {
+        char *data = NULL;
+        if (transport == SHARED_MEMORY) {
+            // Only two dimensional matrices are described by their rows, cols and type, others are serialized
+            qint64 bytes = 0;
+            bool shareable = true;
+            foreach (const Template &t, templates)
+                foreach (const Mat &m, t) {
+                    shareable = shareable && (m.dims <= 2);
+                    bytes += sharedSize(m);
+                }
+            if (shareable) data = outboundSlab.reserve(bytes);
+            if (!data) transport = SERIALIZED;
+        }
+
         QBuffer buffer;
         buffer.open(QBuffer::ReadWrite);
 
         QDataStream serializer(&buffer);
-        serializer << output;
+        serializer << MessageMagic << MessageVersion << quint32(transport);
+        if (transport == SERIALIZED) {
+            serializer << quint32(0); // Pad the header to 16 bytes
+            buffer.write(TemplateCodec::encode(templates));
+        } else {
+            serializer << outboundSlab.key() << templates.size();
+            qint64 offset = 0;
+            foreach (const Template &t, templates) {
+                serializer << t.file << t.size();
+                foreach (const Mat &m, t) {
+                    serializer << m.rows << m.cols << m.type() << offset;
+                    if (!m.empty()) {
+                        Mat shared(m.rows, m.cols, m.type(), data + offset);
+                        m.copyTo(shared);
+                    }
+                    offset += sharedSize(m);
+                }
+            }
+        }
+
         writeArray = buffer.data();
         emit pulseSendSerialized();
         return true;
@@ -426,6 +560,7 @@ public:
         comm = new CommunicationManager();
         name = baseName;
         comm->key = "worker_"+baseName.mid(1,5);
+        comm->outboundSlab.baseKey = baseName+"_worker";
         comm->startServer(baseName+"_worker");
         comm->connectToRemote(baseName+"_master");
 
@@ -447,9 +582,10 @@ public:
             TemplateList inList;
             TemplateList outList;
 
-            comm->readData(inList);
+            // The master waits for our reply before reusing its buffer, so the input can stay in shared memory
+            comm->readTemplates(inList, false);
             transform->projectUpdate(inList,outList);
-            comm->sendData(outList);
+            comm->sendTemplates(outList, comm->receivedTransport);
         }
         comm->shutdown();
     }
@@ -544,13 +680,18 @@ struct ProcessData
 /*!
  * \ingroup transforms
  * \brief Interface to a separate process
+ *
+ * Templates are exchanged over a local socket. With \em sharedMemory the matrix data goes through shared memory instead
+ * and only file metadata and matrix headers are sent over the socket, falling back to the socket if shared memory is unavailable.
  * \author Charles Otto \cite caotto
  */
 class ProcessWrapperTransform : public WrapperTransform
 {
     Q_OBJECT
     Q_PROPERTY(int concurrentCount READ get_concurrentCount WRITE set_concurrentCount RESET reset_concurrentCount STORED false)
+    Q_PROPERTY(bool sharedMemory READ get_sharedMemory WRITE set_sharedMemory RESET reset_sharedMemory STORED false)
     BR_PROPERTY(int, concurrentCount, 2)
+    BR_PROPERTY(bool, sharedMemory, true)
 
     QString baseKey;
 
@@ -578,9 +719,9 @@ class ProcessWrapperTransform : public WrapperTransform
         CommunicationManager *localComm = &(data->comm);
 
         localComm->sendSignal(CommunicationManager::INPUT_AVAILABLE);
-        localComm->sendData(src);
+        localComm->sendTemplates(src, sharedMemory ? CommunicationManager::SHARED_MEMORY : CommunicationManager::SERIALIZED);
 
-        localComm->readData(dst);
+        localComm->readTemplates(dst, true);
         processes.release(data);
     }
 
@@ -647,6 +788,7 @@ class ProcessWrapperTransform : public WrapperTransform
         argumentList.append(baseKey);
 
         data->comm.key = "master_"+baseKey.mid(1,5);
+        data->comm.outboundSlab.baseKey = baseKey+"_master";
 
         data->comm.startServer(baseKey+"_master");
 
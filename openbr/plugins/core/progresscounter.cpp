@@ -37,13 +37,13 @@ class ProgressCounterTransform : public TimeVaryingTransform
         int last_frame = -2;
         if (!dst.empty()) {
             for (int i=0;i < dst.size();i++) {
-                int frame = dst[i].file.get<int>("FrameNumber", -1);
+                int frame = dst[i].file.get<int>(Metadata::FrameNumber, -1);
                 if (frame == last_frame && frame != -1)
                     continue;
 
                 // Use 1 as the starting index for progress output
-                Globals->currentProgress = dst[i].file.get<qint64>("progress",0)+1;
-                dst[i].file.remove("progress");
+                Globals->currentProgress = dst[i].file.get<qint64>(Metadata::Progress, 0)+1;
+                dst[i].file.remove(Metadata::Progress);
                 last_frame = frame;
 
                 Globals->currentStep++;
@@ -15,11 +15,10 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <fstream>
+#include <QElapsedTimer>
 #include <QReadWriteLock>
 #include <QWaitCondition>
-#include <QThreadPool>
 #include <QSemaphore>
-#include <QMap>
 #include <QQueue>
 #include <QtConcurrent>
 #include <opencv/highgui.h>
@@ -28,7 +27,9 @@
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/profiler.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 using namespace std;
@@ -41,6 +42,7 @@ class FrameData
 public:
     int sequenceNumber;
     TemplateList data;
+    qint64 queued; // Profiler::now() when added to a stage's input buffer
 };
 
 // A buffer shared between adjacent processing stages in a stream
@@ -59,145 +61,310 @@ public:
 
 // for n - 1 boundaries, multiple threads call addItem, the frames are
 // sequenced based on FrameData::sequence_number, and calls to getItem
-// receive them in that order
+// receive them in that order. At most capacity frames are in flight, so
+// frame n always lands in slot n % capacity, which the consumer has
+// already emptied. Producers publish with a release store, the single
+// consumer claims the next slot with an acquire load, so no locks are
+// needed on either side.
 class SequencingBuffer : public SharedBuffer
 {
 public:
-    SequencingBuffer()
+    SequencingBuffer(int capacity) : slots(capacity)
     {
         next_target = 0;
     }
 
     void addItem(FrameData *input)
     {
-        QMutexLocker bufferLock(&bufferGuard);
-
-        buffer.insert(input->sequenceNumber, input);
+        if (!slots[input->sequenceNumber % slots.size()].testAndSetRelease(NULL, input))
+            qFatal("Sequencing buffer overflow at frame %d!", input->sequenceNumber);
+        count.ref();
     }
 
     FrameData *tryGetItem()
     {
-        QMutexLocker bufferLock(&bufferGuard);
-
-        if (buffer.empty() || buffer.begin().key() != this->next_target) {
+        QAtomicPointer<FrameData> &slot = slots[next_target % slots.size()];
+        FrameData *output = slot.loadAcquire();
+        if (output == NULL)
             return NULL;
-        }
 
-        QMap<int, FrameData *>::Iterator result = buffer.begin();
-
-        if (next_target != result.value()->sequenceNumber) {
+        if (next_target != output->sequenceNumber) {
             qFatal("mismatched targets!");
         }
 
+        slot.storeRelease(NULL);
+        count.deref();
         next_target = next_target + 1;
-
-        FrameData *output = result.value();
-        buffer.erase(result);
         return output;
     }
 
     virtual int size()
     {
-        QMutexLocker lock(&bufferGuard);
-        return buffer.size();
+        return count.load();
     }
     virtual void reset()
     {
         if (size() != 0)
             qDebug("Sequencing buffer has non-zero size during reset!");
 
-        QMutexLocker lock(&bufferGuard);
         next_target = 0;
     }
 
 
 private:
-    QMutex bufferGuard;
     int next_target;
+    QAtomicInt count;
 
-    QMap<int, FrameData *> buffer;
+    QVector< QAtomicPointer<FrameData> > slots;
 };
 
-// For 1 - 1 boundaries, a double buffering scheme
-// Producer/consumer read/write from separate buffers, and switch if their
-// buffer runs out/overflows. Synchronization is handled by a read/write lock
-// threads are "reading" if they are adding to/removing from their individual
-// buffer, and writing if they access or swap with the other buffer.
-class DoubleBuffer : public SharedBuffer
+// For 1 - 1 boundaries, a bounded single-producer/single-consumer ring.
+// Calls to addItem and tryGetItem may come from different threads over
+// time, but each side is serialized by the stage owning it. The producer
+// only writes tail and the consumer only writes head, and each publishes
+// with a release store that the other side reads with an acquire load, so
+// neither side takes a lock.
+class RingBuffer : public SharedBuffer
 {
 public:
-    DoubleBuffer()
-    {
-        inputBuffer = &buffer1;
-        outputBuffer = &buffer2;
-    }
+    // One slot is left unused to tell a full ring from an empty one
+    RingBuffer(int capacity) : slots(capacity + 1) {}
 
     int size()
     {
-        QReadLocker readLock(&bufferGuard);
-        return inputBuffer->size() + outputBuffer->size();
+        const int n = slots.size();
+        return (tail.load() - head.load() + n) % n;
     }
 
     // called from the producer thread
     void addItem(FrameData *input)
     {
-        QReadLocker readLock(&bufferGuard);
-        inputBuffer->append(input);
+        const int t = tail.load();
+        const int next = (t + 1) % slots.size();
+        if (next == head.loadAcquire())
+            qFatal("Ring buffer overflow!");
+
+        slots[t] = input;
+        tail.storeRelease(next);
     }
 
     FrameData *tryGetItem()
     {
-        QReadLocker readLock(&bufferGuard);
+        const int h = head.load();
+        if (h == tail.loadAcquire())
+            return NULL;
+
+        FrameData *output = slots[h];
+        head.storeRelease((h + 1) % slots.size());
+        return output;
+    }
+
+    virtual void reset()
+    {
+        if (this->size() != 0)
+            qDebug("Shared buffer has non-zero size during reset!");
+    }
+
+
+private:
+    // Index of the next item to remove, written by the consumer
+    QAtomicInt head;
+
+    // Keep the producer's index off the consumer's cache line
+    char padding[64];
+
+    // Index of the next free slot, written by the producer
+    QAtomicInt tail;
+
+    QVector<FrameData *> slots;
+};
+
+// Reads the image files of upcoming templates on a separate pool of I/O threads, so
+// frames leave the read stage with their encoded image in memory, as a single row
+// CV_8UC1 matrix that Open and Read decode on the stream's compute threads.
+// Such templates are marked with ReadAhead, so Open decodes them as br::Format would read the file.
+class ReadAhead
+{
+public:
+    struct Statistics
+    {
+        qint64 reads, bytes;
+        qint64 totalMsecs, maxMsecs; // Time spent in each read
+        qint64 queuedSum; // Reads in flight, summed each time one is issued
+        int maxQueued;
 
-        // There is something for us to get
-        if (!outputBuffer->empty()) {
-            FrameData *output = outputBuffer->first();
-            outputBuffer->removeFirst();
-            return output;
+        QString toString() const
+        {
+            return QString("Reads: %1, MB: %2, Mean latency: %3 ms, Max latency: %4 ms, Mean queue depth: %5, Max queue depth: %6")
+                    .arg(QString::number(reads), QString::number(bytes / double(1 << 20), 'f', 1),
+                         QString::number(reads ? totalMsecs / double(reads) : 0, 'f', 1), QString::number(maxMsecs),
+                         QString::number(reads ? queuedSum / double(reads) : 0, 'f', 1), QString::number(maxQueued));
         }
+    };
 
-        // Outputbuffer is empty, try to swap with the input buffer, we need a
-        // write lock to do that.
-        readLock.unlock();
-        QWriteLocker writeLock(&bufferGuard);
+    ReadAhead() : depth(0), budget(0)
+    {
+        clear();
+    }
 
-        // Nothing on the input buffer either?
-        if (inputBuffer->empty()) {
-            return NULL;
+    ~ReadAhead()
+    {
+        clear();
+    }
+
+    // Up to depth reads are queued, while the buffered and in flight bytes fit in the budget
+    void configure(int depth, qint64 budget)
+    {
+        this->depth = depth;
+        this->budget = budget;
+        threads.setMaxThreadCount(std::max(1, std::min(depth, 32)));
+    }
+
+    bool enabled() const { return depth > 0; }
+
+    // Templates to queue now. None until half the queue is taken, so reads are issued in batches.
+    int room()
+    {
+        if (queue.size() > depth / 2)
+            return 0;
+
+        QMutexLocker locker(&lock);
+        const qint64 meanSize = stats.reads ? stats.bytes / stats.reads : 0;
+        if (!queue.isEmpty() && (buffered + inFlight * meanSize >= budget))
+            return 0;
+        return depth - queue.size();
+    }
+
+    // Queue templates in order, reading their files in path order for locality
+    void issue(const TemplateList &templates)
+    {
+        QList<PathRead> reads;
+        foreach (const Template &t, templates) {
+            QSharedPointer<Read> read(new Read(t));
+            queue.append(read);
+            // Only files Open would give to DefaultFormat
+            if (t.isEmpty() && !t.file.contains("plugin") && !t.file.contains("separator") && imageSuffixes().contains(t.file.suffix().toLower()))
+                reads.append(PathRead(t.file.name, read));
+            else
+                read->done = true;
+        }
+        std::stable_sort(reads.begin(), reads.end(), pathLessThan);
+
+        for (int i=0; i<reads.size(); i++) {
+            {
+                QMutexLocker locker(&lock);
+                inFlight++;
+                stats.queuedSum += inFlight;
+                stats.maxQueued = std::max(stats.maxQueued, inFlight);
+            }
+            threads.start(new ReadTask(this, reads[i].second));
         }
+    }
 
-        // input buffer is non-empty, so swap the buffers
-        std::swap(inputBuffer, outputBuffer);
+    bool isEmpty() const { return queue.isEmpty(); }
 
-        // Return a frame
-        FrameData *output = outputBuffer->first();
-        outputBuffer->removeFirst();
-        return output;
+    // The oldest queued template, waiting for its file if needed
+    Template take()
+    {
+        QSharedPointer<Read> read = queue.takeFirst();
+        QMutexLocker locker(&lock);
+        while (!read->done)
+            finished.wait(&lock);
+        buffered -= read->data.total();
+        // If the read failed the template is left for Open to report
+        if (!read->data.empty()) {
+            read->t.append(read->data);
+            read->t.file.set("ReadAhead", true);
+        }
+        return read->t;
     }
 
-    virtual void reset()
+    // Drop queued templates, once their reads finish
+    void clear()
     {
-        if (this->size() != 0)
-            qDebug("Shared buffer has non-zero size during reset!");
+        threads.waitForDone();
+        queue.clear();
+        buffered = 0;
+        inFlight = 0;
+        memset(&stats, 0, sizeof(stats));
     }
 
+    Statistics statistics()
+    {
+        QMutexLocker locker(&lock);
+        return stats;
+    }
 
 private:
-    // The read-write lock. The thread adding to this buffer can add
-    // to the current input buffer if it has a read lock. The thread
-    // removing from this buffer can remove things from the current
-    // output buffer if it has a read lock, or swap the buffers if it
-    // has a write lock.
-    QReadWriteLock bufferGuard;
-
-    // The buffer that is currently being added to
-    QList<FrameData *> * inputBuffer;
-    // The buffer that is currently being removed from
-    QList<FrameData *> * outputBuffer;
-
-    // The buffers pointed at by inputBuffer/outputBuffer
-    QList<FrameData *> buffer1;
-    QList<FrameData *> buffer2;
+    struct Read;
+    typedef QPair<QString, QSharedPointer<Read> > PathRead;
+
+    static bool pathLessThan(const PathRead &a, const PathRead &b)
+    {
+        return a.first < b.first;
+    }
+
+    struct Read
+    {
+        Template t;
+        Mat data;
+        bool done;
+
+        Read(const Template &t) : t(t), done(false) {}
+    };
+
+    class ReadTask : public QRunnable
+    {
+        ReadAhead *owner;
+        QSharedPointer<Read> read;
+
+    public:
+        ReadTask(ReadAhead *owner, const QSharedPointer<Read> &read) : owner(owner), read(read) {}
+
+        void run()
+        {
+            QElapsedTimer timer;
+            timer.start();
+
+            Mat data;
+            QFile file(read->t.file.resolved());
+            if (file.open(QFile::ReadOnly) && (file.size() > 0) && (file.size() < std::numeric_limits<int>::max())) {
+                data = Mat(1, int(file.size()), CV_8UC1);
+                if (file.read((char*) data.data, data.total()) != qint64(data.total()))
+                    data = Mat();
+            }
+            const qint64 msecs = timer.elapsed();
+
+            QMutexLocker locker(&owner->lock);
+            read->data = data;
+            read->done = true;
+            owner->inFlight--;
+            owner->buffered += data.total();
+            owner->stats.reads++;
+            owner->stats.bytes += data.total();
+            owner->stats.totalMsecs += msecs;
+            owner->stats.maxMsecs = std::max(owner->stats.maxMsecs, msecs);
+            owner->finished.wakeAll();
+        }
+    };
+
+    static const QStringList &imageSuffixes()
+    {
+        static const QStringList suffixes = QStringList() << "bmp" << "dib" << "jpeg" << "jpg" << "jpe" << "jp2" << "png" << "webp"
+                                                          << "pbm" << "pgm" << "ppm" << "sr" << "ras" << "tiff" << "tif";
+        return suffixes;
+    }
+
+    int depth;
+    qint64 budget;
+    QList< QSharedPointer<Read> > queue; // Oldest first, only used by the read stage
+    QThreadPool threads;
+
+    QMutex lock; // Guards the reads and the members below
+    QWaitCondition finished;
+    qint64 buffered; // Bytes read but not yet taken
+    int inFlight;
+    Statistics stats;
 };
 
 // Given a template as input, open the file contained as a gallery, and return templates one at a time on
@@ -231,13 +398,44 @@ struct StreamGallery
         currentData.clear();
         nextIdx = 0;
         lastBlock = true;
+
+        const ReadAhead::Statistics stats = readAhead.statistics();
+        if (Globals->verbose && (stats.reads > 0))
+            qDebug("Read ahead: %s", qPrintable(stats.toString()));
+        readAhead.clear();
     }
 
     bool getNextTemplate(Template &output)
+    {
+        if (!readAhead.enabled())
+            return getNextStored(output);
+
+        TemplateList upcoming;
+        const int room = readAhead.room();
+        Template t;
+        while ((upcoming.size() < room) && getNextStored(t))
+            upcoming.append(t);
+        readAhead.issue(upcoming);
+
+        if (readAhead.isEmpty()) {
+            galleryOk = false;
+            return false;
+        }
+
+        output = readAhead.take();
+        return true;
+    }
+
+    ReadAhead readAhead;
+
+protected:
+    bool getNextStored(Template &output)
     {
         // If we still have data available, we return one of those
         if ((nextIdx >= currentData.size()) && !lastBlock) {
+            Profiler::Scope scope(gallery.data(), "read");
             currentData = gallery->readBlock(&lastBlock);
+            scope.output(currentData);
             nextIdx = 0;
         }
 
@@ -251,8 +449,6 @@ struct StreamGallery
         return true;
     }
 
-protected:
-
     QSharedPointer<Gallery> gallery;
     bool galleryOk;
     bool lastBlock;
@@ -267,7 +463,7 @@ protected:
 class DataSource
 {
 public:
-    DataSource(int maxFrames=500)
+    DataSource(int maxFrames=500) : batchSize(1), allFrames(maxFrames)
     {
         // The sequence number of the last frame
         final_frame = -1;
@@ -311,6 +507,7 @@ public:
         final_frame = -1;
         // Start our sequence numbers from the input index
         next_sequence_number = 0;
+        next_frame_number = 0;
 
         // Actually open the data source
         bool open_res = openNextTemplate();
@@ -390,15 +587,34 @@ public:
         lastReturned.wakeAll();
     }
 
-    bool waitLast()
+    // Templates read into each frame, so stages see several at once
+    int batchSize;
+
+    // Read the images of up to depth upcoming templates in the background, within budget bytes
+    void setReadAhead(int depth, qint64 budget)
     {
-        QMutexLocker lock(&last_frame_update);
+        frameSource.readAhead.configure(depth, budget);
+    }
 
-        while (!allReturned)
+    // Run the stream's queued tasks (identified by owner) on the calling
+    // thread until the last frame is returned.
+    bool waitLast(const void *owner)
+    {
+        forever
         {
-            // This would be a safer wait if we used a timeout, but
-            // theoretically that should never matter.
-            lastReturned.wait(&last_frame_update);
+            {
+                QMutexLocker lock(&last_frame_update);
+                if (allReturned)
+                    return true;
+            }
+
+            if (Scheduler::instance()->tryRun(owner))
+                continue;
+
+            QMutexLocker lock(&last_frame_update);
+            // Timed, since there may be new tasks to help with
+            if (!allReturned)
+                lastReturned.wait(&last_frame_update, 1);
         }
         return true;
     }
@@ -430,38 +646,32 @@ protected:
 
     bool getNextFrame(FrameData &output)
     {
-        bool got_frame = false;
-
         Template aTemplate;
 
-        while (!got_frame)
+        while (output.data.size() < batchSize)
         {
-            got_frame = frameSource.getNextTemplate(aTemplate);
-
-            // OK we got a frame
-            if (got_frame) {
-                // set the sequence number and tempalte of this frame
-                output.sequenceNumber = next_sequence_number;
+            // OK we got a template
+            if (frameSource.getNextTemplate(aTemplate)) {
                 output.data.append(aTemplate);
                 // set the frame number in the template's metadata
-                output.data.last().file.set("FrameNumber", output.sequenceNumber);
-                next_sequence_number++;
-                return true;
+                output.data.last().file.set(Metadata::FrameNumber, next_frame_number++);
+                continue;
             }
 
-            // advance to the next tempalte in our list
+            // advance to the next template in our list, a partial batch is
+            // returned if there isn't one.
             this->current_template_idx++;
-            bool open_res = this->openNextTemplate();
-
-            // couldn't get the next template? nothing to do, otherwise we try to read
-            // a frame at the top of this loop.
-            if (!open_res) {
-                output.sequenceNumber = next_sequence_number;
-                return false;
-            }
+            if (!this->openNextTemplate())
+                break;
         }
 
-        return false;
+        // set the sequence number of this frame
+        output.sequenceNumber = next_sequence_number;
+        if (output.data.isEmpty())
+            return false;
+
+        next_sequence_number++;
+        return true;
     }
 
     // Index of the template in the templatelist we are currently reading from
@@ -474,11 +684,12 @@ protected:
     StreamGallery frameSource;
 
     int next_sequence_number;
+    int next_frame_number;
     int final_frame;
     bool is_broken;
     bool allReturned;
 
-    DoubleBuffer allFrames;
+    RingBuffer allFrames;
 
     QWaitCondition lastReturned;
     QMutex last_frame_update;
@@ -486,14 +697,9 @@ protected:
 
 class ProcessingStage;
 
-class BasicLoop : public QRunnable, public QFutureInterface<void>
+class BasicLoop : public QRunnable
 {
 public:
-    BasicLoop()
-    {
-        this->reportStarted();
-    }
-
     void run();
 
     QList<ProcessingStage *> * stages;
@@ -512,7 +718,9 @@ public:
     }
     virtual ~ProcessingStage() {}
 
-    virtual FrameData* run(FrameData *input, bool &should_continue, bool &final)=0;
+    // Sets repeat if the returned frame should be run through this stage again
+    // by the calling thread, rather than passed to the next stage.
+    virtual FrameData* run(FrameData *input, bool &should_continue, bool &final, bool &repeat)=0;
 
     virtual bool tryAcquireNextStage(FrameData *& input, bool &final)=0;
 
@@ -528,7 +736,7 @@ protected:
     SharedBuffer *inputBuffer;
     ProcessingStage *nextStage;
     QList<ProcessingStage *> * stages;
-    QThreadPool *threads;
+    Scheduler *threads;
     Transform *transform;
 
 };
@@ -540,16 +748,20 @@ public:
 
     // Not much to worry about here, we will project the input
     // and try to continue to the next stage.
-    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    FrameData *run(FrameData *input, bool &should_continue, bool &final, bool &repeat)
     {
         if (input == NULL) {
             qFatal("null input to multi-thread stage");
         }
 
+        repeat = false;
+
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
+        Profiler::Scope scope(transform, "stage", input->data);
         transform->project(input->data, res);
+        scope.output(res);
         input->data = res;
         input->data.append(ftes);
 
@@ -579,19 +791,20 @@ public:
 class SingleThreadStage : public ProcessingStage
 {
 public:
-    SingleThreadStage(bool input_variance) : ProcessingStage(1)
+    // capacity is the number of frames that may be in flight at once
+    SingleThreadStage(bool input_variance, int capacity) : ProcessingStage(1)
     {
         currentStatus = STOPPING;
         next_target = 0;
         // If the previous stage is single-threaded, queued inputs
-        // are stored in a double buffer
+        // are stored in a ring buffer
         if (input_variance) {
-            this->inputBuffer = new DoubleBuffer();
+            this->inputBuffer = new RingBuffer(capacity);
         }
         // If it's multi-threaded we need to put the inputs back in order
         // before we can use them, so we use a sequencing buffer.
         else {
-            this->inputBuffer = new SequencingBuffer();
+            this->inputBuffer = new SequencingBuffer(capacity);
         }
     }
 
@@ -618,11 +831,13 @@ public:
     QReadWriteLock statusLock;
     Status currentStatus;
 
-    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    FrameData *run(FrameData *input, bool &should_continue, bool &final, bool &repeat)
     {
         if (input == NULL)
             qFatal("NULL input to stage %d", this->stage_id);
 
+        repeat = false;
+
         if (input->sequenceNumber != next_target)
             qFatal("out of order frames for stage %d, got %d expected %d", this->stage_id, input->sequenceNumber, this->next_target);
 
@@ -631,7 +846,9 @@ public:
         TemplateList ftes;
         splitFTEs(input->data, ftes);
         TemplateList res;
+        Profiler::Scope scope(transform, "stage", input->data);
         transform->projectUpdate(input->data, res);
+        scope.output(res);
         input->data = res;
         input->data.append(ftes);
 
@@ -642,15 +859,23 @@ public:
 
         // Is there anything on our input buffer? If so we should start a thread with that.
         QWriteLocker lock(&statusLock);
-        FrameData *newItem = inputBuffer->tryGetItem();
+        FrameData *newItem = takeQueued();
         if (!newItem)
         {
             this->currentStatus = STOPPING;
         }
         lock.unlock();
 
-        if (newItem)
+        if (newItem) {
+            // If our frame isn't going anywhere, this thread continues with the
+            // queued one instead of handing it to a new task
+            if (!should_continue) {
+                should_continue = true;
+                repeat = true;
+                return newItem;
+            }
             startThread(newItem);
+        }
 
         return input;
     }
@@ -662,12 +887,11 @@ public:
         next->start_idx = this->stage_id;
         next->startItem = newItem;
 
-        // We start threads with priority equal to their stage id
-        // This is intended to ensure progression, we do queued late stage
-        // jobs before queued early stage jobs, and so tend to finish frames
-        // rather than go stage by stage. In Qt 5.1, priorities are priorities
-        // so we use the stage_id directly.
-        this->threads->start(next, stage_id);
+        // Tasks are owned by the stream, so a thread waiting for it to finish
+        // only helps with this stream's frames. The scheduler runs the most
+        // recently started task first on the starting worker, so the new frame
+        // tends to follow the current one through the remaining stages.
+        this->threads->start(next, stages);
     }
 
 
@@ -675,6 +899,8 @@ public:
     bool tryAcquireNextStage(FrameData *& input, bool &final)
     {
         final = false;
+        if (Profiler::enabled())
+            input->queued = Profiler::now();
         inputBuffer->addItem(input);
 
         QReadLocker lock(&statusLock);
@@ -694,7 +920,7 @@ public:
         }
         // Ok we might start a thread, as long as we can get something back
         // from the input buffer
-        input = inputBuffer->tryGetItem();
+        input = takeQueued();
 
         if (!input)
             return false;
@@ -704,6 +930,15 @@ public:
         return true;
     }
 
+    // Next frame from the input buffer, recording how long it waited there
+    FrameData *takeQueued()
+    {
+        FrameData *item = inputBuffer->tryGetItem();
+        if (item && Profiler::enabled())
+            Profiler::wait(transform, "queue", item->queued);
+        return item;
+    }
+
     void status() {
         qDebug("single thread stage %d, status starting? %d, next %d buffer size %d", this->stage_id, this->currentStatus == SingleThreadStage::STARTING, this->next_target, this->inputBuffer->size());
     }
@@ -713,7 +948,7 @@ public:
 class EndStage : public SingleThreadStage
 {
 public:
-    EndStage(bool input_variance) : SingleThreadStage(input_variance) {}
+    EndStage(bool input_variance, int capacity) : SingleThreadStage(input_variance, capacity) {}
 
     ~EndStage() {}
 
@@ -790,7 +1025,7 @@ BR_REGISTER(Transform, CollectOutputTransform)
 class ReadStage : public SingleThreadStage
 {
 public:
-    ReadStage(int activeFrames = 100) : SingleThreadStage(true), dataSource(activeFrames){ }
+    ReadStage(int activeFrames = 100) : SingleThreadStage(true, activeFrames), dataSource(activeFrames){ }
 
     DataSource dataSource;
 
@@ -800,11 +1035,13 @@ public:
         SingleThreadStage::reset();
     }
 
-    FrameData *run(FrameData *input, bool &should_continue, bool &final)
+    FrameData *run(FrameData *input, bool &should_continue, bool &final, bool &repeat)
     {
         if (input == NULL)
             qFatal("NULL frame in input stage");
 
+        repeat = false;
+
         // Can we enter the next stage?
         should_continue = nextStage->tryAcquireNextStage(input, final);
 
@@ -815,15 +1052,24 @@ public:
         bool last_frame = false;
         FrameData *newFrame = dataSource.tryGetFrame(last_frame);
 
-        // Were we able to get a frame?
-        if (newFrame) startThread(newFrame);
         // If not this stage will enter a stopped state.
-        else {
+        if (!newFrame) {
             currentStatus = STOPPING;
         }
 
         lock.unlock();
 
+        // Were we able to get a frame? Keep reading on this thread if our
+        // frame isn't going anywhere.
+        if (newFrame) {
+            if (!should_continue) {
+                should_continue = true;
+                repeat = true;
+                return newFrame;
+            }
+            startThread(newFrame);
+        }
+
         return input;
     }
 
@@ -886,7 +1132,11 @@ void BasicLoop::run()
     bool the_end = false;
     forever
     {
-        target_item = stages->at(current_idx)->run(target_item, should_continue, the_end);
+        bool repeat = false;
+        target_item = stages->at(current_idx)->run(target_item, should_continue, the_end, repeat);
+        if (repeat) {
+            continue;
+        }
         if (!should_continue) {
             break;
         }
@@ -896,9 +1146,6 @@ void BasicLoop::run()
     if (the_end) {
         dynamic_cast<ReadStage *> (stages->at(0))->dataSource.wake();
     }
-
-    this->reportFinished();
-
 }
 
 class DirectStreamTransform : public CompositeTransform
@@ -908,8 +1155,14 @@ class DirectStreamTransform : public CompositeTransform
 public:
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    Q_PROPERTY(int readAhead READ get_readAhead WRITE set_readAhead RESET reset_readAhead)
+    Q_PROPERTY(int readAheadMemory READ get_readAheadMemory WRITE set_readAheadMemory RESET reset_readAheadMemory)
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(int, batchSize, 1)
+    BR_PROPERTY(int, readAhead, 0)
+    BR_PROPERTY(int, readAheadMemory, 256)
 
     friend class StreamTransfrom;
 
@@ -1033,7 +1286,7 @@ public:
 
         // Wait for the stream to process the last frame available from
         // the data source.
-        readStage->dataSource.waitLast();
+        readStage->dataSource.waitLast(&processingStages);
 
         // Now that there are no more incoming frames, call finalize
         // on each transform in turn to collect any last templates
@@ -1083,18 +1336,8 @@ public:
         // correctly.
         CompositeTransform::init();
 
-        // We share a thread pool across streams attached to the same
-        // parent tranform, retrieve or create a thread pool based
-        // on our parent transform.
-        QMutexLocker poolLock(&poolsAccess);
-        QHash<QObject *, QThreadPool *>::Iterator it;
-        if (!pools.contains(this->parent())) {
-            it = pools.insert(this->parent(), new QThreadPool());
-            it.value()->setMaxThreadCount(Globals->parallelism);
-        }
-        else it = pools.find(this->parent());
-        threads = it.value();
-        poolLock.unlock();
+        // All streams share the process-wide scheduler
+        threads = Scheduler::instance();
 
         // Are our children time varying or not? This decides whether
         // we run them in single threaded or multi threaded stages
@@ -1107,6 +1350,8 @@ public:
         // Additionally, we have a separate stage responsible for reading
         // frames from the data source
         readStage = new ReadStage(activeFrames);
+        readStage->dataSource.batchSize = std::max(1, batchSize);
+        readStage->dataSource.setReadAhead(readAhead, qint64(readAheadMemory) << 20);
 
         processingStages.push_back(readStage);
         readStage->stage_id = 0;
@@ -1122,7 +1367,7 @@ public:
             if (stage_variance[i])
                 // Whether or not the previous stage is multi-threaded controls
                 // the type of input buffer we need in a single threaded stage.
-                processingStages.append(new SingleThreadStage(prev_stage_variance));
+                processingStages.append(new SingleThreadStage(prev_stage_variance, activeFrames));
             else
                 processingStages.append(new MultiThreadStage(Globals->parallelism));
 
@@ -1141,7 +1386,7 @@ public:
 
         // We also have the last stage, which just puts the output of the
         // previous stages on a template list.
-        collectionStage = new EndStage(prev_stage_variance);
+        collectionStage = new EndStage(prev_stage_variance, activeFrames);
         collectionStage->transform = this->endPoint;
 
 
@@ -1176,24 +1421,12 @@ protected:
 
     QList<ProcessingStage *> processingStages;
 
-    // This is a map from parent transforms (of Streams) to thread pools. Rather
-    // than starting threads on the global thread pool, Stream uses separate thread pools
-    // keyed on their parent transform. This is necessary because stream's project starts
-    // threads, then enters an indefinite wait for them to finish. Since we are starting
-    // threads using thread pools, threads themselves are a limited resource. Therefore,
-    // the type of hold and wait done by stream project can lead to deadlock unless
-    // resources are ordered in such a way that a circular wait will not occur. The points
-    // of this hash is to introduce a resource ordering (on threads) that mirrors the structure
-    // of the algorithm. So, as long as the structure of the algorithm is a DAG, the wait done
-    // by stream project will not be circular, since every thread in stream project is waiting
-    // for threads at a lower level to do the work.
-    // This issue doesn't come up in distribute, since a thread waiting on a QFutureSynchronizer
-    // will steal work from those jobs, so in that sense distribute isn't doing a hold and wait.
-    // Waiting for a QFutureSynchronzier isn't really possible here since stream runs an indeteriminate
-    // number of jobs.
-    static QHash<QObject *, QThreadPool *> pools;
-    static QMutex poolsAccess;
-    QThreadPool *threads;
+    // Stream's project starts tasks, then waits for the last frame. Since all streams
+    // share one scheduler, a nested stream waiting on a worker would hold that worker
+    // while waiting for others, which can deadlock once every worker is waiting. So
+    // instead of blocking, DataSource::waitLast runs this stream's queued tasks on the
+    // waiting thread, much like waiting on a QFutureSynchronizer steals its jobs.
+    Scheduler *threads;
 
     void _project(const Template &src, Template &dst) const
     {
@@ -1207,9 +1440,6 @@ protected:
     }
 };
 
-QHash<QObject *, QThreadPool *> DirectStreamTransform::pools;
-QMutex DirectStreamTransform::poolsAccess;
-
 BR_REGISTER(Transform, DirectStreamTransform)
 
 class StreamTransform : public WrapperTransform
@@ -1223,9 +1453,19 @@ public:
 
     Q_PROPERTY(br::Transform* endPoint READ get_endPoint WRITE set_endPoint RESET reset_endPoint STORED true)
     Q_PROPERTY(int activeFrames READ get_activeFrames WRITE set_activeFrames RESET reset_activeFrames)
+    // Templates read into each frame. Stages with a batched project(TemplateList), like PCA, then
+    // process them together, but per-frame transforms like DropFrames act on the whole batch.
+    Q_PROPERTY(int batchSize READ get_batchSize WRITE set_batchSize RESET reset_batchSize)
+    // Image files of up to readAhead upcoming templates are read by separate I/O threads, using at most
+    // readAheadMemory MB, and decoded by Open or Read. Statistics are printed with -verbose.
+    Q_PROPERTY(int readAhead READ get_readAhead WRITE set_readAhead RESET reset_readAhead)
+    Q_PROPERTY(int readAheadMemory READ get_readAheadMemory WRITE set_readAheadMemory RESET reset_readAheadMemory)
 
     BR_PROPERTY(int, activeFrames, 100)
     BR_PROPERTY(br::Transform*, endPoint, make("CollectOutput"))
+    BR_PROPERTY(int, batchSize, 1)
+    BR_PROPERTY(int, readAhead, 0)
+    BR_PROPERTY(int, readAheadMemory, 256)
 
     bool timeVarying() const { return true; }
 
@@ -1267,6 +1507,9 @@ public:
         basis->transforms.clear();
         basis->activeFrames = this->activeFrames;
         basis->endPoint = this->endPoint;
+        basis->batchSize = this->batchSize;
+        basis->readAhead = this->readAhead;
+        basis->readAheadMemory = this->readAheadMemory;
 
         // We need at least a CompositeTransform * to acess transform's children.
         CompositeTransform *downcast = dynamic_cast<CompositeTransform *> (transform);
@@ -1339,6 +1582,9 @@ public:
         // We just want the DirectStream to begin with, so just return a copy of that.
         DirectStreamTransform *res = (DirectStreamTransform *) basis->smartCopy(newTransform);
         res->activeFrames = this->activeFrames;
+        res->batchSize = this->batchSize;
+        res->readAhead = this->readAhead;
+        res->readAheadMemory = this->readAheadMemory;
         return res;
     }
 
@@ -14,16 +14,15 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <Eigen/Dense>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 namespace br
 {
 
 /*!
  * \ingroup distances
- * \brief L1 distance computed using eigen.
+ * \brief Fast floating point L1 distance.
  * \author Josh Klontz \cite jklontz
  */
 class L1Distance : public UntrainableDistance
@@ -32,10 +31,16 @@ class L1Distance : public UntrainableDistance
 
     float compare(const cv::Mat &a, const cv::Mat &b) const
     {
-        const int size = a.rows * a.cols;
-        Eigen::Map<Eigen::VectorXf> aMap((float*)a.data, size);
-        Eigen::Map<Eigen::VectorXf> bMap((float*)b.data, size);
-        return (aMap-bMap).cwiseAbs().sum();
+        return l1((const float*)a.data, (const float*)b.data, a.rows * a.cols);
+    }
+
+    bool compareBatch(const uchar *queries, const uchar *targets, int queryCount, int targetCount, size_t size, float *scores) const
+    {
+        const int dim = size / sizeof(float);
+        for (int i=0; i<queryCount; i++)
+            for (int j=0; j<targetCount; j++)
+                scores[i*targetCount + j] = l1((const float*)queries + i*dim, (const float*)targets + j*dim, dim);
+        return true;
     }
 };
 
@@ -14,10 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -69,10 +68,10 @@ class BayesianQuantizationDistance : public Distance
         const QList<int> templateLabels = src.indexProperty(inputVariable);
         loglikelihoods = QVector<float>(data.cols*256, 0);
 
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
-        futures.waitForFinished();
+            tasks.start(newTask(&BayesianQuantizationDistance::computeLogLikelihood, data.col(i), templateLabels, &loglikelihoods.data()[i*256]));
+        tasks.wait();
     }
 
     float compare(const cv::Mat &a, const cv::Mat &b) const
@@ -33,6 +33,14 @@ class ByteL1Distance : public UntrainableDistance
     {
         return l1(a, b, size);
     }
+
+    bool compareBatch(const uchar *queries, const uchar *targets, int queryCount, int targetCount, size_t size, float *scores) const
+    {
+        for (int i=0; i<queryCount; i++)
+            for (int j=0; j<targetCount; j++)
+                scores[i*targetCount + j] = l1(targets + j*size, queries + i*size, size);
+        return true;
+    }
 };
 
 BR_REGISTER(Distance, ByteL1Distance)
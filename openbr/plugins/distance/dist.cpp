@@ -16,6 +16,7 @@
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/distance_sse.h>
 
 using namespace cv;
 
@@ -82,6 +83,8 @@ private:
           case Cosine:
             return cosine(a, b);
           case Dot:
+            if ((a.type() == CV_32FC1) && a.isContinuous() && b.isContinuous())
+                return ::dot((const float*)a.data, (const float*)b.data, a.rows * a.cols);
             return a.dot(b);
           default:
             qFatal("Invalid metric");
@@ -95,6 +98,9 @@ private:
 
     static float cosine(const Mat &a, const Mat &b)
     {
+        if (a.isContinuous() && b.isContinuous())
+            return ::cosine((const float*)a.data, (const float*)b.data, a.rows * a.cols);
+
         float dot = 0;
         float magA = 0;
         float magB = 0;
@@ -14,13 +14,17 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
 
+static void _train(Distance *distance, const TemplateList *data)
+{
+    distance->train(*data);
+}
+
 /*!
  * \ingroup distances
  * \brief Distances in series.
@@ -38,10 +42,10 @@ class PipeDistance : public Distance
 
     void train(const TemplateList &data)
     {
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         foreach (br::Distance *distance, distances)
-            futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
-        futures.waitForFinished();
+            tasks.start(newTask(_train, distance, &data));
+        tasks.wait();
     }
 
     float compare(const Template &a, const Template &b) const
@@ -14,13 +14,17 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
 
+static void _train(Distance *distance, const TemplateList *data)
+{
+    distance->train(*data);
+}
+
 /*!
  * \ingroup distances
  * \brief Sum match scores across multiple distances
@@ -34,10 +38,10 @@ class SumDistance : public UntrainableDistance
 
     void train(const TemplateList &data)
     {
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         foreach (br::Distance *distance, distances)
-            futures.addFuture(QtConcurrent::run(distance, &Distance::train, data));
-        futures.waitForFinished();
+            tasks.start(newTask(_train, distance, &data));
+        tasks.wait();
     }
 
     float compare(const Template &target, const Template &query) const
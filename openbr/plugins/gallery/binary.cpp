@@ -14,6 +14,8 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <QBuffer>
+#include <QJsonDocument>
 #include <QJsonObject>
 #include <QJsonParseError>
 #include <QUrl>
@@ -24,7 +26,10 @@
 #endif // _WIN32
 
 #include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/mappedfiles.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
+#include <openbr/core/templatecodec.h>
 #include <openbr/universal_template.h>
 
 namespace br
@@ -102,6 +107,7 @@ class BinaryGallery : public Gallery
         }
     }
 
+protected:
     TemplateList readBlock(bool *done)
     {
         readOpen();
@@ -113,7 +119,7 @@ class BinaryGallery : public Gallery
             const Template t = readTemplate();
             if (!t.isEmpty() || !t.file.isNull()) {
                 templates.append(t);
-                templates.last().file.set("progress", position());
+                templates.last().file.set(Metadata::Progress, position());
             }
 
             // Special case for pipes where we want to process data as soon as it is available
@@ -125,6 +131,7 @@ class BinaryGallery : public Gallery
         return templates;
     }
 
+private:
     void write(const Template &t)
     {
         writeOpen();
@@ -187,96 +194,231 @@ BR_REGISTER(Gallery, galGallery)
 /*!
  * \ingroup galleries
  * \brief A contiguous array of br_universal_template.
+ *
+ * With \c mmap the file is memory mapped and the feature vectors of the templates read
+ * reference the mapping instead of being copied, see br::MappedFiles.
+ * With \c index the offsets of all templates are computed and validated when the gallery is opened.
  * \author Josh Klontz \cite jklontz
  */
 class utGallery : public BinaryGallery
 {
     Q_OBJECT
+    Q_PROPERTY(bool mmap READ get_mmap WRITE set_mmap RESET reset_mmap STORED false)
+    Q_PROPERTY(bool index READ get_index WRITE set_index RESET reset_index STORED false)
+    BR_PROPERTY(bool, mmap, false)
+    BR_PROPERTY(bool, index, false)
+
+    const uchar *mapping;
+    qint64 mappingSize, offset;
+    QVector<qint64> offsets; // Populated when index is set
+    int next;
 
     Template readTemplate()
     {
-        Template t;
         br_universal_template ut;
-        if (gallery.read((char*)&ut, sizeof(br_universal_template)) == sizeof(br_universal_template)) {
-            QByteArray data(ut.urlSize + ut.fvSize, Qt::Uninitialized);
-            char *dst = data.data();
-            qint64 bytesNeeded = ut.urlSize + ut.fvSize;
-            while (bytesNeeded > 0) {
-                qint64 bytesRead = gallery.read(dst, bytesNeeded);
-                if (bytesRead <= 0) {
-                    qDebug() << gallery.errorString();
-                    qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(bytesNeeded), int(ut.urlSize + ut.fvSize));
-                }
-                bytesNeeded -= bytesRead;
-                dst += bytesRead;
-            }
+        if (gallery.read((char*)&ut, sizeof(br_universal_template)) != sizeof(br_universal_template)) {
+            if (!gallery.atEnd())
+                qWarning("Failed to read universal template header!");
+            gallery.close();
+            return Template();
+        }
 
-            t.file.set("ImageID", QVariant(QByteArray((const char*)ut.imageID, 16).toHex()));
-            t.file.set("AlgorithmID", ut.algorithmID);
-            t.file.set("URL", QString(data.data()));
-            char *dataStart = data.data() + ut.urlSize;
-            uint32_t dataSize = ut.fvSize;
-            if ((ut.algorithmID <= -1) && (ut.algorithmID >= -3)) {
-                t.file.set("FrontalFace", QRectF(ut.x, ut.y, ut.width, ut.height));
-                uint32_t *rightEyeX = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *rightEyeY = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *leftEyeX = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                uint32_t *leftEyeY = reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-                dataSize -= sizeof(uint32_t)*4;
-                t.file.set("First_Eye", QPointF(*rightEyeX, *rightEyeY));
-                t.file.set("Second_Eye", QPointF(*leftEyeX, *leftEyeY));
+        QByteArray data(sizeof(br_universal_template) + ut.urlSize + ut.fvSize, Qt::Uninitialized);
+        memcpy(data.data(), &ut, sizeof(br_universal_template));
+        char *dst = data.data() + sizeof(br_universal_template);
+        qint64 bytesNeeded = ut.urlSize + ut.fvSize;
+        while (bytesNeeded > 0) {
+            qint64 bytesRead = gallery.read(dst, bytesNeeded);
+            if (bytesRead <= 0) {
+                qDebug() << gallery.errorString();
+                qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(bytesNeeded), int(ut.urlSize + ut.fvSize));
             }
-            else if (ut.algorithmID == 7) {
-                // binary data consisting of a single channel matrix, of a supported type.
-                // 4 element header:
-                // uint16 datatype (single channel opencv datatype code)
-                // uint32 matrix rows
-                // uint32 matrix cols
-                // uint16 matrix depth (max 512)
-                // Followed by serialized data, in row-major order (in r/c), with depth values
-                // for each layer listed in order (i.e. rgb, rgb etc.)
-                // #### NOTE! matlab's default order is col-major, so some work should
-                // be done on the matlab side to make sure that the initial serialization is correct.
-                uint16_t dataType = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint16_t);
-
-                uint32_t matrixRows = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-
-                uint32_t matrixCols = *reinterpret_cast<uint32_t*>(dataStart);
-                dataStart += sizeof(uint32_t);
-
-                uint16_t matrixDepth= *reinterpret_cast<uint16_t*>(dataStart);
-                dataStart += sizeof(uint16_t);
-
-                // Set metadata
-                t.file.set("Label", ut.label);
-                t.file.set("X", ut.x);
-                t.file.set("Y", ut.y);
-                t.file.set("Width", ut.width);
-                t.file.set("Height", ut.height);
-
-                t.append(cv::Mat(matrixRows, matrixCols, CV_MAKETYPE(dataType, matrixDepth), dataStart).clone() /* We don't want a shallow copy! */);
-                return t;
+            bytesNeeded -= bytesRead;
+            dst += bytesRead;
+        }
+
+        return fromUniversalTemplate((const uchar*)data.constData(), true);
+    }
+
+    static Template fromMapping(const uchar *data)
+    {
+        return fromUniversalTemplate(data, false);
+    }
+
+    static void parseMapping(const uchar *data, Template *t)
+    {
+        *t = fromMapping(data);
+    }
+
+    // Parse a serialized br_universal_template, the matrix references data unless copy is set
+    static Template fromUniversalTemplate(const uchar *data, bool copy)
+    {
+        Template t;
+        br_universal_template ut;
+        memcpy(&ut, data, sizeof(br_universal_template)); // data may be unaligned
+        const char *url = (const char*)data + sizeof(br_universal_template);
+
+        t.file.set("ImageID", QVariant(QByteArray((const char*)ut.imageID, 16).toHex()));
+        t.file.set("AlgorithmID", ut.algorithmID);
+        t.file.set("URL", QString(url));
+        const char *dataStart = url + ut.urlSize;
+        uint32_t dataSize = ut.fvSize;
+        if ((ut.algorithmID <= -1) && (ut.algorithmID >= -3)) {
+            t.file.set("FrontalFace", QRectF(ut.x, ut.y, ut.width, ut.height));
+            const uint32_t *rightEyeX = reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+            const uint32_t *rightEyeY = reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+            const uint32_t *leftEyeX = reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+            const uint32_t *leftEyeY = reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+            dataSize -= sizeof(uint32_t)*4;
+            t.file.set("First_Eye", QPointF(*rightEyeX, *rightEyeY));
+            t.file.set("Second_Eye", QPointF(*leftEyeX, *leftEyeY));
+        }
+        else if (ut.algorithmID == 7) {
+            // binary data consisting of a single channel matrix, of a supported type.
+            // 4 element header:
+            // uint16 datatype (single channel opencv datatype code)
+            // uint32 matrix rows
+            // uint32 matrix cols
+            // uint16 matrix depth (max 512)
+            // Followed by serialized data, in row-major order (in r/c), with depth values
+            // for each layer listed in order (i.e. rgb, rgb etc.)
+            // #### NOTE! matlab's default order is col-major, so some work should
+            // be done on the matlab side to make sure that the initial serialization is correct.
+            uint16_t dataType = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint16_t);
+
+            uint32_t matrixRows = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+
+            uint32_t matrixCols = *reinterpret_cast<const uint32_t*>(dataStart);
+            dataStart += sizeof(uint32_t);
+
+            uint16_t matrixDepth= *reinterpret_cast<const uint16_t*>(dataStart);
+            dataStart += sizeof(uint16_t);
+
+            // Set metadata
+            t.file.set(Metadata::Label, ut.label);
+            t.file.set("X", ut.x);
+            t.file.set("Y", ut.y);
+            t.file.set("Width", ut.width);
+            t.file.set("Height", ut.height);
+
+            const cv::Mat m(matrixRows, matrixCols, CV_MAKETYPE(dataType, matrixDepth), (void*)dataStart);
+            t.append(copy ? m.clone() : m);
+            return t;
+        }
+        else {
+            t.file.set("X", ut.x);
+            t.file.set("Y", ut.y);
+            t.file.set("Width", ut.width);
+            t.file.set("Height", ut.height);
+        }
+        t.file.set(Metadata::Label, ut.label);
+        const cv::Mat m(1, dataSize, CV_8UC1, (void*)dataStart);
+        t.append(copy ? m.clone() : m);
+        return t;
+    }
+
+    // Offset of the template following the one at offset, or -1 if there isn't a complete header at offset
+    qint64 nextOffset(qint64 offset) const
+    {
+        br_universal_template ut;
+        if (offset + qint64(sizeof(br_universal_template)) > mappingSize) {
+            qWarning("Failed to read universal template header!");
+            return -1;
+        }
+        memcpy(&ut, mapping + offset, sizeof(br_universal_template));
+
+        const qint64 end = offset + sizeof(br_universal_template) + ut.urlSize + ut.fvSize;
+        if (end > mappingSize)
+            qFatal("Unexepected EOF while reading universal template data, needed: %d more of: %d bytes.", int(end - mappingSize), int(ut.urlSize + ut.fvSize));
+        return end;
+    }
+
+    void mapOpen()
+    {
+        if (mappingSize >= 0)
+            return;
+
+        mapping = MappedFiles::map(file, &mappingSize);
+        if (index) {
+            qint64 at = 0;
+            while (at < mappingSize) {
+                const qint64 end = nextOffset(at);
+                if (end < 0)
+                    break;
+                offsets.append(at);
+                at = end;
             }
-            else {
-                t.file.set("X", ut.x);
-                t.file.set("Y", ut.y);
-                t.file.set("Width", ut.width);
-                t.file.set("Height", ut.height);
+            mappingSize = at; // Excludes an incomplete trailing header
+        }
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        // Pipes can't be mapped
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::readBlock(done);
+
+        mapOpen();
+        if (offset >= mappingSize) {
+            offset = 0;
+            next = 0;
+        }
+
+        QList<const uchar*> block;
+        QList<qint64> ends;
+        while ((block.size() < readBlockSize) && (offset < mappingSize)) {
+            const qint64 end = index ? ((next+1 < offsets.size()) ? offsets[next+1] : mappingSize)
+                                     : nextOffset(offset);
+            if (end < 0) {
+                offset = mappingSize;
+                break;
             }
-            t.file.set("Label", ut.label);
-            t.append(cv::Mat(1, dataSize, CV_8UC1, dataStart).clone() /* We don't want a shallow copy! */);
+            block.append(mapping + offset);
+            ends.append(end);
+            offset = end;
+            next++;
+        }
+
+        // Parsing the metadata dominates once the feature vectors aren't copied
+        TemplateList templates;
+        if (Globals->parallelism) {
+            templates.reserve(block.size());
+            for (int i=0; i<block.size(); i++)
+                templates.append(Template());
+            Scheduler::Group tasks;
+            for (int i=0; i<block.size(); i++)
+                tasks.start(newTask(&utGallery::parseMapping, block[i], &templates[i]));
+            tasks.wait();
         } else {
-            if (!gallery.atEnd())
-                qWarning("Failed to read universal template header!");
-            gallery.close();
+            foreach (const uchar *data, block)
+                templates.append(fromMapping(data));
         }
-        return t;
+        for (int i=0; i<templates.size(); i++)
+            templates[i].file.set(Metadata::Progress, ends[i]);
+
+        *done = (offset >= mappingSize);
+        return templates;
+    }
+
+    qint64 totalSize()
+    {
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::totalSize();
+        mapOpen();
+        return mappingSize;
+    }
+
+    qint64 position()
+    {
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::position();
+        return offset;
     }
 
     void writeTemplate(const Template &t)
@@ -318,7 +460,7 @@ class utGallery : public BinaryGallery
             width = t.file.get<uint32_t>("Width", 0);
             height = t.file.get<uint32_t>("Height", 0);
         }
-        const uint32_t label = t.file.get<uint32_t>("Label", 0);
+        const uint32_t label = t.file.get<uint32_t>(Metadata::Label, 0);
 
         gallery.write(imageID);
         gallery.write((const char*) &algorithmID, sizeof(int32_t));
@@ -341,10 +483,295 @@ class utGallery : public BinaryGallery
             gallery.write((const char*) t.m().data, signatureSize);
         }
     }
+
+public:
+    utGallery() : mapping(NULL), mappingSize(-1), offset(0), next(0) {}
 };
 
 BR_REGISTER(Gallery, utGallery)
 
+/*!
+ * \ingroup galleries
+ * \brief Templates in the compact binary encoding of br::TemplateCodec.
+ *
+ * Metadata keys are interned and common metadata types have fixed width encodings,
+ * so reading and writing is cheaper than for .gal galleries.
+ * With \c mmap the file is memory mapped and the matrices of the templates read
+ * reference the mapping instead of being copied, see br::MappedFiles.
+ * Compatible with TemplateList::fromBuffer.
+ */
+class brtGallery : public BinaryGallery
+{
+    Q_OBJECT
+    Q_PROPERTY(bool mmap READ get_mmap WRITE set_mmap RESET reset_mmap STORED false)
+    BR_PROPERTY(bool, mmap, false)
+
+    TemplateCodec reader, writer;
+    const uchar *mapping;
+    qint64 mappingSize, offset;
+
+    bool readFully(char *data, qint64 size)
+    {
+        while (size > 0) {
+            const qint64 bytesRead = gallery.read(data, size);
+            if (bytesRead <= 0)
+                return false;
+            size -= bytesRead;
+            data += bytesRead;
+        }
+        return true;
+    }
+
+    Template readTemplate()
+    {
+        QByteArray record;
+        forever {
+            record.resize(TemplateCodec::HeaderSize);
+            if (!readFully(record.data(), TemplateCodec::HeaderSize)) {
+                if (!gallery.atEnd())
+                    qWarning("Failed to read brt record header!");
+                return Template();
+            }
+
+            const qint64 size = TemplateCodec::recordSize(record.constData());
+            if (size < 0)
+                qFatal("Invalid brt gallery: %s", qPrintable(file.name));
+            record.resize(size);
+            if (!readFully(record.data() + TemplateCodec::HeaderSize, size - TemplateCodec::HeaderSize))
+                qFatal("Unexpected EOF while reading brt gallery: %s", qPrintable(file.name));
+
+            // Segment and key records only update the reader
+            Template t;
+            if (reader.read(record.constData(), t, true))
+                return t;
+        }
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        // Pipes can't be mapped
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::readBlock(done);
+
+        if (mappingSize < 0)
+            mapping = MappedFiles::map(file, &mappingSize);
+        if (offset >= mappingSize)
+            offset = 0;
+
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && (offset + TemplateCodec::HeaderSize <= mappingSize)) {
+            const char *record = (const char*)mapping + offset;
+            const qint64 size = TemplateCodec::recordSize(record);
+            if ((size < 0) || (offset + size > mappingSize))
+                qFatal("Invalid brt gallery: %s", qPrintable(file.name));
+            offset += size;
+
+            Template t;
+            if (reader.read(record, t, false)) {
+                t.file.set(Metadata::Progress, offset);
+                templates.append(t);
+            }
+        }
+        if (offset + TemplateCodec::HeaderSize > mappingSize)
+            offset = mappingSize;
+
+        *done = (offset >= mappingSize);
+        return templates;
+    }
+
+    qint64 totalSize()
+    {
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::totalSize();
+        if (mappingSize < 0)
+            mapping = MappedFiles::map(file, &mappingSize);
+        return mappingSize;
+    }
+
+    qint64 position()
+    {
+        if (!mmap || gallery.isOpen())
+            return BinaryGallery::position();
+        return offset;
+    }
+
+    void writeTemplate(const Template &t)
+    {
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        QByteArray records;
+        writer.write(t.file.fte ? Template(t.file) : t, records); // only write metadata for failure to enroll
+        gallery.write(records);
+    }
+
+public:
+    brtGallery() : mapping(NULL), mappingSize(-1), offset(0) {}
+};
+
+BR_REGISTER(Gallery, brtGallery)
+
+/*!
+ * \ingroup galleries
+ * \brief Fixed-stride feature vectors with a separate metadata table.
+ *
+ * Templates must have a single continuous matrix of the same size and type, or no matrix at all (e.g. failures to enroll).
+ * The file is a 64-byte header, followed by the feature vectors as one contiguous row-major block,
+ * followed by the serialized br::File of every template.
+ * The file is memory mapped for reading, see br::MappedFiles,
+ * and the matrices of consecutive templates are consecutive rows of the feature vector block.
+ * br::Distance compares such template lists as one matrix without copying them.
+ */
+class fvGallery : public Gallery
+{
+    Q_OBJECT
+
+    struct Header
+    {
+        char magic[4]; // "BRFV"
+        quint32 version;
+        quint32 rows, cols;
+        qint32 type;
+        quint32 reserved;
+        quint64 templates;
+        quint64 vectors; // Templates with a matrix
+        quint64 metadataOffset;
+        char padding[16];
+    };
+
+    Header header;
+    QFile gallery;
+    QBuffer metadataBuffer;
+    QDataStream metadata;
+
+    const uchar *mapping;
+    qint64 mappingSize, index, row;
+
+    ~fvGallery()
+    {
+        if (!gallery.isOpen())
+            return;
+
+        // Metadata table and final header
+        header.metadataOffset = gallery.pos();
+        gallery.write(metadataBuffer.data());
+        gallery.seek(0);
+        gallery.write((const char*)&header, sizeof(Header));
+    }
+
+    size_t stride() const
+    {
+        return size_t(header.rows) * header.cols * CV_ELEM_SIZE(header.type);
+    }
+
+    void readOpen()
+    {
+        if (mappingSize >= 0)
+            return;
+
+        mapping = MappedFiles::map(file, &mappingSize);
+        if (mappingSize < qint64(sizeof(Header)))
+            qFatal("Invalid fv gallery: %s", qPrintable(file.name));
+        memcpy(&header, mapping, sizeof(Header));
+        if ((memcmp(header.magic, "BRFV", 4) != 0) || (header.version != 1) ||
+            (header.metadataOffset != sizeof(Header) + header.vectors * stride()) || (header.metadataOffset > quint64(mappingSize)))
+            qFatal("Invalid fv gallery: %s", qPrintable(file.name));
+
+        metadataBuffer.setData(QByteArray::fromRawData((const char*)mapping + header.metadataOffset, mappingSize - header.metadataOffset));
+        metadataBuffer.open(QBuffer::ReadOnly);
+        metadata.setDevice(&metadataBuffer);
+    }
+
+    void writeOpen()
+    {
+        if (gallery.isOpen())
+            return;
+
+        gallery.setFileName(file);
+        QtUtils::touchDir(gallery);
+        if (!gallery.open(QFile::WriteOnly))
+            qFatal("Can't open gallery: %s for writing", qPrintable(gallery.fileName()));
+
+        memset(&header, 0, sizeof(Header));
+        memcpy(header.magic, "BRFV", 4);
+        header.version = 1;
+        gallery.write((const char*)&header, sizeof(Header)); // Placeholder until the gallery is closed
+
+        metadataBuffer.open(QBuffer::WriteOnly);
+        metadata.setDevice(&metadataBuffer);
+    }
+
+    TemplateList readBlock(bool *done)
+    {
+        readOpen();
+        if (index == qint64(header.templates)) {
+            index = row = 0;
+            metadataBuffer.seek(0);
+        }
+
+        const uchar *vectors = mapping + sizeof(Header);
+        TemplateList templates;
+        while ((templates.size() < readBlockSize) && (index < qint64(header.templates))) {
+            bool vector;
+            File f;
+            metadata >> vector >> f;
+            if (metadata.status() != QDataStream::Ok)
+                qFatal("Failed to read metadata from fv gallery: %s", qPrintable(file.name));
+
+            Template t(f);
+            if (vector)
+                t.append(cv::Mat(header.rows, header.cols, header.type, (void*)(vectors + row++ * stride())));
+            t.file.set(Metadata::Progress, ++index);
+            templates.append(t);
+        }
+
+        *done = (index == qint64(header.templates));
+        return templates;
+    }
+
+    void write(const Template &t)
+    {
+        writeOpen();
+        if (t.isEmpty() && t.file.isNull())
+            return;
+
+        const bool vector = !t.isEmpty() && !t.file.fte;
+        if (vector) {
+            const cv::Mat &m = t.m();
+            if ((t.size() != 1) || !m.isContinuous())
+                qFatal("fvGallery requires templates with a single continuous matrix.");
+            if (header.vectors == 0) {
+                header.rows = m.rows;
+                header.cols = m.cols;
+                header.type = m.type();
+            } else if ((m.rows != int(header.rows)) || (m.cols != int(header.cols)) || (m.type() != header.type)) {
+                qFatal("fvGallery requires matrices of the same size and type.");
+            }
+            gallery.write((const char*)m.data, stride());
+            header.vectors++;
+        }
+
+        metadata << vector << t.file;
+        header.templates++;
+    }
+
+    qint64 totalSize()
+    {
+        readOpen();
+        return header.templates;
+    }
+
+    qint64 position()
+    {
+        return index;
+    }
+
+public:
+    fvGallery() : mapping(NULL), mappingSize(-1), index(0), row(0) {}
+};
+
+BR_REGISTER(Gallery, fvGallery)
+
 /*!
  * \ingroup galleries
  * \brief Newline-separated URLs.
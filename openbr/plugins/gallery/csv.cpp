@@ -117,7 +117,7 @@ class csvGallery : public FileGallery
                 else        fi.set(headers[j], words[j]);
             }
             templates.append(fi);
-            templates.last().file.set("progress", f.pos());
+            templates.last().file.set(Metadata::Progress, f.pos());
         }
         *done = f.atEnd();
 
@@ -14,10 +14,14 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
+
+#include <QDirIterator>
+#include <QMutex>
+#include <QRegExp>
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 namespace br
 {
@@ -58,13 +62,16 @@ class EmptyGallery : public Gallery
 
         // Add immediate subfolders
         QDir dir(file);
-        QList< QFuture<TemplateList> > futures;
-        foreach (const QString &folder, QtUtils::naturalSort(dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))) {
-            const QDir subdir = dir.absoluteFilePath(folder);
-            futures.append(QtConcurrent::run(&EmptyGallery::getTemplates, subdir));
-        }
-        foreach (const QFuture<TemplateList> &future, futures)
-            templates.append(future.result());
+        const QStringList folders = QtUtils::naturalSort(dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot));
+        QList<TemplateList> subdirTemplates;
+        for (int i=0; i<folders.size(); i++)
+            subdirTemplates.append(TemplateList());
+        Scheduler::Group tasks;
+        for (int i=0; i<folders.size(); i++)
+            tasks.start(newTask(&EmptyGallery::listTemplates, QDir(dir.absoluteFilePath(folders[i])), &subdirTemplates[i]));
+        tasks.wait();
+        foreach (const TemplateList &subdir, subdirTemplates)
+            templates.append(subdir);
 
         // Add root folder
         foreach (const QString &fileName, QtUtils::getFiles(file.name, false))
@@ -80,7 +87,7 @@ class EmptyGallery : public Gallery
             }
         }
 
-        for (int i = 0; i < templates.size(); i++) templates[i].file.set("progress", i);
+        for (int i = 0; i < templates.size(); i++) templates[i].file.set(Metadata::Progress, i);
 
         return templates;
     }
@@ -110,6 +117,11 @@ class EmptyGallery : public Gallery
         return gallerySize;
     }
 
+    static void listTemplates(QDir dir, TemplateList *templates)
+    {
+        *templates = getTemplates(dir);
+    }
+
     static TemplateList getTemplates(const QDir &dir)
     {
         const QStringList files = QtUtils::getFiles(dir, true);
@@ -43,7 +43,7 @@ class flatGallery : public FileGallery
 
             if (!line.isEmpty()) {
                 templates.append(File(QString::fromLocal8Bit(line).trimmed()));
-                templates.last().file.set("progress", this->position());
+                templates.last().file.set(Metadata::Progress, this->position());
             }
 
             if (f.atEnd()) {
@@ -69,7 +69,7 @@ class memGallery : public Gallery
     {
         TemplateList templates = MemoryGalleries::galleries[file].mid(block*readBlockSize, readBlockSize);
         for (qint64 i = 0; i < templates.size();i++) {
-            templates[i].file.set("progress", i + block * readBlockSize);
+            templates[i].file.set(Metadata::Progress, i + block * readBlockSize);
         }
 
         *done = (templates.size() < readBlockSize);
@@ -114,7 +114,7 @@ FileList FileList::fromGallery(const File &rFile, bool cache)
 
     TemplateList templates;
     // OK we read the data in some form, does the gallery type containing matrices?
-    if ((QStringList() << "gal" << "mem" << "template" << "ut").contains(file.suffix())) {
+    if ((QStringList() << "gal" << "mem" << "template" << "ut" << "fv").contains(file.suffix())) {
         // Retrieve it block by block, dropping matrices from read templates.
         QScopedPointer<Gallery> gallery(Gallery::make(file));
         gallery->set_readBlockSize(10);
@@ -65,7 +65,7 @@ class txtGallery : public FileGallery
                 int splitIndex = line.lastIndexOf(' ');
                 if (splitIndex == -1) templates.append(File(line));
                 else                  templates.append(File(line.mid(0, splitIndex), line.mid(splitIndex+1)));
-                templates.last().file.set("progress", this->position());
+                templates.last().file.set(Metadata::Progress, this->position());
             }
 
             if (f.atEnd()) {
@@ -73,7 +73,7 @@ public:
         // problems later.
         output.m() = temp.clone();
 
-        output.file.set("progress", idx);
+        output.file.set(Metadata::Progress, idx);
         idx++;
 
         TemplateList rVal;
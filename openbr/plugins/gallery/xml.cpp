@@ -112,7 +112,7 @@ class xmlGallery : public FileGallery
                             }
                         }
                         templates.last().file.setRects(rects);
-                        templates.last().file.set("progress", f.pos());
+                        templates.last().file.set(Metadata::Progress, f.pos());
 
                         // we read another complete template
                         count++;
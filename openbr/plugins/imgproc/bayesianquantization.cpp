@@ -14,12 +14,11 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
 #include <openbr/core/opencvutils.h>
 #include <openbr/core/qtutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -100,10 +99,10 @@ class BayesianQuantizationTransform : public Transform
 
         thresholds = QVector<float>(256*data.cols);
 
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&BayesianQuantizationTransform::computeThresholds, data.col(i), labels, &thresholds.data()[i*256]));
-        futures.waitForFinished();
+            tasks.start(newTask(&BayesianQuantizationTransform::computeThresholds, data.col(i), labels, &thresholds.data()[i*256]));
+        tasks.wait();
     }
 
     void project(const Template &src, Template &dst) const
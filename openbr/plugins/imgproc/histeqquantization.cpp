@@ -14,10 +14,9 @@
  * limitations under the License.                                            *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-#include <QtConcurrent>
-
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -48,10 +47,10 @@ class HistEqQuantizationTransform : public Transform
         const Mat data = OpenCVUtils::toMat(src.data());
         thresholds = QVector<float>(256*data.cols);
 
-        QFutureSynchronizer<void> futures;
+        Scheduler::Group tasks;
         for (int i=0; i<data.cols; i++)
-            futures.addFuture(QtConcurrent::run(&HistEqQuantizationTransform::computeThresholds, data.col(i), &thresholds.data()[i*256]));
-        futures.waitForFinished();
+            tasks.start(newTask(&HistEqQuantizationTransform::computeThresholds, data.col(i), &thresholds.data()[i*256]));
+        tasks.wait();
     }
 
     void project(const Template &src, Template &dst) const
@@ -19,6 +19,9 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/highgui/highgui_c.h>
 #include <limits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <openbr/plugins/openbr_internal.h>
 
@@ -27,11 +30,100 @@ using namespace cv;
 namespace br
 {
 
+// Codes of count pixels starting at c, before the lookup table, comparing neighbors radius rows and columns away
+template <typename T>
+static void codeRowScalar(const T *c, int step, int radius, int count, uchar *codes)
+{
+    const T *u = c - radius*step, *d = c + radius*step;
+    for (int i=0; i<count; i++) {
+        const T v = c[i];
+        codes[i] = (u[i-radius] >= v ? 128 : 0) |
+                   (u[i       ] >= v ? 64  : 0) |
+                   (u[i+radius] >= v ? 32  : 0) |
+                   (c[i+radius] >= v ? 16  : 0) |
+                   (d[i+radius] >= v ? 8   : 0) |
+                   (d[i       ] >= v ? 4   : 0) |
+                   (d[i-radius] >= v ? 2   : 0) |
+                   (c[i-radius] >= v ? 1   : 0);
+    }
+}
+
+#ifdef __SSE2__
+
+static inline __m128i greaterEqual(const uchar *n, __m128i v, char bit)
+{
+    const __m128i neighbor = _mm_loadu_si128((const __m128i*)n);
+    return _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(neighbor, v), neighbor), _mm_set1_epi8(bit));
+}
+
+static void codeRow(const uchar *c, int step, int radius, int count, uchar *codes)
+{
+    const uchar *u = c - radius*step, *d = c + radius*step;
+    int i = 0;
+    for (; i+16<=count; i+=16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(c+i));
+        __m128i code = greaterEqual(u+i-radius, v, char(128));
+        code = _mm_or_si128(code, greaterEqual(u+i,        v, 64));
+        code = _mm_or_si128(code, greaterEqual(u+i+radius, v, 32));
+        code = _mm_or_si128(code, greaterEqual(c+i+radius, v, 16));
+        code = _mm_or_si128(code, greaterEqual(d+i+radius, v, 8));
+        code = _mm_or_si128(code, greaterEqual(d+i,        v, 4));
+        code = _mm_or_si128(code, greaterEqual(d+i-radius, v, 2));
+        code = _mm_or_si128(code, greaterEqual(c+i-radius, v, 1));
+        _mm_storeu_si128((__m128i*)(codes+i), code);
+    }
+    codeRowScalar(c+i, step, radius, count-i, codes+i);
+}
+
+// Codes of four pixels as 32-bit lanes
+static inline __m128i codeQuad(const float *c, const float *u, const float *d, int radius)
+{
+    const __m128 v = _mm_loadu_ps(c);
+    __m128i code =               _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(u-radius), v)), _mm_set1_epi32(128));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(u),        v)), _mm_set1_epi32(64)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(u+radius), v)), _mm_set1_epi32(32)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(c+radius), v)), _mm_set1_epi32(16)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(d+radius), v)), _mm_set1_epi32(8)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(d),        v)), _mm_set1_epi32(4)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(d-radius), v)), _mm_set1_epi32(2)));
+    return _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(_mm_cmpge_ps(_mm_loadu_ps(c-radius), v)), _mm_set1_epi32(1)));
+}
+
+static void codeRow(const float *c, int step, int radius, int count, uchar *codes)
+{
+    const float *u = c - radius*step, *d = c + radius*step;
+    int i = 0;
+    for (; i+16<=count; i+=16) {
+        const __m128i low  = _mm_packs_epi32(codeQuad(c+i,   u+i,   d+i,   radius), codeQuad(c+i+4,  u+i+4,  d+i+4,  radius));
+        const __m128i high = _mm_packs_epi32(codeQuad(c+i+8, u+i+8, d+i+8, radius), codeQuad(c+i+12, u+i+12, d+i+12, radius));
+        _mm_storeu_si128((__m128i*)(codes+i), _mm_packus_epi16(low, high));
+    }
+    codeRowScalar(c+i, step, radius, count-i, codes+i);
+}
+
+#else // __SSE2__
+
+static void codeRow(const uchar *c, int step, int radius, int count, uchar *codes)
+{
+    codeRowScalar(c, step, radius, count, codes);
+}
+
+static void codeRow(const float *c, int step, int radius, int count, uchar *codes)
+{
+    codeRowScalar(c, step, radius, count, codes);
+}
+
+#endif // __SSE2__
+
 /*!
  * \ingroup transforms
  * \brief Ahonen, T.; Hadid, A.; Pietikainen, M.;
  * "Face Description with Local Binary Patterns: Application to Face Recognition"
  * Pattern Analysis and Machine Intelligence, IEEE Transactions, vol.28, no.12, pp.2037-2041, Dec. 2006
+ *
+ * 8-bit and 32-bit floating point images are processed without conversion, a row at a time.
+ * If \em cellWidth is set, the codes are histogrammed into cells as they are computed instead of output as an image,
+ * e.g. <tt>LBP(1,2,cellWidth=8,cellHeight=8,cellWidthStep=6,cellHeightStep=6)</tt> is equivalent to <tt>LBP(1,2)+RectRegions(8,8,6,6)+Hist(59)</tt>.
  * \author Josh Klontz \cite jklontz
  */
 class LBPTransform : public UntrainableTransform
@@ -40,9 +132,17 @@ class LBPTransform : public UntrainableTransform
     Q_PROPERTY(int radius READ get_radius WRITE set_radius RESET reset_radius STORED false)
     Q_PROPERTY(int maxTransitions READ get_maxTransitions WRITE set_maxTransitions RESET reset_maxTransitions STORED false)
     Q_PROPERTY(bool rotationInvariant READ get_rotationInvariant WRITE set_rotationInvariant RESET reset_rotationInvariant STORED false)
+    Q_PROPERTY(int cellWidth READ get_cellWidth WRITE set_cellWidth RESET reset_cellWidth STORED false)
+    Q_PROPERTY(int cellHeight READ get_cellHeight WRITE set_cellHeight RESET reset_cellHeight STORED false)
+    Q_PROPERTY(int cellWidthStep READ get_cellWidthStep WRITE set_cellWidthStep RESET reset_cellWidthStep STORED false)
+    Q_PROPERTY(int cellHeightStep READ get_cellHeightStep WRITE set_cellHeightStep RESET reset_cellHeightStep STORED false)
     BR_PROPERTY(int, radius, 1)
     BR_PROPERTY(int, maxTransitions, 8)
     BR_PROPERTY(bool, rotationInvariant, false)
+    BR_PROPERTY(int, cellWidth, 0)
+    BR_PROPERTY(int, cellHeight, 0)
+    BR_PROPERTY(int, cellWidthStep, -1)
+    BR_PROPERTY(int, cellHeightStep, -1)
 
     uchar lut[256];
     uchar null;
@@ -97,28 +197,82 @@ class LBPTransform : public UntrainableTransform
                 lut[i] = null; // Set to null id
     }
 
-    void project(const Template &src, Template &dst) const
+    // Looked up codes of row r, null within radius of the border
+    template <typename T>
+    void codes(const Mat &m, int r, uchar *row) const
+    {
+        const int count = m.cols - 2*radius;
+        if ((r < radius) || (r >= m.rows - radius) || (count <= 0)) {
+            memset(row, null, m.cols);
+            return;
+        }
+
+        memset(row, null, radius);
+        memset(row + m.cols - radius, null, radius);
+        codeRow(m.ptr<T>(r) + radius, int(m.step1()), radius, count, row + radius);
+        for (int i=radius; i<m.cols-radius; i++)
+            row[i] = lut[row[i]];
+    }
+
+    template <typename T>
+    void image(const Mat &m, Template &dst) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
         Mat n(m.rows, m.cols, CV_8UC1);
-        n = null; // Initialize to NULL LBP pattern
-
-        const float *p = (const float*)m.ptr();
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  =     (p[(r+0*radius)*m.cols+c+0*radius]);
-                n.at<uchar>(r, c) = lut[(p[(r-1*radius)*m.cols+c-1*radius] >= cval ? 128 : 0) |
-                                        (p[(r-1*radius)*m.cols+c+0*radius] >= cval ? 64  : 0) |
-                                        (p[(r-1*radius)*m.cols+c+1*radius] >= cval ? 32  : 0) |
-                                        (p[(r+0*radius)*m.cols+c+1*radius] >= cval ? 16  : 0) |
-                                        (p[(r+1*radius)*m.cols+c+1*radius] >= cval ? 8   : 0) |
-                                        (p[(r+1*radius)*m.cols+c+0*radius] >= cval ? 4   : 0) |
-                                        (p[(r+1*radius)*m.cols+c-1*radius] >= cval ? 2   : 0) |
-                                        (p[(r+0*radius)*m.cols+c-1*radius] >= cval ? 1   : 0)];
+        for (int r=0; r<m.rows; r++)
+            codes<T>(m, r, n.ptr(r));
+        dst += n;
+    }
+
+    // Histograms of cells in the order of RectRegions, one row of counts per cell
+    template <typename T>
+    void cells(const Mat &m, Template &dst) const
+    {
+        const int cellHeight = this->cellHeight > 0 ? this->cellHeight : cellWidth;
+        const int widthStep = cellWidthStep == -1 ? cellWidth : cellWidthStep;
+        const int heightStep = cellHeightStep == -1 ? cellHeight : cellHeightStep;
+        const int xCells = m.cols >= cellWidth ? (m.cols - cellWidth) / widthStep + 1 : 0;
+        const int yCells = m.rows >= cellHeight ? (m.rows - cellHeight) / heightStep + 1 : 0;
+        const int bins = null + 1;
+
+        Mat counts(xCells * yCells, bins, CV_32SC1, Scalar(0));
+        std::vector<uchar> row(m.cols);
+        const int rows = yCells > 0 ? (yCells-1) * heightStep + cellHeight : 0;
+        for (int r=0; r<rows; r++) {
+            codes<T>(m, r, &row[0]);
+
+            // Cells containing row r
+            const int yBegin = r < cellHeight ? 0 : (r - cellHeight) / heightStep + 1;
+            const int yEnd = std::min(yCells, r / heightStep + 1);
+            for (int x=0; x<xCells; x++) {
+                const uchar *cellCodes = &row[x * widthStep];
+                for (int y=yBegin; y<yEnd; y++) {
+                    int *hist = counts.ptr<int>(x * yCells + y);
+                    for (int i=0; i<cellWidth; i++)
+                        hist[cellCodes[i]]++;
+                }
             }
         }
 
-        dst += n;
+        for (int i=0; i<counts.rows; i++) {
+            Mat hist;
+            counts.row(i).convertTo(hist, CV_32F);
+            dst += hist;
+        }
+    }
+
+    void project(const Template &src, Template &dst) const
+    {
+        Mat m = src.m(); assert(m.channels() == 1);
+        if ((m.depth() != CV_8U) && (m.depth() != CV_32F))
+            m.convertTo(m, CV_32F);
+
+        if (cellWidth > 0) {
+            if (m.depth() == CV_8U) cells<uchar>(m, dst);
+            else                    cells<float>(m, dst);
+        } else {
+            if (m.depth() == CV_8U) image<uchar>(m, dst);
+            else                    image<float>(m, dst);
+        }
     }
 };
 
@@ -52,61 +52,43 @@ class LTPTransform : public UntrainableTransform
         }
     }
 
-    void project(const Template &src, Template &dst) const
+    // Codes of count pixels starting at c, comparing neighbors radius rows and columns away
+    template <typename T>
+    void codeRow(const T *c, int step, int count, unsigned short *codes) const
     {
-        Mat m; src.m().convertTo(m, CV_32F); assert(m.isContinuous() && (m.channels() == 1));
-
-        Mat n(m.rows, m.cols, CV_16U);
-        n = null; 
-        float thresholdNeg = -1.0 * threshold; //compute once (can move to init)
-
-        const float *p = (const float*)m.ptr();
-        float diff;
-        for (int r=radius; r<m.rows-radius; r++) {
-            for (int c=radius; c<m.cols-radius; c++) {
-                const float cval  = (p[(r+0*radius)*m.cols+c+0*radius]);
-
-                diff = p[(r-1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) = lut[0][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) = lut[0][1];
-                else                            n.at<unsigned short>(r,c) = lut[0][2];
-
-                diff = p[(r-1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[1][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[1][1];
-                else                            n.at<unsigned short>(r,c) += lut[1][2];
-
-                diff = p[(r-1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[2][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[2][1];
-                else                            n.at<unsigned short>(r,c) += lut[2][2];
-
-                diff = p[(r+0*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[3][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[3][1];
-                else                            n.at<unsigned short>(r,c) += lut[3][2];
-
-                diff = p[(r+1*radius)*m.cols+c+1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[4][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[4][1];
-                else                            n.at<unsigned short>(r,c) += lut[4][2];
+        const T *u = c - radius*step, *d = c + radius*step;
+        const float thresholdNeg = -1.0 * threshold;
+        const int offsets[8][2] = { {-1, -1}, {-1, 0}, {-1, 1}, {0, 1}, {1, 1}, {1, 0}, {1, -1}, {0, -1} };
+        for (int i=0; i<count; i++) {
+            const float cval = c[i];
+            unsigned short code = 0;
+            for (int j=0; j<8; j++) {
+                const T *row = offsets[j][0] < 0 ? u : (offsets[j][0] > 0 ? d : c);
+                const float diff = row[i + offsets[j][1]*radius] - cval;
+                code += lut[j][diff > threshold ? 0 : (diff < thresholdNeg ? 1 : 2)];
+            }
+            codes[i] = code;
+        }
+    }
 
-                diff = p[(r+1*radius)*m.cols+c+0*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[5][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[5][1];
-                else                            n.at<unsigned short>(r,c) += lut[5][2];
+    template <typename T>
+    void codes(const Mat &m, Mat &n) const
+    {
+        for (int r=radius; r<m.rows-radius; r++)
+            codeRow(m.ptr<T>(r) + radius, int(m.step1()), m.cols - 2*radius, n.ptr<unsigned short>(r) + radius);
+    }
 
-                diff = p[(r+1*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[6][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[6][1];
-                else                            n.at<unsigned short>(r,c) += lut[6][2];
+    void project(const Template &src, Template &dst) const
+    {
+        // 8-bit and 32-bit floating point images are read without conversion
+        Mat m = src.m(); assert(m.channels() == 1);
+        if ((m.depth() != CV_8U) && (m.depth() != CV_32F))
+            m.convertTo(m, CV_32F);
 
-                diff = p[(r+0*radius)*m.cols+c-1*radius] - cval;
-                if      (diff > threshold)      n.at<unsigned short>(r,c) += lut[7][0];
-                else if (diff < thresholdNeg)   n.at<unsigned short>(r,c) += lut[7][1];
-                else                            n.at<unsigned short>(r,c) += lut[7][2];
-            }
-        }
+        Mat n(m.rows, m.cols, CV_16U);
+        n = null;
+        if (m.depth() == CV_8U) codes<uchar>(m, n);
+        else                    codes<float>(m, n);
 
         dst += n;
     }
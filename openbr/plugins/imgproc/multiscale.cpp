@@ -18,6 +18,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/opencvutils.h>
+#include <openbr/core/scheduler.h>
 
 using namespace cv;
 
@@ -107,7 +108,10 @@ static TemplateList cropTrainingSamples(const TemplateList &data, const float as
 
 /*!
  * \ingroup transforms
- * \brief Document me
+ * \brief Applies a detector like SlidingWindowTransform to the image at multiple scales.
+ *
+ * Unless \em takeLargestScale is set the scales are resized and projected in parallel,
+ * and the rects and \c Confidences found at each are merged in order of decreasing scale.
  * \author Austin Blanton \cite imaus10
  */
 class BuildScalesTransform : public Transform
@@ -135,6 +139,26 @@ private:
     int windowHeight;
     bool skipProject;
 
+    class ScaleTask : public QRunnable
+    {
+        const Transform *transform;
+        const Template &src;
+        float scale;
+        Template &dst;
+
+    public:
+        ScaleTask(const Transform *transform, const Template &src, float scale, Template &dst)
+            : transform(transform), src(src), scale(scale), dst(dst) {}
+
+        void run()
+        {
+            Template scaleImg(src.file, Mat());
+            scaleImg.file.set("scale", scale);
+            resize(src, scaleImg, Size(qRound(src.m().cols / scale), qRound(src.m().rows / scale)));
+            transform->project(scaleImg, dst);
+        }
+    };
+
     void train(const TemplateList &data)
     {
         skipProject = true;
@@ -170,14 +194,41 @@ private:
         else
             startScale = qRound((float) cols / (float) windowWidth);
 
-        for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor)) {
-            Template scaleImg(dst.file, Mat());
-            scaleImg.file.set("scale", scale);
-            resize(src, scaleImg, Size(qRound(cols / scale), qRound(rows / scale)));
-            transform->project(scaleImg, dst);
-            if (takeLargestScale && !dst.file.rects().empty())
-                return;
+        if (takeLargestScale) {
+            for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor)) {
+                Template scaleImg(dst.file, Mat());
+                scaleImg.file.set("scale", scale);
+                resize(src, scaleImg, Size(qRound(cols / scale), qRound(rows / scale)));
+                transform->project(scaleImg, dst);
+                if (!dst.file.rects().empty())
+                    return;
+            }
+            return;
+        }
+
+        QList<float> scales;
+        for (float scale = startScale; scale >= minScale; scale -= (1.0 - scaleFactor))
+            scales.append(scale);
+        if (scales.isEmpty())
+            return;
+
+        QVector<Template> levels(scales.size());
+        Scheduler::Group tasks;
+        for (int i=0; i<scales.size(); i++)
+            tasks.start(new ScaleTask(transform, src, scales[i], levels[i]));
+        tasks.wait();
+
+        // Each level starts from the rects of src, so only the ones after them are new
+        QList<QRectF> rects = src.file.rects();
+        QList<float> confidences = src.file.getList<float>("Confidences", QList<float>());
+        const int previousRects = rects.size(), previousConfidences = confidences.size();
+        foreach (const Template &level, levels) {
+            rects.append(level.file.rects().mid(previousRects));
+            confidences.append(level.file.getList<float>("Confidences", QList<float>()).mid(previousConfidences));
         }
+        dst = levels.last();
+        dst.file.setRects(rects);
+        dst.file.setList<float>("Confidences", confidences);
     }
 
     void store(QDataStream &stream) const
@@ -18,6 +18,7 @@
 
 #include <openbr/plugins/openbr_internal.h>
 #include <openbr/core/common.h>
+#include <openbr/core/distance_sse.h>
 #include <openbr/core/opencvutils.h>
 
 using namespace cv;
@@ -30,13 +31,79 @@ QVector<Mat> ProductQuantizationLUTs;
 /*!
  * \ingroup distances
  * \brief Distance in a product quantized space \cite jegou11
+ *
+ * When comparing template lists, each query first copies the LUT entries for its own codes into a table of 256 entries per subspace,
+ * then targets are scored by summing table entries, 16 at a time from codes interleaved by subspace.
+ * With \em quantized the tables are rounded to 8 bits, trading some accuracy for a table a quarter of the size.
  * \author Josh Klontz \cite jklontz
  */
 class ProductQuantizationDistance : public UntrainableDistance
 {
     Q_OBJECT
     Q_PROPERTY(bool bayesian READ get_bayesian WRITE set_bayesian RESET reset_bayesian STORED false)
+    Q_PROPERTY(bool quantized READ get_quantized WRITE set_quantized RESET reset_quantized STORED false)
     BR_PROPERTY(bool, bayesian, false)
+    BR_PROPERTY(bool, quantized, false)
+
+    // Entries of the triangular LUT for each subspace code of the query
+    static void queryTable(const float *lut, const uchar *query, int subspaces, float *table)
+    {
+        for (int j=0; j<subspaces; j++) {
+            const float *subspaceLUT = lut + j*256*(256+1)/2;
+            const int q = query[j];
+            for (int c=0; c<256; c++) {
+                const int y = max(q, c);
+                const int x = min(q, c);
+                table[j*256 + c] = subspaceLUT[x + (y+1)*y/2];
+            }
+        }
+    }
+
+    bool compareBatch(const uchar *queries, const uchar *targets, int queryCount, int targetCount, size_t size, float *scores) const
+    {
+        if (size <= sizeof(quint16))
+            return false;
+
+        const int subspaces = size - sizeof(quint16);
+        const float *lut = (const float*)ProductQuantizationLUTs[*reinterpret_cast<const quint16*>(targets)].data;
+        const int padded = (targetCount + 15) / 16 * 16;
+
+        QVector<uchar> codes(padded * subspaces);
+        pq_interleave(targets + sizeof(quint16), targetCount, subspaces, size, codes.data());
+
+        QVector<float> table(subspaces * 256), distances(padded);
+        QVector<uchar> table8(subspaces * 256 + 3);
+        QVector<quint32> distances8(quantized ? padded : 0);
+        for (int i=0; i<queryCount; i++) {
+            queryTable(lut, queries + i*size + sizeof(quint16), subspaces, table.data());
+
+            if (quantized) {
+                // One step size for all subspaces, so the integer sums stay comparable
+                float bias = 0, step = 0;
+                QVector<float> minimums(subspaces);
+                for (int j=0; j<subspaces; j++) {
+                    const float *begin = table.data() + j*256;
+                    minimums[j] = *std::min_element(begin, begin + 256);
+                    bias += minimums[j];
+                    step = std::max(step, (*std::max_element(begin, begin + 256) - minimums[j]) / 255);
+                }
+                if (step == 0) step = 1;
+                for (int j=0; j<subspaces; j++)
+                    for (int c=0; c<256; c++)
+                        table8[j*256 + c] = uchar(qRound((table[j*256 + c] - minimums[j]) / step));
+
+                pq_scan(codes.data(), padded, subspaces, table8.data(), distances8.data());
+                for (int t=0; t<targetCount; t++)
+                    distances[t] = bias + distances8[t] * step;
+            } else {
+                pq_scan(codes.data(), padded, subspaces, table.data(), distances.data());
+            }
+
+            for (int t=0; t<targetCount; t++)
+                scores[i*targetCount + t] = bayesian ? distances[t] : -log(distances[t]+1);
+        }
+        return true;
+    }
 
     float compare(const Template &a, const Template &b) const
     {
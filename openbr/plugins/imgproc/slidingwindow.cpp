@@ -45,6 +45,13 @@ static float getAspectRatio(const TemplateList &data)
  * \ingroup transforms
  * \brief Applies a transform to a sliding window.
  *        Discards negative detections.
+ *
+ * The windows of an image are copied into the rows of one contiguous matrix and projected together with one call to br::Transform::project(const TemplateList&, TemplateList&),
+ * so they are evaluated in parallel, and by matrix-matrix products for transforms like PCA.
+ * With \em takeFirst, windows are evaluated in scan order a batch at a time, stopping after the first batch with a detection.
+ * Windows scoring at most \em threshold in one of the \em cascade transforms are rejected before the next one, ending with \em transform.
+ * Each stage is trained on the training samples accepted by the ones before it.
+ * Detections are written to the rects and \c Confidences of dst once all windows have been evaluated.
  * \author Austin Blanton \cite imaus10
  */
 class SlidingWindowTransform : public Transform
@@ -56,17 +63,85 @@ class SlidingWindowTransform : public Transform
     Q_PROPERTY(float threshold READ get_threshold WRITE set_threshold RESET reset_threshold STORED false)
     Q_PROPERTY(float stepFraction READ get_stepFraction WRITE set_stepFraction RESET reset_stepFraction STORED false)
     Q_PROPERTY(int ignoreBorder READ get_ignoreBorder WRITE set_ignoreBorder RESET reset_ignoreBorder STORED true)
+    Q_PROPERTY(QList<br::Transform*> cascade READ get_cascade WRITE set_cascade RESET reset_cascade STORED false)
     BR_PROPERTY(br::Transform *, transform, NULL)
     BR_PROPERTY(int, windowWidth, 24)
     BR_PROPERTY(bool, takeFirst, false)
     BR_PROPERTY(float, threshold, 0)
     BR_PROPERTY(float, stepFraction, 0.25)
     BR_PROPERTY(int, ignoreBorder, 0)
+    BR_PROPERTY(QList<br::Transform*>, cascade, QList<br::Transform*>())
 
 private:
     int windowHeight;
     bool skipProject;
 
+    QList<Transform*> stages() const
+    {
+        return QList<Transform*>(cascade) << transform;
+    }
+
+    static const int FirstBatchSize = 64;
+
+    // Windows at positions [begin, end), each a row of one contiguous matrix so stages can project them together
+    TemplateList pack(const Template &src, const QList<QPointF> &positions, int begin, int end, int windowWidth, int windowHeight) const
+    {
+        const int width = windowWidth - ignoreBorder * 2;
+        const int height = windowHeight - ignoreBorder * 2;
+        const int channels = src.m().channels();
+        Mat packed(end - begin, width * height * channels, CV_MAKETYPE(src.m().depth(), 1));
+
+        TemplateList windows;
+        windows.reserve(end - begin);
+        for (int i=begin; i<end; i++) {
+            Mat window = packed.row(i - begin).reshape(channels, height);
+            Mat(src, Rect(positions[i].x() + ignoreBorder, positions[i].y() + ignoreBorder, width, height)).copyTo(window);
+            Template t(src.file, src);
+            t.replace(0, window);
+            windows.append(t);
+        }
+        return windows;
+    }
+
+    // Indices of the candidate windows scoring above threshold, in order, and their scores
+    QList<int> accept(const Transform *stage, const TemplateList &windows, const QList<int> &candidates, QVector<float> &confidences) const
+    {
+        TemplateList input;
+        input.reserve(candidates.size());
+        foreach (int i, candidates)
+            input.append(windows[i]);
+
+        TemplateList output;
+        stage->project(input, output);
+
+        // Failed windows may be moved to the end, in which case they are projected again one at a time to match them up
+        bool aligned = (output.size() == input.size());
+        for (int i=0; aligned && (i<output.size()); i++)
+            aligned = !output[i].file.fte;
+        if (!aligned) {
+            output.clear();
+            foreach (const Template &window, input) {
+                TemplateList result;
+                stage->project(TemplateList() << window, result);
+                output.append((result.size() == 1) ? result.first() : Template(window.file));
+                if (result.size() != 1)
+                    output.last().file.fte = true;
+            }
+        }
+
+        QList<int> accepted;
+        for (int i=0; i<output.size(); i++) {
+            if (output[i].file.fte || output[i].isEmpty() || output[i].m().empty())
+                continue;
+            const float conf = output[i].m().at<float>(0);
+            if (conf > threshold) {
+                accepted.append(candidates[i]);
+                confidences[candidates[i]] = conf;
+            }
+        }
+        return accepted;
+    }
+
     void train(const TemplateList &data)
     {
         skipProject = true;
@@ -75,28 +150,44 @@ private:
             aspectRatio = getAspectRatio(data);
         windowHeight = qRound(windowWidth / aspectRatio);
 
-        if (transform->trainable) {
-            TemplateList dataOut = data;
-            if (ignoreBorder > 0) {
-                for (int i = 0; i < dataOut.size(); i++) {
-                    Template t = dataOut[i];
-                    Mat m = t.m();
-                    dataOut.replace(i,Template(t.file, Mat(m,Rect(ignoreBorder,ignoreBorder,m.cols - ignoreBorder * 2, m.rows - ignoreBorder * 2))));
-                }
+        TemplateList dataOut = data;
+        if (ignoreBorder > 0) {
+            for (int i = 0; i < dataOut.size(); i++) {
+                Template t = dataOut[i];
+                Mat m = t.m();
+                dataOut.replace(i,Template(t.file, Mat(m,Rect(ignoreBorder,ignoreBorder,m.cols - ignoreBorder * 2, m.rows - ignoreBorder * 2))));
             }
-            transform->train(dataOut);
+        }
+
+        QList<int> remaining;
+        for (int i=0; i<dataOut.size(); i++)
+            remaining.append(i);
+        QVector<float> confidences(dataOut.size());
+        foreach (Transform *stage, stages()) {
+            if (stage->trainable) {
+                TemplateList stageData;
+                foreach (int i, remaining)
+                    stageData.append(dataOut[i]);
+                stage->train(stageData);
+            }
+            if (stage != transform)
+                remaining = accept(stage, dataOut, remaining, confidences);
         }
     }
 
     void store(QDataStream &stream) const
     {
         transform->store(stream);
+        foreach (const Transform *stage, cascade)
+            stage->store(stream);
         stream << windowHeight;
     }
 
     void load(QDataStream &stream)
     {
         transform->load(stream);
+        foreach (Transform *stage, cascade)
+            stage->load(stream);
         stream >> windowHeight;
     }
 
@@ -116,25 +207,45 @@ private:
             return;
         }
 
-        Template windowTemplate(src.file, src);
-        QList<float> confidences = dst.file.getList<float>("Confidences", QList<float>());
-        for (float y = 0; y + windowHeight < src.m().rows; y += windowHeight*stepFraction) {
-            for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction) {
-                Mat windowMat(src, Rect(x + ignoreBorder, y + ignoreBorder, windowWidth - ignoreBorder * 2, windowHeight - ignoreBorder * 2));
-                windowTemplate.replace(0,windowMat);
-                Template detect;
-                transform->project(windowTemplate, detect);
-                float conf = detect.m().at<float>(0);
-
-                // the result will be in the Label
-                if (conf > threshold) {
-                    dst.file.appendRect(QRectF(x*scale, y*scale, windowWidth*scale, windowHeight*scale));
-                    confidences.append(conf);
-                    if (takeFirst)
-                        return;
-                }
+        QList<QPointF> positions; // Scan order
+        for (float y = 0; y + windowHeight < src.m().rows; y += windowHeight*stepFraction)
+            for (float x = 0; x + windowWidth < src.m().cols; x += windowWidth*stepFraction)
+                positions.append(QPointF(x, y));
+
+        // Without takeFirst all windows are one batch
+        const int batchSize = takeFirst ? FirstBatchSize : std::max(1, positions.size());
+        QList<int> candidates;
+        QVector<float> scores(positions.size());
+        for (int begin=0; (begin<positions.size()) && candidates.isEmpty(); begin+=batchSize) {
+            const int end = std::min(begin+batchSize, positions.size());
+            const TemplateList windows = pack(src, positions, begin, end, windowWidth, windowHeight);
+
+            QList<int> remaining;
+            for (int i=0; i<windows.size(); i++)
+                remaining.append(i);
+            QVector<float> windowScores(windows.size());
+            foreach (const Transform *stage, stages()) {
+                if (remaining.isEmpty())
+                    break;
+                remaining = accept(stage, windows, remaining, windowScores);
+            }
+
+            foreach (int i, remaining) {
+                candidates.append(begin + i);
+                scores[begin + i] = windowScores[i];
             }
         }
+
+        if (takeFirst && (candidates.size() > 1))
+            candidates = candidates.mid(0, 1);
+
+        QList<QRectF> rects = dst.file.rects();
+        QList<float> confidences = dst.file.getList<float>("Confidences", QList<float>());
+        foreach (int i, candidates) {
+            rects.append(QRectF(positions[i].x()*scale, positions[i].y()*scale, windowWidth*scale, windowHeight*scale));
+            confidences.append(scores[i]);
+        }
+        dst.file.setRects(rects);
         dst.file.setList<float>("Confidences", confidences);
     }
 };
@@ -35,7 +35,17 @@ class OpenTransform : public UntrainableMetaTransform
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
-        if (src.empty()) {
+
+        // Image files read ahead by Stream are decoded like DefaultFormat reads them, or read again if that fails
+        Mat prefetched;
+        if (src.file.contains("ReadAhead")) {
+            dst.file.remove("ReadAhead");
+            prefetched = imdecode(src.m(), IMREAD_COLOR);
+        }
+
+        if (!prefetched.empty()) {
+            dst += prefetched;
+        } else if (src.empty() || src.file.contains("ReadAhead")) {
             if (Globals->verbose)
                 qDebug("Opening %s", qPrintable(src.file.flat()));
 
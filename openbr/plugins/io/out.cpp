@@ -45,15 +45,22 @@ class OutputTransform : public TimeVaryingTransform
         foreach (const Template &t, dst) {
             bool fte = t.file.getBool("FTE") || t.file.fte;
 
-            for (int i=0; i < scoresPerMat; i++) {
-                output->setRelative(fte ? -std::numeric_limits<float>::max() : t.m().at<float>(0, i), currentRow, currentCol);
-
-                // row-major input
-                if (!transposeMode)
-                    currentCol++;
-                // col-major input
-                else
+            // row-major input
+            if (!transposeMode) {
+                if (fte) {
+                    const QVector<float> missing(scoresPerMat, -std::numeric_limits<float>::max());
+                    output->setRow(missing.constData(), scoresPerMat, currentRow, currentCol);
+                } else {
+                    output->setRow(t.m().ptr<float>(0), scoresPerMat, currentRow, currentCol);
+                }
+                currentCol += scoresPerMat;
+            }
+            // col-major input
+            else {
+                for (int i=0; i < scoresPerMat; i++) {
+                    output->setRelative(fte ? -std::numeric_limits<float>::max() : t.m().at<float>(0, i), currentRow, currentCol);
                     currentRow++;
+                }
             }
             // filled in a row, advance to the next, reset column position
             if (!transposeMode) {
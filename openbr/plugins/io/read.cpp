@@ -50,6 +50,7 @@ private:
     void project(const Template &src, Template &dst) const
     {
         dst.file = src.file;
+        dst.file.remove("ReadAhead"); // Set by Stream on the file read into src, which is decoded like imread() reads it
         if (Globals->verbose)
             qDebug("Opening %s", qPrintable(src.file.flat()));
 
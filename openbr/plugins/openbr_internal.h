@@ -455,6 +455,12 @@ void applyAdditionalProperties(const File &temp, Transform *target);
 
 inline void splitFTEs(TemplateList &src, TemplateList  &ftes)
 {
+    int first = 0;
+    while ((first < src.size()) && !src.at(first).file.fte)
+        first++;
+    if (first == src.size())
+        return; // No FTEs, leave the list shared
+
     TemplateList active = src;
     src.clear();
 
@@ -65,6 +65,17 @@ class bestOutput : public Output
             lock.unlock();
         }
     }
+
+    void setRange(const float *values, int count, int i, int j)
+    {
+        // Only the best value of the row is a candidate
+        int best = -1;
+        for (int k=0; k<count; k++)
+            if ((!selfSimilar || (i != j+k)) && ((best == -1) || (values[k] > values[best])))
+                best = k;
+        if (best != -1)
+            set(values[best], i, j+best);
+    }
 };
 
 BR_REGISTER(Output, bestOutput)
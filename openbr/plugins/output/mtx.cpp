@@ -15,7 +15,7 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include <openbr/plugins/openbr_internal.h>
-#include <openbr/core/qtutils.h>
+#include <openbr/core/bee.h>
 
 namespace br
 {
@@ -34,8 +34,9 @@ class mtxOutput : public Output
     BR_PROPERTY(QString, targetGallery, "Unknown_Target")
     BR_PROPERTY(QString, queryGallery, "Unknown_Query")
 
-    int headerSize, rowBlock, columnBlock;
+    int rowBlock, columnBlock;
     cv::Mat blockScores;
+    QScopedPointer<BEE::MatrixWriter> writer;
 
     ~mtxOutput()
     {
@@ -45,29 +46,8 @@ class mtxOutput : public Output
     void setBlock(int rowBlock, int columnBlock)
     {
         if ((rowBlock == 0) && (columnBlock == 0)) {
-            // Initialize the file
-            QFile f(file);
-            QtUtils::touchDir(f);
-            if (!f.open(QFile::WriteOnly))
-                qFatal("Unable to open %s for writing.", qPrintable(file));
-            const int endian = 0x12345678;
-            QByteArray header;
-            header.append("S2\n");
-            header.append(qPrintable(targetGallery));
-            header.append("\n");
-            header.append(qPrintable(queryGallery));
-            header.append("\nMF ");
-            header.append(qPrintable(QString::number(queryFiles.size())));
-            header.append(" ");
-            header.append(qPrintable(QString::number(targetFiles.size())));
-            header.append(" ");
-            header.append(QByteArray((const char*)&endian, 4));
-            header.append("\n");
-            headerSize = f.write(header);
-            const float defaultValue = -std::numeric_limits<float>::max();
-            for (int i=0; i<targetFiles.size()*queryFiles.size(); i++)
-                f.write((const char*)&defaultValue, 4);
-            f.close();
+            // Initialize the file, blocks of full rows arriving in order are appended to it
+            writer.reset(new BEE::MatrixWriter(file, queryFiles.size(), targetFiles.size(), CV_32FC1, targetGallery, queryGallery));
         } else {
             writeBlock();
         }
@@ -86,6 +66,11 @@ class mtxOutput : public Output
         blockScores.at<float>(i,j) = value;
     }
 
+    void setRow(const float *values, int count, int i, int j)
+    {
+        memcpy(blockScores.ptr<float>(i) + j, values, count * sizeof(float));
+    }
+
     void set(float value, int i, int j)
     {
         (void) value; (void) i; (void) j;
@@ -94,14 +79,8 @@ class mtxOutput : public Output
 
     void writeBlock()
     {
-        QFile f(file);
-        if (!f.open(QFile::ReadWrite))
-            qFatal("Unable to open %s for modifying.", qPrintable(file));
-        for (int i=0; i<blockScores.rows; i++) {
-            f.seek(headerSize + sizeof(float)*(quint64(rowBlock*this->blockRows+i)*targetFiles.size()+(columnBlock*this->blockCols)));
-            f.write((const char*)blockScores.row(i).data, sizeof(float)*blockScores.cols);
-        }
-        f.close();
+        if (writer.isNull()) return;
+        writer->write(blockScores, rowBlock*this->blockRows, columnBlock*this->blockCols);
     }
 };
 
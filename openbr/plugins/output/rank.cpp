@@ -46,7 +46,7 @@ class rankOutput : public MatrixOutput
             foreach (const Pair &pair, Common::Sort(OpenCVUtils::matrixToVector<float>(data.row(i)), true)) {
                 if (Globals->crossValidate > 0 ? (targetFiles[pair.second].get<int>("Partition",-1) == -1 || targetFiles[pair.second].get<int>("Partition",-1) == queryFiles[i].get<int>("Partition",-1)) : true) {
                     if (QString(targetFiles[pair.second]) != QString(queryFiles[i])) {
-                        if (targetFiles[pair.second].get<QString>("Label") == queryFiles[i].get<QString>("Label")) {
+                        if (targetFiles[pair.second].get<QString>(Metadata::Label) == queryFiles[i].get<QString>(Metadata::Label)) {
                             ranks.append(rank);
                             positions.append(pair.second);
                             scores.append(pair.first);
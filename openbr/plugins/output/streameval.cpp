@@ -0,0 +1,122 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/bee.h>
+#include <openbr/core/eval.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief Evaluate scores as they are computed, without storing the similarity matrix.
+ *
+ * The streaming counterpart of evalOutput for comparisons too large to hold in memory,
+ * e.g. <tt>br -compare target.gal query.gal results.streamEval</tt> writes \c results.csv.
+ * The mask is derived from the \c Label of each file, as in BEE::makeMask() for partition 0.
+ * \see br::StreamingEvaluation for memory use and accuracy.
+ */
+class streamEvalOutput : public Output
+{
+    Q_OBJECT
+
+    QScopedPointer<StreamingEvaluation> evaluation;
+    QVector<int> targetNames, queryNames; // Interned file names, to detect self comparisons
+    QVector<int> targetLabels, queryLabels; // Interned labels, -1 if unlabeled
+    QList<int> targetPartitions, queryPartitions;
+    QList<bool> targetOnly;
+    QMutex lock;
+
+    ~streamEvalOutput()
+    {
+        if (evaluation.isNull()) return;
+        const QString csv = QString(file.name).replace(".streamEval", ".csv");
+        evaluation->write(csv, targetFiles.size());
+    }
+
+    static QVector<int> intern(const QStringList &strings, QHash<QString,int> &ids, bool unlabeled)
+    {
+        QVector<int> result; result.reserve(strings.size());
+        foreach (const QString &string, strings) {
+            if (unlabeled && (string == "-1")) {
+                result.append(-1);
+                continue;
+            }
+            QHash<QString,int>::const_iterator it = ids.constFind(string);
+            if (it == ids.constEnd()) it = ids.insert(string, ids.size());
+            result.append(it.value());
+        }
+        return result;
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+
+        QHash<QString,int> names, labels;
+        targetNames = intern(targetFiles.names(), names, false);
+        queryNames = intern(queryFiles.names(), names, false);
+        targetLabels = intern(File::get<QString>(targetFiles, "Label", "-1"), labels, true);
+        queryLabels = intern(File::get<QString>(queryFiles, "Label", "-1"), labels, true);
+        targetPartitions = targetFiles.crossValidationPartitions();
+        queryPartitions = queryFiles.crossValidationPartitions();
+        targetOnly = File::get<bool>(queryFiles, "targetOnly", false);
+
+        evaluation.reset(new StreamingEvaluation(queryFiles.size()));
+    }
+
+    BEE::MaskValue mask(int i, int j) const
+    {
+        if      (queryNames[i] == targetNames[j])  return BEE::DontCare;
+        else if (targetOnly[i])                    return BEE::DontCare;
+        else if (queryLabels[i] == -1)             return BEE::DontCare;
+        else if (targetLabels[j] == -1)            return BEE::DontCare;
+        else if (queryPartitions[i] != 0)          return BEE::DontCare;
+        else if (targetPartitions[j] == -1)        return BEE::NonMatch;
+        else if (targetPartitions[j] != 0)         return BEE::DontCare;
+        else if (queryLabels[i] == targetLabels[j]) return BEE::Match;
+        else                                       return BEE::NonMatch;
+    }
+
+    void set(float value, int i, int j)
+    {
+        const BEE::MaskValue maskValue = mask(i, j);
+        if (maskValue == BEE::DontCare) return;
+
+        QMutexLocker locker(&lock);
+        evaluation->add(value, maskValue, i);
+    }
+
+    // Masks the row before taking the lock once for all of it
+    void setRange(const float *values, int count, int i, int j)
+    {
+        QVector<uchar> masks(count);
+        for (int k=0; k<count; k++)
+            masks[k] = mask(i, j+k);
+
+        QMutexLocker locker(&lock);
+        for (int k=0; k<count; k++)
+            if (masks[k] != BEE::DontCare)
+                evaluation->add(values[k], masks[k], i);
+    }
+};
+
+BR_REGISTER(Output, streamEvalOutput)
+
+} // namespace br
+
+#include "output/streameval.moc"
@@ -106,6 +106,18 @@ class tailOutput : public Output
         lastValue = comparisons.last().value;
         comparisonsLock.unlock();
     }
+
+    void setRange(const float *values, int count, int i, int j)
+    {
+        // Only the lower triangle of self similar matrices
+        if (selfSimilar)
+            count = std::min(count, i - j);
+
+        // Most values fail the criteria, check them without a call per value
+        for (int k=0; k<count; k++)
+            if ((values[k] >= threshold) || (values[k] > lastValue) || (comparisons.size() < atLeast))
+                set(values[k], i, j+k);
+    }
 };
 
 BR_REGISTER(Output, tailOutput)
@@ -0,0 +1,154 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * Copyright 2012 The MITRE Corporation                                      *
+ *                                                                           *
+ * Licensed under the Apache License, Version 2.0 (the "License");           *
+ * you may not use this file except in compliance with the License.          *
+ * You may obtain a copy of the License at                                   *
+ *                                                                           *
+ *     http://www.apache.org/licenses/LICENSE-2.0                            *
+ *                                                                           *
+ * Unless required by applicable law or agreed to in writing, software       *
+ * distributed under the License is distributed on an "AS IS" BASIS,         *
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.  *
+ * See the License for the specific language governing permissions and       *
+ * limitations under the License.                                            *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <functional>
+
+#include <openbr/plugins/openbr_internal.h>
+#include <openbr/core/qtutils.h>
+
+namespace br
+{
+
+/*!
+ * \ingroup outputs
+ * \brief The \em k highest scoring targets for each query.
+ *
+ * Only a bounded heap of candidates is kept for each query,
+ * so memory grows with the number of queries times \em k rather than the number of comparisons.
+ * Scores below a running per-query threshold are rejected without locking,
+ * and queries are guarded by a small set of striped locks so rows never contend on a global lock.
+ *
+ * Candidate lists are written in rank order when the output is destroyed, according to \em format:
+ * - \c csv (default) One <tt>Query,Rank,Value,Target</tt> line per candidate.
+ * - \c json One JSON object per query, newline-separated.
+ * - \c bin For each query a \c qint32 candidate count followed by \c qint32 target index and \c float score pairs, in QDataStream format.
+ */
+class topKOutput : public Output
+{
+    Q_OBJECT
+
+    typedef QPair<float,int> Candidate; // Score, target index
+    static const int Stripes = 64;
+
+    int k;
+    QString format;
+    QVector< QVector<Candidate> > heaps; // Min-heaps, so the lowest retained score is at the front
+    QVector<QAtomicInt> thresholds; // Bits of the lowest retained score once a heap is full
+    QMutex locks[Stripes];
+
+    static int toBits(float value)
+    {
+        int bits;
+        memcpy(&bits, &value, sizeof(float));
+        return bits;
+    }
+
+    static float fromBits(int bits)
+    {
+        float value;
+        memcpy(&value, &bits, sizeof(float));
+        return value;
+    }
+
+    ~topKOutput()
+    {
+        if (file.isNull() || heaps.isEmpty()) return;
+
+        for (int i=0; i<heaps.size(); i++)
+            std::sort_heap(heaps[i].begin(), heaps[i].end(), std::greater<Candidate>());
+
+        if (format == "bin") {
+            QByteArray data;
+            QDataStream stream(&data, QFile::WriteOnly);
+            stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+            foreach (const QVector<Candidate> &candidates, heaps) {
+                stream << qint32(candidates.size());
+                foreach (const Candidate &candidate, candidates)
+                    stream << qint32(candidate.second) << candidate.first;
+            }
+            QtUtils::writeFile(file, data);
+        } else if (format == "json") {
+            QStringList lines; lines.reserve(heaps.size());
+            for (int i=0; i<heaps.size(); i++) {
+                QJsonArray candidates;
+                foreach (const Candidate &candidate, heaps[i]) {
+                    QJsonObject object;
+                    object.insert("Target", targetFiles[candidate.second].name);
+                    object.insert("Value", candidate.first);
+                    candidates.append(object);
+                }
+                QJsonObject object;
+                object.insert("Query", queryFiles[i].name);
+                object.insert("Candidates", candidates);
+                lines.append(QJsonDocument(object).toJson(QJsonDocument::Compact));
+            }
+            QtUtils::writeFile(file, lines);
+        } else if (format == "csv") {
+            QStringList lines;
+            lines.append("Query,Rank,Value,Target");
+            for (int i=0; i<heaps.size(); i++)
+                for (int j=0; j<heaps[i].size(); j++)
+                    lines.append(queryFiles[i].name + "," + QString::number(j+1) + "," + QString::number(heaps[i][j].first) + "," + targetFiles[heaps[i][j].second].name);
+            QtUtils::writeFile(file, lines);
+        } else {
+            qFatal("Unsupported topK format: %s", qPrintable(format));
+        }
+    }
+
+    void initialize(const FileList &targetFiles, const FileList &queryFiles)
+    {
+        Output::initialize(targetFiles, queryFiles);
+        k = std::max(1, file.get<int>("k", 20));
+        format = file.get<QString>("format", "csv");
+        heaps = QVector< QVector<Candidate> >(queryFiles.size());
+        thresholds = QVector<QAtomicInt>(queryFiles.size(), QAtomicInt(toBits(-std::numeric_limits<float>::max())));
+    }
+
+    void set(float value, int i, int j)
+    {
+        // Return early for self similar matrices
+        if (selfSimilar && (i == j)) return;
+
+        // The threshold only increases, so a stale read just means taking the lock below
+        if (value <= fromBits(thresholds.at(i).load())) return;
+
+        QMutexLocker locker(&locks[i % Stripes]);
+        QVector<Candidate> &heap = heaps[i];
+        if (heap.size() < k) {
+            heap.append(Candidate(value, j));
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+        } else if (value > heap.first().first) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+            heap.last() = Candidate(value, j);
+            std::push_heap(heap.begin(), heap.end(), std::greater<Candidate>());
+        } else {
+            return;
+        }
+
+        if (heap.size() == k)
+            thresholds[i].store(toBits(heap.first().first));
+    }
+};
+
+BR_REGISTER(Output, topKOutput)
+
+} // namespace br
+
+#include "output/topk.moc"
@@ -34,7 +34,7 @@ class DropFrames : public UntrainableMetaTransform
 
     void project(const TemplateList &src, TemplateList &dst) const
     {
-        if (src.first().file.get<int>("FrameNumber") % n != 0) return;
+        if (src.first().file.get<int>(Metadata::FrameNumber) % n != 0) return;
         dst = src;
     }
 
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+if [ ! -f benchmarkProcessWrapper.sh ]; then
+  echo "Run this script from the scripts folder!"
+  exit
+fi
+
+if ! hash br 2>/dev/null; then
+  echo "Can't find 'br'. Did you forget to build and install OpenBR? Here's some help: http://openbiometrics.org/doxygen/latest/installation.html"
+  exit
+fi
+
+# Compare ProcessWrapper throughput with matrices sent through shared memory and serialized over the socket
+
+./downloadDatasets.sh
+
+ALGORITHM='Open+Cvt(Gray)+Cascade(FrontalFace)+ASEFEyes+Affine(128,128,0.33,0.45)'
+SIGSET=../data/MEDS/sigset/MEDS_frontal_all.xml
+TEMPLATES=$(grep -c "<presentation" ${SIGSET})
+
+echo "concurrentCount,sharedMemory,templates/s"
+for COUNT in $(seq 1 16); do
+  for SHARED in true false; do
+    START=$(date +%s.%N)
+    br -quiet -algorithm "ProcessWrapper(${ALGORITHM},concurrentCount=${COUNT},sharedMemory=${SHARED})" -path ../data/MEDS/img -enroll ${SIGSET} benchmark.gal
+    END=$(date +%s.%N)
+    echo "${COUNT},${SHARED},$(echo "${TEMPLATES} / (${END} - ${START})" | bc -l)"
+    rm -f benchmark.gal
+  done
+done